@@ -0,0 +1,155 @@
+/*
+ * adapt.c - adaptive maximum cacheable object size
+ */
+#include "adapt.h"
+#include "stats.h"
+
+/* Shared by every process, like the cache and the counters */
+struct adapt_region {
+    adapt_state_t state;
+    uint64_t next_decision;             /* stats_now_usec() of the next one */
+    uint32_t ghost[ADAPT_GHOST];        /* Fingerprints of keys fetched, by hash */
+};
+
+static struct adapt_region *region;
+static cache_t *adapt_cache;
+
+/* Map the shared state; must run before workers are forked */
+void adapt_init(cache_t *cache) {
+    region = Mmap(NULL, sizeof(struct adapt_region), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(region, 0, sizeof(struct adapt_region));
+    adapt_cache = cache;
+}
+
+/* Core mode keeps its caches per core, which this does not steer */
+void adapt_configure(config_t *config) {
+    region->state.min = config->max_object_min;
+    region->state.max = config->max_object_max < config->cache_size
+        ? config->max_object_max : config->cache_size;
+    __atomic_store_n(&region->next_decision, stats_now_usec() + ADAPT_INTERVAL * 1000000ULL,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&region->state.enabled, config->max_object_adapt && !config->cores,
+                     __ATOMIC_RELAXED);
+}
+
+/* Largest object in class */
+size_t adapt_class_limit(int class) {
+    return (size_t)1024 << class;
+}
+
+static int size_class(size_t size) {
+    int class = 0;
+
+    while (class < ADAPT_CLASSES - 1 && size > adapt_class_limit(class))
+        class++;
+    return class;
+}
+
+static void format_size(char *buf, size_t size) {
+    if (size >= (1 << 20) && size % (1 << 20) == 0)
+        sprintf(buf, "%luM", (unsigned long)(size >> 20));
+    else if (size >= 1024 && size % 1024 == 0)
+        sprintf(buf, "%luK", (unsigned long)(size >> 10));
+    else
+        sprintf(buf, "%lu", (unsigned long)size);
+}
+
+/*
+ * Score each limit, move max_object_size if one is clearly better, then
+ * age the histograms. If the cache refuses the new limit, the last
+ * decision stands (and the histograms are kept for the next try).
+ */
+static void decide(void) {
+    adapt_state_t *s = &region->state;
+    double footprint = 0, value = 0;
+    uint64_t samples = 0, score[ADAPT_CLASSES];
+    cache_stats_t cs;
+    int class, best = -1, cur;
+    char cur_name[32], best_name[32];
+
+    cache_get_stats(adapt_cache, &cs);
+    for (class = 0; class < ADAPT_CLASSES; class++) {
+        samples += s->seen[class] + s->reref[class];
+        footprint += s->seen_bytes[class];
+        value += s->reref_bytes[class];
+        score[class] = footprint > cs.budget ? value * cs.budget / footprint : value;
+        if (adapt_class_limit(class) >= s->min && adapt_class_limit(class) <= s->max &&
+            (best < 0 || score[class] > score[best]))
+            best = class;
+    }
+    cur = size_class(cs.max_object);
+    format_size(cur_name, cs.max_object);
+    format_size(best_name, best >= 0 ? adapt_class_limit(best) : 0);
+
+    if (samples < ADAPT_MIN_SAMPLES) {
+        snprintf(s->reason, sizeof(s->reason), "kept %s: %lu samples, need %d",
+                 cur_name, (unsigned long)samples, ADAPT_MIN_SAMPLES);
+    } else if (best < 0 || adapt_class_limit(best) == cs.max_object ||
+               score[best] * 100 <= score[cur] * (100 + ADAPT_GAIN)) {
+        snprintf(s->reason, sizeof(s->reason), "kept %s: %lu expected byte hits, best %s has %lu",
+                 cur_name, (unsigned long)score[cur], best_name,
+                 (unsigned long)(best >= 0 ? score[best] : 0));
+    } else if (cache_set_limits(adapt_cache, cs.budget, adapt_class_limit(best), cs.policy) == 0) {
+        snprintf(s->reason, sizeof(s->reason), "%s %s to %s: %lu expected byte hits instead of %lu",
+                 best > cur ? "raised" : "lowered", cur_name, best_name,
+                 (unsigned long)score[best], (unsigned long)score[cur]);
+        STAT_ADD(adapt_changes, 1);
+    } else {
+        fprintf(stderr, "adapt: could not change max_object_size from %s to %s: %s\n",
+                cur_name, best_name, strerror(errno));
+        return;
+    }
+    memcpy(s->score, score, sizeof(score));
+    s->decided = time(NULL);
+    STAT_ADD(adapt_decisions, 1);
+    if (samples < ADAPT_MIN_SAMPLES)
+        return;
+
+    for (class = 0; class < ADAPT_CLASSES; class++) {
+        s->seen[class] /= 2;
+        s->seen_bytes[class] /= 2;
+        s->reref[class] /= 2;
+        s->reref_bytes[class] /= 2;
+    }
+}
+
+/*
+ * adapt_record - Count a reference to the object under key, of size
+ *     bytes: a hit, or a complete response fetched from the origin.
+ *     Takes a decision if one is due.
+ */
+void adapt_record(const char *key, size_t size, int hit) {
+    adapt_state_t *s = &region->state;
+    int class = size_class(size), first = 0;
+    uint64_t hash, now, next;
+    uint32_t fingerprint;
+
+    if (!__atomic_load_n(&s->enabled, __ATOMIC_RELAXED))
+        return;
+    if (!hit) {
+        hash = cache_key_hash(key);
+        fingerprint = (uint32_t)(hash >> 32) | 1;
+        first = __atomic_exchange_n(&region->ghost[hash % ADAPT_GHOST], fingerprint,
+                                    __ATOMIC_RELAXED) != fingerprint;
+    }
+    if (first) {
+        __atomic_fetch_add(&s->seen[class], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->seen_bytes[class], size, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&s->reref[class], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->reref_bytes[class], size, __ATOMIC_RELAXED);
+    }
+
+    /* Whoever moves the deadline on takes the decision */
+    now = stats_now_usec();
+    next = __atomic_load_n(&region->next_decision, __ATOMIC_RELAXED);
+    if (now >= next && __atomic_compare_exchange_n(&region->next_decision, &next,
+                                                   now + ADAPT_INTERVAL * 1000000ULL, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        decide();
+}
+
+void adapt_get_state(adapt_state_t *state) {
+    memcpy(state, &region->state, sizeof(adapt_state_t));
+}
@@ -0,0 +1,53 @@
+/*
+ * adapt.h - adaptive maximum cacheable object size
+ *
+ * With max_object_adapt on, each complete response fetched and each hit
+ * is counted by size class in histograms shared by all processes:
+ * objects seen for the first time, and references to objects seen
+ * before (hits, and misses on objects evicted or too big to keep). A
+ * small table of key fingerprints tells the two apart.
+ *
+ * Every ADAPT_INTERVAL seconds the process that notices takes a
+ * decision. Caching objects up to a class's limit would return the
+ * re-referenced bytes of that class and those below it, scaled down
+ * when their distinct bytes exceed the cache budget. The limit with
+ * the most expected byte hits, within [max_object_min, max_object_max],
+ * becomes max_object_size if it beats the current one by ADAPT_GAIN
+ * percent; then the histograms are halved, so old traffic fades. The
+ * admin "adapt" command shows the histograms, each limit's score and
+ * the reason for the last decision.
+ */
+#ifndef __ADAPT_H__
+#define __ADAPT_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "config.h"
+#include <stdint.h>
+
+#define ADAPT_CLASSES     16        /* Objects up to 1K, 2K, ... 32M, and bigger */
+#define ADAPT_GHOST       (1 << 16) /* Key fingerprints kept to spot re-references */
+#define ADAPT_INTERVAL    10        /* Seconds between decisions */
+#define ADAPT_MIN_SAMPLES 200       /* Fewer in the histograms and nothing changes */
+#define ADAPT_GAIN        10        /* Percent more byte hits needed to move */
+
+/* A copy of the histograms and the last decision, for the admin socket */
+typedef struct {
+    int enabled;
+    size_t min, max;                    /* Bounds on the limit */
+    uint64_t seen[ADAPT_CLASSES];       /* First references, and their bytes */
+    uint64_t seen_bytes[ADAPT_CLASSES];
+    uint64_t reref[ADAPT_CLASSES];      /* Later references, and their bytes */
+    uint64_t reref_bytes[ADAPT_CLASSES];
+    uint64_t score[ADAPT_CLASSES];      /* Expected byte hits at each limit, last decision */
+    time_t decided;                     /* When, 0 for never */
+    char reason[160];
+} adapt_state_t;
+
+void adapt_init(cache_t *cache);
+void adapt_configure(config_t *config);
+void adapt_record(const char *key, size_t size, int hit);
+size_t adapt_class_limit(int class);
+void adapt_get_state(adapt_state_t *state);
+
+#endif /* __ADAPT_H__ */
@@ -0,0 +1,473 @@
+/*
+ * admin.c - admin socket thread and command interpreter
+ *
+ * Commands:
+ *
+ *   help                       List the commands
+ *   stats                      Proxy and cache counters
+ *   dump [N]                   Up to N cached objects, most recent first:
+ *                              <size> <hits> <age-seconds> <key>
+ *   lookup <key>               Whether key is cached, without touching it
+ *   purge <key> | purge all    Drop one object, or every object
+ *   set cache_size <size>      Resize the cache in place
+ *   set max_object_size <size>
+ *   set policy lru|fifo        Change the eviction policy
+ *   latency                    Latency percentiles and histogram per
+ *                              response size class:
+ *                              <class> n=<count> p50= p90= p99= <usec>:<count>...
+ *   classes                    Per cache class (see route's cache= option):
+ *                              <class> hits= misses= hit_ratio= entries=
+ *                              bytes= evictions=
+ *   cost                       While instrumented, what requests cost on
+ *                              average per route ("-" for none, "*" for
+ *                              all) and outcome:
+ *                              <route> <outcome> n= cpu_usec= lookup_cpu_usec=
+ *                              reads= writes= connects= bytes=
+ *   adapt                      Adaptive max_object_size: histograms per size
+ *                              limit, each limit's expected byte hits at the
+ *                              last decision, and why it was taken:
+ *                              <limit> seen= seen_bytes= reref= reref_bytes= score=
+ *   instrument on|off          Toggle the per-request access log
+ *   drain                      Stop accepting, finish requests, exit
+ *   quit                       Close this admin connection
+ *
+ * Settings changed here last until the next configuration reload. In
+ * core mode the cache is split into per-core shards this thread can't
+ * touch, so the cache commands (dump, lookup, purge, set) are refused
+ * and stats and classes leave out the cache's own counters.
+ */
+#include "admin.h"
+#include "config.h"
+#include "stats.h"
+#include "adapt.h"
+#include <sys/un.h>
+
+#define ADMIN_TIMEOUT 30     /* Seconds an idle admin client may hold the thread */
+#define DUMP_DEFAULT  100
+
+static int admin_fd = -1;
+static cache_t *admin_cache;         /* NULL in core mode */
+
+/* Growable reply buffer */
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} reply_t;
+
+static void reply_printf(reply_t *reply, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(reply->buf + reply->len, reply->cap - reply->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (reply->len + n < reply->cap) {
+            reply->len += n;
+            return;
+        }
+        reply->cap = 2 * (reply->cap + n);
+        reply->buf = Realloc(reply->buf, reply->cap);
+    }
+}
+
+static void cmd_stats(reply_t *reply) {
+    cache_stats_t cs;
+    uint64_t requests = STAT_GET(requests);
+
+    reply_printf(reply, "requests %lu\n", (unsigned long)requests);
+    reply_printf(reply, "hits %lu\n", (unsigned long)STAT_GET(hits));
+    reply_printf(reply, "misses %lu\n", (unsigned long)STAT_GET(misses));
+    reply_printf(reply, "errors %lu\n", (unsigned long)STAT_GET(errors));
+    reply_printf(reply, "bytes_out %lu\n", (unsigned long)STAT_GET(bytes_out));
+    reply_printf(reply, "client_aborts %lu\n", (unsigned long)STAT_GET(client_aborts));
+    reply_printf(reply, "aborts_cancelled %lu\n", (unsigned long)STAT_GET(aborts_cancelled));
+    reply_printf(reply, "aborts_finished %lu\n", (unsigned long)STAT_GET(aborts_finished));
+    reply_printf(reply, "abort_wasted_bytes %lu\n", (unsigned long)STAT_GET(abort_wasted_bytes));
+    reply_printf(reply, "abort_salvaged_bytes %lu\n", (unsigned long)STAT_GET(abort_salvaged_bytes));
+    reply_printf(reply, "abort_saved_bytes %lu\n", (unsigned long)STAT_GET(abort_saved_bytes));
+    reply_printf(reply, "zerocopy_sends %lu\n", (unsigned long)STAT_GET(zerocopy_sends));
+    reply_printf(reply, "zerocopy_bytes %lu\n", (unsigned long)STAT_GET(zerocopy_bytes));
+    reply_printf(reply, "zerocopy_copied %lu\n", (unsigned long)STAT_GET(zerocopy_copied));
+    reply_printf(reply, "zerocopy_stuck %lu\n", (unsigned long)STAT_GET(zerocopy_stuck));
+    reply_printf(reply, "sched_waits %lu\n", (unsigned long)STAT_GET(sched_waits));
+    reply_printf(reply, "sched_wait_usec %lu\n", (unsigned long)STAT_GET(sched_wait_usec));
+    reply_printf(reply, "sched_yields %lu\n", (unsigned long)STAT_GET(sched_yields));
+    reply_printf(reply, "shadow_sent %lu\n", (unsigned long)STAT_GET(shadow_sent));
+    reply_printf(reply, "shadow_dropped %lu\n", (unsigned long)STAT_GET(shadow_dropped));
+    reply_printf(reply, "shadow_errors %lu\n", (unsigned long)STAT_GET(shadow_errors));
+    reply_printf(reply, "shadow_mismatches %lu\n", (unsigned long)STAT_GET(shadow_mismatches));
+    reply_printf(reply, "shadow_usec %lu\n", (unsigned long)STAT_GET(shadow_usec));
+    reply_printf(reply, "shadow_primary_usec %lu\n", (unsigned long)STAT_GET(shadow_primary_usec));
+    reply_printf(reply, "core_local %lu\n", (unsigned long)STAT_GET(core_local));
+    reply_printf(reply, "core_handoffs %lu\n", (unsigned long)STAT_GET(core_handoffs));
+    reply_printf(reply, "core_mailed %lu\n", (unsigned long)STAT_GET(core_mailed));
+    reply_printf(reply, "parent_requests %lu\n", (unsigned long)STAT_GET(parent_requests));
+    reply_printf(reply, "parent_reused %lu\n", (unsigned long)STAT_GET(parent_reused));
+    reply_printf(reply, "parent_failovers %lu\n", (unsigned long)STAT_GET(parent_failovers));
+    reply_printf(reply, "parent_bypassed %lu\n", (unsigned long)STAT_GET(parent_bypassed));
+    reply_printf(reply, "parent_retries %lu\n", (unsigned long)STAT_GET(parent_retries));
+    reply_printf(reply, "pool_threads %lu\n", (unsigned long)STAT_GET(pool_threads));
+    reply_printf(reply, "pool_grows %lu\n", (unsigned long)STAT_GET(pool_grows));
+    reply_printf(reply, "pool_shrinks %lu\n", (unsigned long)STAT_GET(pool_shrinks));
+    reply_printf(reply, "pool_jobs %lu\n", (unsigned long)STAT_GET(pool_jobs));
+    reply_printf(reply, "pool_wait_usec %lu\n", (unsigned long)STAT_GET(pool_wait_usec));
+    reply_printf(reply, "pool_busy_usec %lu\n", (unsigned long)STAT_GET(pool_busy_usec));
+    reply_printf(reply, "pool_blocked_usec %lu\n", (unsigned long)STAT_GET(pool_blocked_usec));
+    reply_printf(reply, "adapt_decisions %lu\n", (unsigned long)STAT_GET(adapt_decisions));
+    reply_printf(reply, "adapt_changes %lu\n", (unsigned long)STAT_GET(adapt_changes));
+    reply_printf(reply, "mem_limit %lu\n", (unsigned long)STAT_GET(mem_limit));
+    reply_printf(reply, "mem_usage %lu\n", (unsigned long)STAT_GET(mem_usage));
+    reply_printf(reply, "mem_stalls %lu\n", (unsigned long)STAT_GET(mem_stalls));
+    reply_printf(reply, "mem_shrinks %lu\n", (unsigned long)STAT_GET(mem_shrinks));
+    reply_printf(reply, "mem_grows %lu\n", (unsigned long)STAT_GET(mem_grows));
+    reply_printf(reply, "vary_stores %lu\n", (unsigned long)STAT_GET(vary_stores));
+    reply_printf(reply, "vary_evictions %lu\n", (unsigned long)STAT_GET(vary_evictions));
+    reply_printf(reply, "vary_uncacheable %lu\n", (unsigned long)STAT_GET(vary_uncacheable));
+    reply_printf(reply, "esi_pages %lu\n", (unsigned long)STAT_GET(esi_pages));
+    reply_printf(reply, "esi_fragments %lu\n", (unsigned long)STAT_GET(esi_fragments));
+    reply_printf(reply, "esi_fragment_hits %lu\n", (unsigned long)STAT_GET(esi_fragment_hits));
+    reply_printf(reply, "esi_fragment_errors %lu\n", (unsigned long)STAT_GET(esi_fragment_errors));
+    reply_printf(reply, "redirects_cached %lu\n", (unsigned long)STAT_GET(redirects_cached));
+    reply_printf(reply, "redirects_followed %lu\n", (unsigned long)STAT_GET(redirects_followed));
+    reply_printf(reply, "h2_connections %lu\n", (unsigned long)STAT_GET(h2_connections));
+    reply_printf(reply, "h2_streams %lu\n", (unsigned long)STAT_GET(h2_streams));
+    reply_printf(reply, "h2_cancelled %lu\n", (unsigned long)STAT_GET(h2_cancelled));
+    reply_printf(reply, "h2_errors %lu\n", (unsigned long)STAT_GET(h2_errors));
+    reply_printf(reply, "h2_timeouts %lu\n", (unsigned long)STAT_GET(h2_timeouts));
+    reply_printf(reply, "instrument %s\n", STAT_GET(instrument) ? "on" : "off");
+    if (!admin_cache)
+        return;
+    cache_get_stats(admin_cache, &cs);
+    reply_printf(reply, "cache_budget %lu\n", (unsigned long)cs.budget);
+    reply_printf(reply, "cache_size %lu\n", (unsigned long)cs.current_size);
+    reply_printf(reply, "cache_max_object %lu\n", (unsigned long)cs.max_object);
+    reply_printf(reply, "cache_policy %s\n", config_policy_name(cs.policy));
+    reply_printf(reply, "cache_entries %lu\n", (unsigned long)cs.entries);
+    reply_printf(reply, "cache_hits %lu\n", (unsigned long)cs.hits);
+    reply_printf(reply, "cache_misses %lu\n", (unsigned long)cs.misses);
+    reply_printf(reply, "cache_inserts %lu\n", (unsigned long)cs.inserts);
+    reply_printf(reply, "cache_evictions %lu\n", (unsigned long)cs.evictions);
+    reply_printf(reply, "cache_recoveries %lu\n", (unsigned long)cs.recoveries);
+}
+
+/* Upper bound of the bucket holding the given fraction of count requests */
+static unsigned long percentile(uint64_t *buckets, uint64_t count, double fraction) {
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        if ((seen += buckets[i]) >= fraction * count)
+            break;
+    return 2UL << (i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1);
+}
+
+static void cmd_latency(reply_t *reply) {
+    uint64_t buckets[LATENCY_BUCKETS], count;
+    int class, i;
+
+    for (class = 0; class < SIZE_CLASSES; class++) {
+        for (count = 0, i = 0; i < LATENCY_BUCKETS; i++)
+            count += buckets[i] = STAT_GET(latency[class][i]);
+        reply_printf(reply, "%s n=%lu", stats_size_class_name(class), (unsigned long)count);
+        if (count)
+            reply_printf(reply, " p50=%lu p90=%lu p99=%lu", percentile(buckets, count, 0.5),
+                         percentile(buckets, count, 0.9), percentile(buckets, count, 0.99));
+        for (i = 0; i < LATENCY_BUCKETS; i++)
+            if (buckets[i])
+                reply_printf(reply, " %lu:%lu", 2UL << i, (unsigned long)buckets[i]);
+        reply_printf(reply, "\n");
+    }
+}
+
+static void cmd_classes(reply_t *reply) {
+    cache_stats_t cs;
+    uint64_t hits, misses;
+    int c;
+
+    if (admin_cache)
+        cache_get_stats(admin_cache, &cs);
+    for (c = 0; c < CACHE_CLASSES; c++) {
+        hits = STAT_GET(class_hits[c]);
+        misses = STAT_GET(class_misses[c]);
+        reply_printf(reply, "%s hits=%lu misses=%lu hit_ratio=%.3f", config_class_name(c),
+                     (unsigned long)hits, (unsigned long)misses,
+                     hits + misses ? (double)hits / (hits + misses) : 0.0);
+        if (!admin_cache) {
+            reply_printf(reply, "\n");
+            continue;
+        }
+        reply_printf(reply, " entries=%lu bytes=%lu evictions=%lu\n",
+                     (unsigned long)cs.class_entries[c], (unsigned long)cs.class_size[c],
+                     (unsigned long)cs.class_evictions[c]);
+    }
+    if (!admin_cache)
+        return;
+    reply_printf(reply, "pinned_budget %lu\n", (unsigned long)cs.pinned_budget);
+}
+
+/* Print a cost total as per-request averages */
+static void print_cost(reply_t *reply, const char *route, int outcome, const request_cost_t *c) {
+    double n = c->requests;
+
+    reply_printf(reply, "%s %s n=%lu cpu_usec=%.1f lookup_cpu_usec=%.1f reads=%.1f writes=%.1f "
+                 "connects=%.2f bytes=%.0f\n", route, stats_outcome_name(outcome),
+                 (unsigned long)c->requests, c->cpu_usec / n, c->lookup_cpu_usec / n, c->reads / n,
+                 c->writes / n, c->connects / n, c->bytes / n);
+}
+
+static void cmd_cost(reply_t *reply) {
+    request_cost_t all[OUTCOMES], c;
+    route_cost_t *rc;
+    int i, o;
+
+    memset(all, 0, sizeof(all));
+    for (i = 0; i < COST_ROUTES; i++) {
+        rc = &proxy_stats->costs[i];
+        if (__atomic_load_n(&rc->state, __ATOMIC_ACQUIRE) != 2)
+            continue;
+        for (o = 0; o < OUTCOMES; o++) {
+            c.requests = STAT_GET(costs[i].by_outcome[o].requests);
+            c.cpu_usec = STAT_GET(costs[i].by_outcome[o].cpu_usec);
+            c.lookup_cpu_usec = STAT_GET(costs[i].by_outcome[o].lookup_cpu_usec);
+            c.reads = STAT_GET(costs[i].by_outcome[o].reads);
+            c.writes = STAT_GET(costs[i].by_outcome[o].writes);
+            c.connects = STAT_GET(costs[i].by_outcome[o].connects);
+            c.bytes = STAT_GET(costs[i].by_outcome[o].bytes);
+            if (!c.requests)
+                continue;
+            print_cost(reply, rc->name, o, &c);
+            all[o].requests += c.requests;
+            all[o].cpu_usec += c.cpu_usec;
+            all[o].lookup_cpu_usec += c.lookup_cpu_usec;
+            all[o].reads += c.reads;
+            all[o].writes += c.writes;
+            all[o].connects += c.connects;
+            all[o].bytes += c.bytes;
+        }
+    }
+    for (o = 0; o < OUTCOMES; o++)
+        if (all[o].requests)
+            print_cost(reply, "*", o, &all[o]);
+}
+
+static void cmd_adapt(reply_t *reply) {
+    adapt_state_t s;
+    int class;
+
+    adapt_get_state(&s);
+    reply_printf(reply, "adapt %s min=%lu max=%lu\n", s.enabled ? "on" : "off",
+                 (unsigned long)s.min, (unsigned long)s.max);
+    for (class = 0; class < ADAPT_CLASSES; class++)
+        reply_printf(reply, "%lu seen=%lu seen_bytes=%lu reref=%lu reref_bytes=%lu score=%lu\n",
+                     (unsigned long)adapt_class_limit(class), (unsigned long)s.seen[class],
+                     (unsigned long)s.seen_bytes[class], (unsigned long)s.reref[class],
+                     (unsigned long)s.reref_bytes[class], (unsigned long)s.score[class]);
+    if (s.decided)
+        reply_printf(reply, "decision %lds ago: %s\n", (long)(time(NULL) - s.decided), s.reason);
+}
+
+struct dump_state {
+    reply_t *reply;
+    long remaining;
+    time_t now;
+};
+
+static int dump_one(cache_info_t *info, void *arg) {
+    struct dump_state *st = arg;
+
+    reply_printf(st->reply, "%lu %u %ld %s\n", (unsigned long)info->size, info->hits,
+                 (long)(st->now - info->stored), info->key);
+    return --st->remaining <= 0;
+}
+
+/* Change one cache limit, keeping the others as they are now */
+static int set_cache(const char *what, const char *value, reply_t *reply) {
+    cache_stats_t cs;
+    size_t budget, max_object;
+    int policy;
+
+    cache_get_stats(admin_cache, &cs);
+    budget = cs.budget;
+    max_object = cs.max_object;
+    policy = cs.policy;
+
+    if (!strcmp(what, "cache_size")) {
+        if (config_parse_size(value, &budget) < 0)
+            goto bad;
+    } else if (!strcmp(what, "max_object_size")) {
+        if (config_parse_size(value, &max_object) < 0 || max_object == 0)
+            goto bad;
+    } else if (!strcmp(what, "policy")) {
+        if ((policy = config_parse_policy(value)) < 0)
+            goto bad;
+    } else {
+        reply_printf(reply, "ERR unknown setting %s\n", what);
+        return -1;
+    }
+    if (cache_set_limits(admin_cache, budget, max_object, policy) < 0) {
+        if (errno == ENOMEM)
+            reply_printf(reply, "ERR the pinned objects need more than %lu bytes\n",
+                         (unsigned long)budget);
+        else
+            reply_printf(reply, "ERR cache_size must be at most %lu and at least max_object_size\n",
+                         (unsigned long)CACHE_MAX_BUDGET);
+        return -1;
+    }
+    return 0;
+
+ bad:
+    reply_printf(reply, "ERR bad value %s for %s\n", value, what);
+    return -1;
+}
+
+/* Run one command line. Returns 1 if the client asked to quit. */
+static int admin_command(char *line, reply_t *reply) {
+    char *argv[4], *p, *save;
+    int argc = 0;
+    cache_info_t info;
+    struct dump_state st;
+
+    for (p = strtok_r(line, " \t\r\n", &save); p && argc < 4; p = strtok_r(NULL, " \t\r\n", &save))
+        argv[argc++] = p;
+    if (argc == 0)
+        return 0;
+
+    if (!strcmp(argv[0], "help")) {
+        reply_printf(reply, "stats | dump [N] | lookup <key> | purge <key>|all\n"
+                     "set cache_size|max_object_size|policy <value>\n"
+                     "latency | classes | cost | adapt | instrument on|off | drain | quit\n");
+    } else if (!strcmp(argv[0], "stats")) {
+        cmd_stats(reply);
+    } else if (!strcmp(argv[0], "latency")) {
+        cmd_latency(reply);
+    } else if (!strcmp(argv[0], "cost")) {
+        cmd_cost(reply);
+    } else if (!strcmp(argv[0], "classes")) {
+        cmd_classes(reply);
+    } else if (!strcmp(argv[0], "adapt")) {
+        cmd_adapt(reply);
+    } else if (!admin_cache && (!strcmp(argv[0], "dump") || !strcmp(argv[0], "lookup") ||
+                                !strcmp(argv[0], "purge") || !strcmp(argv[0], "set"))) {
+        reply_printf(reply, "ERR core mode: the cache is in per-core shards, out of reach here\n");
+        return 0;
+    } else if (!strcmp(argv[0], "dump")) {
+        st.reply = reply;
+        st.remaining = argc > 1 ? atol(argv[1]) : DUMP_DEFAULT;
+        st.now = time(NULL);
+        if (st.remaining > 0)
+            cache_walk(admin_cache, dump_one, &st);
+    } else if (!strcmp(argv[0], "lookup") && argc == 2) {
+        if (!cache_peek(admin_cache, argv[1], &info)) {
+            reply_printf(reply, "ERR not cached\n");
+            return 0;
+        }
+        reply_printf(reply, "size %lu\nstatus %d\nhits %u\nage %ld\n", (unsigned long)info.size,
+                     info.status, info.hits, (long)(time(NULL) - info.stored));
+    } else if (!strcmp(argv[0], "purge") && argc == 2) {
+        if (!strcmp(argv[1], "all")) {
+            cache_purge_all(admin_cache);
+        } else if (!cache_purge(admin_cache, argv[1])) {
+            reply_printf(reply, "ERR not cached\n");
+            return 0;
+        }
+    } else if (!strcmp(argv[0], "set") && argc == 3) {
+        if (set_cache(argv[1], argv[2], reply) < 0)
+            return 0;
+    } else if (!strcmp(argv[0], "instrument") && argc == 2 &&
+               (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+        __atomic_store_n(&proxy_stats->instrument, !strcmp(argv[1], "on"), __ATOMIC_RELAXED);
+    } else if (!strcmp(argv[0], "drain")) {
+        /* The same graceful stop as SIGQUIT, handled by the accept loop */
+        kill(getpid(), SIGQUIT);
+    } else if (!strcmp(argv[0], "quit")) {
+        reply_printf(reply, "OK\n");
+        return 1;
+    } else {
+        reply_printf(reply, "ERR unknown command, try help\n");
+        return 0;
+    }
+    reply_printf(reply, "OK\n");
+    return 0;
+}
+
+static void admin_session(int fd) {
+    char line[MAXLINE];
+    reply_t reply;
+    rio_t rio;
+    int quit = 0;
+
+    reply.cap = MAXLINE;
+    reply.buf = Malloc(reply.cap);
+    rio_readinitb(&rio, fd);
+    while (!quit && rio_readlineb(&rio, line, MAXLINE) > 0) {
+        reply.len = 0;
+        quit = admin_command(line, &reply);
+        if (rio_writen(fd, reply.buf, reply.len) < 0)
+            break;
+    }
+    Free(reply.buf);
+}
+
+static void *admin_thread(void *arg) {
+    struct timeval tv = {ADMIN_TIMEOUT, 0};
+    int fd;
+
+    while (1) {
+        if ((fd = accept(admin_fd, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "admin: accept failed: %s\n", strerror(errno));
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        admin_session(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Forked children (workers, upgrades) must not hold the admin socket */
+static void admin_atfork_child(void) {
+    if (admin_fd >= 0) {
+        close(admin_fd);
+        admin_fd = -1;
+    }
+}
+
+/*
+ * admin_start - Listen on the Unix socket at path (replacing a stale one,
+ *     or one left by the process being upgraded) and start the admin
+ *     thread. Returns 0 on success, -1 on error.
+ */
+int admin_start(const char *path, cache_t *cache) {
+    struct sockaddr_un addr;
+    pthread_t tid;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "admin: socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    unlink(path);
+    if (bind(admin_fd, (SA *)&addr, sizeof(addr)) < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+        listen(admin_fd, 16) < 0) {
+        fprintf(stderr, "admin: cannot listen on %s: %s\n", path, strerror(errno));
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+
+    admin_cache = cache;
+    pthread_atfork(NULL, NULL, admin_atfork_child);
+    Pthread_create(&tid, NULL, admin_thread, NULL);
+    Pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * admin.h - local admin socket for live inspection and tuning
+ *
+ * A Unix-domain stream socket served by its own thread, so it answers
+ * even when every request worker is busy. The protocol is one command
+ * per line; each reply is zero or more lines of data followed by a line
+ * that is either "OK" or "ERR <reason>". Send "help" for the commands.
+ */
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+int admin_start(const char *path, cache_t *cache);
+
+#endif /* __ADMIN_H__ */
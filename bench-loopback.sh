@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# bench-loopback.sh - compare TCP loopback with Unix-domain sockets
+#     between client, proxy and origin on one host.
+#
+#     Runs tiny and the proxy twice: once on TCP ports, once on Unix
+#     sockets (client -> proxy and proxy -> tiny), with caching off so
+#     every request goes through to the origin, and prints ./bench's
+#     report for each.
+#
+#     usage: ./bench-loopback.sh [requests] [conns] [file]
+#
+
+REQUESTS=${1:-2000}
+CONNS=${2:-8}
+FILE=${3:-home.html}
+TMP_DIR=`mktemp -d`
+
+trap 'kill ${tiny_tcp} ${tiny_unix} ${proxy_tcp} ${proxy_unix} 2> /dev/null; rm -rf ${TMP_DIR}' EXIT
+
+make -s proxy bench || exit 1
+(cd ./tiny && make -s) || exit 1
+
+tiny_port=`bash ./free-port.sh`
+(cd ./tiny && exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_tcp=$!
+(cd ./tiny && exec ./tiny unix:${TMP_DIR}/tiny.sock &> /dev/null) &
+tiny_unix=$!
+sleep 1
+proxy_port=`bash ./free-port.sh`
+
+# Objects over one byte are never cached, so each request is a miss
+cat > ${TMP_DIR}/tcp.conf <<EOF
+port = ${proxy_port}
+cache_size = 1K
+max_object_size = 1
+EOF
+cat > ${TMP_DIR}/unix.conf <<EOF
+port = unix:${TMP_DIR}/proxy.sock
+cache_size = 1K
+max_object_size = 1
+route tiny localhost upstream=unix:${TMP_DIR}/tiny.sock
+EOF
+
+./proxy -c ${TMP_DIR}/tcp.conf &> /dev/null &
+proxy_tcp=$!
+./proxy -c ${TMP_DIR}/unix.conf &> /dev/null &
+proxy_unix=$!
+sleep 1
+
+echo "== TCP loopback: client -> proxy -> tiny =="
+./bench -c ${CONNS} -n ${REQUESTS} localhost:${proxy_port} http://localhost:${tiny_port}/${FILE}
+echo
+echo "== Unix sockets: client -> proxy -> tiny =="
+./bench -c ${CONNS} -n ${REQUESTS} unix:${TMP_DIR}/proxy.sock http://localhost/${FILE}
@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# bench-profiles.sh - compare socket tuning profiles
+#
+#     Runs the proxy in front of tiny once per profile, with that profile
+#     on both the listener and the upstream connections and caching off
+#     so every request connects to the origin, and prints ./bench's
+#     report (connect time, latency, throughput) for each.
+#
+#     usage: ./bench-profiles.sh [profiles-file] [requests] [conns] [file]
+#
+#     The profiles file holds "profile <name> ..." lines as in proxy.conf;
+#     without one a few stock profiles are compared.
+#
+
+PROFILES=$1
+REQUESTS=${2:-2000}
+CONNS=${3:-8}
+FILE=${4:-home.html}
+TMP_DIR=`mktemp -d`
+
+trap 'kill ${tiny_pid} ${proxy_pid} 2> /dev/null; rm -rf ${TMP_DIR}' EXIT
+
+if [ -z "${PROFILES}" ]; then
+    PROFILES=${TMP_DIR}/profiles
+    cat > ${PROFILES} <<EOF2
+profile default
+profile latency nodelay=on fastopen=256 notsent_lowat=16K
+profile bulk nodelay=off rcvbuf=1M sndbuf=1M
+profile deferred nodelay=on defer_accept=5 backlog=1024
+EOF2
+fi
+
+make -s proxy bench || exit 1
+(cd ./tiny && make -s) || exit 1
+
+tiny_port=`bash ./free-port.sh`
+(cd ./tiny && exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_pid=$!
+sleep 1
+
+for name in `awk '$1 == "profile" { print $2 }' ${PROFILES}`; do
+    proxy_port=`bash ./free-port.sh`
+    # Objects over one byte are never cached, so each request is a miss
+    cat > ${TMP_DIR}/proxy.conf <<EOF2
+port = ${proxy_port}
+cache_size = 1K
+max_object_size = 1
+listen_profile = ${name}
+upstream_profile = ${name}
+EOF2
+    grep '^profile' ${PROFILES} >> ${TMP_DIR}/proxy.conf
+
+    ./proxy -c ${TMP_DIR}/proxy.conf &> ${TMP_DIR}/proxy.log &
+    proxy_pid=$!
+    sleep 1
+    echo "== profile ${name} =="
+    ./bench -c ${CONNS} -n ${REQUESTS} localhost:${proxy_port} http://localhost:${tiny_port}/${FILE}
+    cat ${TMP_DIR}/proxy.log
+    echo
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
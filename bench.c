@@ -0,0 +1,149 @@
+/*
+ * bench.c - closed-loop load generator for the proxy
+ *
+ * usage: ./bench [-c conns] [-n requests] <proxy> <url> [<url> ...]
+ *
+ * <proxy> is host:port or unix:<path>. Each of conns threads opens a
+ * connection, sends "GET <url> HTTP/1.0", reads the response to EOF and
+ * repeats, cycling through the URLs, until n requests have been made in
+ * all. Reports throughput, connect time and request latency percentiles.
+ */
+#include "csapp.h"
+#include <stdint.h>
+
+static char *proxy_host, *proxy_port;
+static char **urls;
+static int nurls;
+static long total_requests;
+static long next_request = 0;
+
+typedef struct {
+    uint64_t *latency;          /* Per request, usec */
+    long count;
+    long errors;
+    uint64_t bytes;
+    uint64_t connect_usec;
+} bench_thread_t;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Fetch one URL; returns the response bytes, or -1 */
+static ssize_t fetch(char *url, bench_thread_t *t) {
+    char buf[MAXBUF];
+    uint64_t start = now_usec();
+    ssize_t n, total = 0;
+    int fd;
+
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+        return -1;
+    t->connect_usec += now_usec() - start;
+    n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", url);
+    if (rio_writen(fd, buf, n) < 0) {
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+    close(fd);
+    return n < 0 || total == 0 ? -1 : total;
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = arg;
+    uint64_t start;
+    ssize_t n;
+    long i;
+
+    while ((i = __atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED)) < total_requests) {
+        start = now_usec();
+        if ((n = fetch(urls[i % nurls], t)) < 0) {
+            t->errors++;
+            continue;
+        }
+        t->latency[t->count++] = now_usec() - start;
+        t->bytes += n;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    int conns = 8, opt, i;
+    bench_thread_t *threads;
+    pthread_t *tids;
+    uint64_t start, elapsed, *all, bytes = 0, connect_usec = 0;
+    long count = 0, errors = 0, j;
+    char *colon;
+
+    total_requests = 1000;
+    while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'n':
+            total_requests = atol(optarg);
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind < 2 || conns < 1 || total_requests < 1) {
+        fprintf(stderr, "usage: %s [-c conns] [-n requests] <host:port | unix:path> <url>...\n", argv[0]);
+        exit(1);
+    }
+
+    proxy_host = argv[optind];
+    proxy_port = "";
+    if (!IS_UNIX_ADDR(proxy_host)) {
+        if (!(colon = strrchr(proxy_host, ':')))
+            app_error("proxy must be host:port or unix:path");
+        *colon = '\0';
+        proxy_port = colon + 1;
+    }
+    urls = argv + optind + 1;
+    nurls = argc - optind - 1;
+    Signal(SIGPIPE, SIG_IGN);
+
+    threads = Calloc(conns, sizeof(bench_thread_t));
+    tids = Calloc(conns, sizeof(pthread_t));
+    start = now_usec();
+    for (i = 0; i < conns; i++) {
+        threads[i].latency = Calloc(total_requests, sizeof(uint64_t));
+        Pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+    for (i = 0; i < conns; i++)
+        Pthread_join(tids[i], NULL);
+    elapsed = now_usec() - start;
+
+    all = Calloc(total_requests, sizeof(uint64_t));
+    for (i = 0; i < conns; i++) {
+        for (j = 0; j < threads[i].count; j++)
+            all[count++] = threads[i].latency[j];
+        errors += threads[i].errors;
+        bytes += threads[i].bytes;
+        connect_usec += threads[i].connect_usec;
+    }
+    qsort(all, count, sizeof(uint64_t), cmp_u64);
+
+    printf("requests %ld\nerrors %ld\nseconds %.3f\n", count, errors, elapsed / 1e6);
+    printf("requests_per_sec %.1f\nmbytes_per_sec %.2f\n", count * 1e6 / elapsed,
+           bytes / (elapsed / 1e6) / (1 << 20));
+    if (count) {
+        printf("connect_usec_avg %lu\n", (unsigned long)(connect_usec / count));
+        printf("latency_usec_p50 %lu\nlatency_usec_p90 %lu\nlatency_usec_p99 %lu\nlatency_usec_max %lu\n",
+               (unsigned long)all[count / 2], (unsigned long)all[count * 9 / 10],
+               (unsigned long)all[count * 99 / 100], (unsigned long)all[count - 1]);
+    }
+    return errors ? 1 : 0;
+}
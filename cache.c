@@ -0,0 +1,1081 @@
+/*
+ * cache.c - web object cache in a process-shared memory region
+ *
+ * Region layout:
+ *
+ *   | struct cache_region | heap ...................................... |
+ *
+ * The header holds a robust, process-shared mutex, the LRU list ends
+ * and the counters. The heap is managed by a small boundary-tag
+ * allocator with an explicit free list (the same scheme as a malloc lab
+ * allocator, only with offsets instead of pointers). Tags are one 32-bit
+ * word, and only free blocks carry a footer: an allocated block's
+ * neighbour knows it is allocated from a bit in its own header. Every
+ * cached object is a single heap block, its key and body inline:
+ *
+ *   | hdr | struct cache_entry | [expiry] | key | body ... |
+ *
+ * The index is one more heap block: an open-addressing table of
+ * one-byte control words (a 7-bit fingerprint of the key's hash, or
+ * empty, or deleted) followed by each slot's entry block, as a 32-bit
+ * offset in words. A lookup compares a whole group of 16 control bytes
+ * with the fingerprint at once (SSE2, where there is any) and touches
+ * only the entries whose fingerprint matches; a group with an empty
+ * slot ends the probe. The table is rebuilt twice the size when 7/8
+ * full (counting deleted slots), from the keys. With the entry record
+ * packed to 28 bytes, an object costs about 45 bytes beyond its key and
+ * body in all (see cachebench.c).
+ *
+ * The region reserves CACHE_RESERVE bytes of address space up front,
+ * but the memfd is sparse: only pages that blocks are placed in use
+ * memory. Blocks must end below heap_limit, which follows the budget, so
+ * the cache grows or shrinks in place by moving that limit, evicting
+ * what lies beyond it and releasing the pages of free blocks.
+ *
+ * A hit served straight from the memfd (cache_acquire) pins its entry
+ * rather than copying it out. Removing a pinned entry only unlinks it;
+ * its block is freed by the last cache_release, so the bytes can't be
+ * overwritten while the kernel is still sending them.
+ *
+ * If a worker dies while holding the lock, the next locker gets
+ * EOWNERDEAD. A half-finished update may have left the links in any
+ * state, so the cache is simply emptied and the mutex marked consistent.
+ * Emptying starts a new generation; pins taken in an older one are
+ * dropped rather than released.
+ *
+ * Every priority class has its own LRU list. remove_oldest takes the
+ * tail of the lowest non-pinned class that has one; pinned objects are
+ * only removed to keep within their budget, or when the cache is made
+ * too small to hold them.
+ */
+#include "cache.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CACHE_MAGIC   0x43505258  /* "CPRX" */
+#define CACHE_VERSION 9
+
+/* Allocator constants */
+#define WSIZE      4              /* Header/footer size */
+#define ALIGNMENT  4              /* Block sizes are multiples of this: entries hold only 32-bit words */
+#define MIN_BLOCK  16             /* hdr + next + prev + ftr */
+#define MAX_BLOCK  (1u << 30)     /* Free blocks are not coalesced past this */
+#define TAG_ALLOC      1
+#define TAG_PREV_ALLOC 2
+
+/* Index constants */
+#define GROUP        16           /* Control bytes compared at once */
+#define INDEX_MIN    256          /* Slots in the smallest index */
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe         /* Full slots hold a fingerprint, 0x00-0x7f */
+
+struct cache_region {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t region_size;
+    pthread_mutex_t lock;
+
+    uint64_t budget;
+    uint64_t max_object;
+    int policy;                    /* POLICY_LRU or POLICY_FIFO */
+    uint64_t current_size;
+    uint64_t entries;
+    uint64_t pinned_budget;
+    cache_off_t lru_head[CACHE_CLASSES];  /* Most recently used, per class */
+    cache_off_t lru_tail[CACHE_CLASSES];  /* Least recently used */
+    cache_off_t free_head;         /* Explicit free list of heap blocks */
+    cache_off_t heap_start;
+    cache_off_t heap_end;
+    cache_off_t heap_limit;        /* No block may extend past this */
+
+    cache_off_t index;             /* Heap block of the index */
+    uint64_t index_slots;          /* Power of two, at least INDEX_MIN */
+    uint64_t index_used;           /* Slots full or deleted */
+
+    uint64_t hits, misses, inserts, evictions, recoveries;
+    uint64_t class_size[CACHE_CLASSES], class_entries[CACHE_CLASSES];
+    uint64_t class_evictions[CACHE_CLASSES];
+    uint64_t generation;           /* Bumped each time the heap is reset */
+};
+
+/*
+ * A cached object, stored at the start of its heap block's payload.
+ * Offsets of other blocks are kept in 32-bit words (see short_off).
+ */
+struct cache_entry {
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    uint32_t size;                 /* Body size */
+    uint32_t stored;               /* time() when inserted, less the age it came with */
+    uint32_t hits;
+    uint16_t hdr_len;              /* Prebuilt header block at the start of the body */
+    uint16_t key_len;
+    uint16_t refs;                 /* Pins held by cache_acquire callers */
+    uint16_t status : 10;          /* HTTP status, 0 if unknown */
+    uint16_t cache_class : 2;      /* Which LRU list it is on */
+    uint16_t flags : 2;            /* CACHE_VARIANTS, CACHE_ESI */
+    uint16_t unlinked : 1;         /* Removed while pinned; the last release frees it */
+    uint16_t expiring : 1;         /* A 32-bit expiry time() follows the record */
+};
+
+#define ENTRY_EXPIRES(e) (*(uint32_t *)((e) + 1))
+#define ENTRY_KEY(e)     ((char *)((e) + 1) + ((e)->expiring ? 4 : 0))
+#define ENTRY_BODY(e)    (ENTRY_KEY(e) + (e)->key_len)
+#define ENTRY_LIMIT      UINT16_MAX  /* Bound on key_len, hdr_len and refs */
+
+/*******************
+ * Offset helpers
+ *******************/
+static inline void *at(struct cache_region *r, cache_off_t off) {
+    return (char *)r + off;
+}
+
+static inline cache_off_t off_of(struct cache_region *r, void *p) {
+    return (cache_off_t)((char *)p - (char *)r);
+}
+
+/* Block offsets are multiples of WSIZE: in words, one fits 32 bits (see CACHE_RESERVE) */
+static inline uint32_t short_off(cache_off_t blk) {
+    return blk / WSIZE;
+}
+
+static inline cache_off_t long_off(uint32_t off) {
+    return (cache_off_t)off * WSIZE;
+}
+
+/* Entries live in the payload, one word past the block header */
+static inline struct cache_entry *entry_at(struct cache_region *r, cache_off_t blk) {
+    return at(r, blk + WSIZE);
+}
+
+static inline cache_off_t block_of(struct cache_region *r, struct cache_entry *e) {
+    return off_of(r, e) - WSIZE;
+}
+
+/* FNV-1a */
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**********************************
+ * Boundary-tag heap allocator
+ **********************************/
+static inline uint32_t *hdrp(struct cache_region *r, cache_off_t blk) {
+    return at(r, blk);
+}
+
+static inline uint32_t blk_size(struct cache_region *r, cache_off_t blk) {
+    return *hdrp(r, blk) & ~(uint32_t)(ALIGNMENT - 1);
+}
+
+static inline int blk_alloc(struct cache_region *r, cache_off_t blk) {
+    return *hdrp(r, blk) & TAG_ALLOC;
+}
+
+static inline int prev_alloc(struct cache_region *r, cache_off_t blk) {
+    return *hdrp(r, blk) & TAG_PREV_ALLOC;
+}
+
+/* A free block has a footer too; the block after it is told either way */
+static void set_tags(struct cache_region *r, cache_off_t blk, uint32_t size, int alloc) {
+    cache_off_t next = blk + size;
+
+    *hdrp(r, blk) = size | alloc | prev_alloc(r, blk);
+    if (!alloc)
+        *hdrp(r, next - WSIZE) = size;
+    *hdrp(r, next) = (*hdrp(r, next) & ~TAG_PREV_ALLOC) | (alloc ? TAG_PREV_ALLOC : 0);
+}
+
+/* Free blocks keep their list links in the first two payload words */
+static inline uint32_t *free_next(struct cache_region *r, cache_off_t blk) {
+    return at(r, blk + WSIZE);
+}
+
+static inline uint32_t *free_prev(struct cache_region *r, cache_off_t blk) {
+    return at(r, blk + 2 * WSIZE);
+}
+
+static void free_list_insert(struct cache_region *r, cache_off_t blk) {
+    *free_next(r, blk) = short_off(r->free_head);
+    *free_prev(r, blk) = 0;
+    if (r->free_head)
+        *free_prev(r, r->free_head) = short_off(blk);
+    r->free_head = blk;
+}
+
+static void free_list_remove(struct cache_region *r, cache_off_t blk) {
+    cache_off_t next = long_off(*free_next(r, blk)), prev = long_off(*free_prev(r, blk));
+
+    if (prev)
+        *free_next(r, prev) = short_off(next);
+    else
+        r->free_head = next;
+    if (next)
+        *free_prev(r, next) = short_off(prev);
+}
+
+/* Lay out an empty heap: prologue, free blocks of up to MAX_BLOCK, epilogue */
+static void heap_init(struct cache_region *r) {
+    cache_off_t start, epilogue, blk;
+    uint64_t left;
+    uint32_t size;
+
+    start = (sizeof(struct cache_region) + ALIGNMENT - 1) & ~(cache_off_t)(ALIGNMENT - 1);
+    epilogue = start + ((r->region_size - WSIZE - start) & ~(cache_off_t)(ALIGNMENT - 1));
+
+    r->heap_start = start;
+    r->heap_end = epilogue + WSIZE;
+    r->free_head = 0;
+    *hdrp(r, start) = ALIGNMENT | TAG_ALLOC | TAG_PREV_ALLOC;  /* Prologue */
+    *hdrp(r, epilogue) = TAG_ALLOC;                            /* Epilogue */
+    for (blk = start + ALIGNMENT; blk < epilogue; blk += size) {
+        left = epilogue - blk;
+        size = left > MAX_BLOCK ? MAX_BLOCK : left;
+        if (left - size && left - size < MIN_BLOCK)
+            size -= MIN_BLOCK;
+        *hdrp(r, blk) = blk == start + ALIGNMENT ? TAG_PREV_ALLOC : 0;
+        set_tags(r, blk, size, 0);
+    }
+    /* Listed last to first, so the heap fills from its start */
+    for (blk = epilogue; blk > start + ALIGNMENT; ) {
+        blk -= *hdrp(r, blk - WSIZE);
+        free_list_insert(r, blk);
+    }
+}
+
+static cache_off_t heap_alloc(struct cache_region *r, size_t payload) {
+    uint64_t asize = (payload + WSIZE + ALIGNMENT - 1) & ~(uint64_t)(ALIGNMENT - 1);
+    cache_off_t blk;
+
+    if (asize < MIN_BLOCK)
+        asize = MIN_BLOCK;
+
+    /* First fit */
+    for (blk = r->free_head; blk; blk = long_off(*free_next(r, blk))) {
+        uint32_t bsize = blk_size(r, blk);
+
+        if (bsize < asize || blk + asize > r->heap_limit)
+            continue;
+        free_list_remove(r, blk);
+        if (bsize - asize >= MIN_BLOCK) {
+            set_tags(r, blk, asize, 1);
+            set_tags(r, blk + asize, bsize - asize, 0);
+            free_list_insert(r, blk + asize);
+        } else {
+            set_tags(r, blk, bsize, 1);
+        }
+        return blk;
+    }
+    return 0;
+}
+
+static void heap_free(struct cache_region *r, cache_off_t blk) {
+    uint64_t size = blk_size(r, blk);
+    cache_off_t next = blk + size, prev;
+
+    if (!blk_alloc(r, next) && size + blk_size(r, next) <= MAX_BLOCK) {
+        free_list_remove(r, next);
+        size += blk_size(r, next);
+    }
+    if (!prev_alloc(r, blk)) {
+        prev = blk - *hdrp(r, blk - WSIZE);
+        if (size + blk_size(r, prev) <= MAX_BLOCK) {
+            free_list_remove(r, prev);
+            size += blk_size(r, prev);
+            blk = prev;
+        }
+    }
+    set_tags(r, blk, size, 0);
+    free_list_insert(r, blk);
+}
+
+/* Heap bytes allowed for a budget: the objects plus keys, entry headers, index and fragmentation */
+static cache_off_t limit_for(struct cache_region *r, uint64_t budget) {
+    uint64_t limit = r->heap_start + 2 * budget + (1 << 20);
+
+    return limit < r->heap_end ? limit : r->heap_end;
+}
+
+/* Give the whole pages inside a block back to the kernel, keeping its tags and free list links */
+static void block_release(struct cache_region *r, cache_off_t blk) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    cache_off_t lo = (blk + 3 * WSIZE + pagesize - 1) & ~(cache_off_t)(pagesize - 1);
+    cache_off_t hi = (blk + blk_size(r, blk) - WSIZE) & ~(cache_off_t)(pagesize - 1);
+
+    if (hi > lo)
+        madvise(at(r, lo), hi - lo, MADV_REMOVE);
+}
+
+/* Give the pages inside free blocks back to the kernel */
+static void heap_release(struct cache_region *r) {
+    cache_off_t blk;
+
+    for (blk = r->free_head; blk; blk = long_off(*free_next(r, blk)))
+        block_release(r, blk);
+}
+
+/****************************
+ * Index
+ ****************************/
+static inline uint8_t *index_ctrl(struct cache_region *r) {
+    return at(r, r->index + WSIZE);
+}
+
+/* Each slot's entry block, as a short offset */
+static inline uint32_t *index_blocks(struct cache_region *r) {
+    return (uint32_t *)(index_ctrl(r) + r->index_slots);
+}
+
+static inline uint8_t fingerprint(uint64_t hash) {
+    return hash >> 57;
+}
+
+/* Bit i set for each control byte i of the group at ctrl equal to byte */
+static inline unsigned group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)ctrl), _mm_set1_epi8(byte)));
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < GROUP; i++)
+        mask |= (unsigned)(ctrl[i] == byte) << i;
+    return mask;
+#endif
+}
+
+/*
+ * index_find - The slot holding the entry with key, or with block blk if
+ *     key is NULL; -1 if there is none. Groups are probed in triangular
+ *     order from the one the hash picks, which visits each exactly once.
+ */
+static int64_t index_find(struct cache_region *r, const char *key, size_t key_len,
+                          uint64_t hash, cache_off_t blk) {
+    uint8_t *ctrl = index_ctrl(r), fp = fingerprint(hash);
+    uint32_t *blocks = index_blocks(r), want = short_off(blk);
+    uint64_t groups = r->index_slots / GROUP, g = hash & (groups - 1), i, slot;
+    struct cache_entry *e;
+    unsigned match;
+
+    for (i = 1; i <= groups; g = (g + i++) & (groups - 1)) {
+        for (match = group_match(ctrl + g * GROUP, fp); match; match &= match - 1) {
+            slot = g * GROUP + __builtin_ctz(match);
+            if (!key) {
+                if (blocks[slot] == want)
+                    return slot;
+                continue;
+            }
+            e = entry_at(r, long_off(blocks[slot]));
+            if (e->key_len == key_len && memcmp(ENTRY_KEY(e), key, key_len) == 0)
+                return slot;
+        }
+        if (group_match(ctrl + g * GROUP, CTRL_EMPTY))
+            return -1;
+    }
+    return -1;
+}
+
+/* Put blk in the first free slot of its probe sequence; the index has room */
+static void index_put(struct cache_region *r, uint64_t hash, cache_off_t blk) {
+    uint8_t *ctrl = index_ctrl(r);
+    uint64_t groups = r->index_slots / GROUP, g = hash & (groups - 1), i, slot;
+    unsigned free_slots;
+
+    for (i = 1; ; g = (g + i++) & (groups - 1)) {
+        free_slots = group_match(ctrl + g * GROUP, CTRL_EMPTY) | group_match(ctrl + g * GROUP, CTRL_DELETED);
+        if (free_slots)
+            break;
+    }
+    slot = g * GROUP + __builtin_ctz(free_slots);
+    r->index_used += ctrl[slot] == CTRL_EMPTY;
+    ctrl[slot] = fingerprint(hash);
+    index_blocks(r)[slot] = short_off(blk);
+}
+
+/*
+ * index_rebuild - Move the index to a new block of slots slots (a power
+ *     of two), rehashing every entry from its key and dropping deleted
+ *     slots. Returns 0, or -1 (leaving the index as it was) if the heap
+ *     has no room for it.
+ */
+static int index_rebuild(struct cache_region *r, uint64_t slots) {
+    cache_off_t old = r->index, blk;
+    uint64_t old_slots = r->index_slots, i;
+    uint8_t *old_ctrl = index_ctrl(r);
+    uint32_t *old_blocks = index_blocks(r);
+    struct cache_entry *e;
+
+    if (!(blk = heap_alloc(r, slots * (1 + sizeof(uint32_t)))))
+        return -1;
+    r->index = blk;
+    r->index_slots = slots;
+    r->index_used = 0;
+    memset(index_ctrl(r), CTRL_EMPTY, slots);
+    for (i = 0; i < old_slots; i++) {
+        if (old_ctrl[i] & CTRL_EMPTY)  /* Empty or deleted */
+            continue;
+        e = entry_at(r, long_off(old_blocks[i]));
+        index_put(r, hash_key(ENTRY_KEY(e), e->key_len), long_off(old_blocks[i]));
+    }
+    /* Small entries fill it back only slowly: give its pages back now */
+    block_release(r, old);
+    heap_free(r, old);
+    return 0;
+}
+
+/* Slots for an index holding entries with room to grow: at most half full */
+static uint64_t index_slots_for(uint64_t entries) {
+    uint64_t slots = INDEX_MIN;
+
+    while (entries * 2 > slots)
+        slots *= 2;
+    return slots;
+}
+
+/* Make room for one more entry: rebuild at 7/8 full (counting deleted slots) */
+static int index_reserve(struct cache_region *r) {
+    if ((r->index_used + 1) * 8 <= r->index_slots * 7)
+        return 0;
+    return index_rebuild(r, index_slots_for(r->entries + 1));
+}
+
+/****************************
+ * Index and LRU maintenance
+ ****************************/
+static void lru_unlink(struct cache_region *r, struct cache_entry *e) {
+    cache_off_t prev = long_off(e->lru_prev), next = long_off(e->lru_next);
+
+    if (prev)
+        entry_at(r, prev)->lru_next = e->lru_next;
+    else
+        r->lru_head[e->cache_class] = next;
+    if (next)
+        entry_at(r, next)->lru_prev = e->lru_prev;
+    else
+        r->lru_tail[e->cache_class] = prev;
+}
+
+static void lru_push_front(struct cache_region *r, struct cache_entry *e) {
+    cache_off_t blk = block_of(r, e), *head = &r->lru_head[e->cache_class];
+
+    e->lru_prev = 0;
+    e->lru_next = short_off(*head);
+    if (*head)
+        entry_at(r, *head)->lru_prev = short_off(blk);
+    else
+        r->lru_tail[e->cache_class] = blk;
+    *head = blk;
+}
+
+static struct cache_entry *find_entry(struct cache_region *r, const char *key,
+                                      size_t key_len, uint64_t hash) {
+    int64_t slot = index_find(r, key, key_len, hash, 0);
+
+    return slot < 0 ? NULL : entry_at(r, long_off(index_blocks(r)[slot]));
+}
+
+static int is_stale(struct cache_entry *e) {
+    return e->expiring && ENTRY_EXPIRES(e) <= (uint32_t)time(NULL);
+}
+
+static void remove_entry(struct cache_region *r, struct cache_entry *e);
+
+/* Like find_entry, but an entry past its expiry time is removed and missed */
+static struct cache_entry *find_fresh(struct cache_region *r, const char *key,
+                                      size_t key_len, uint64_t hash) {
+    struct cache_entry *e = find_entry(r, key, key_len, hash);
+
+    if (e && is_stale(e)) {
+        r->class_evictions[e->cache_class]++;
+        remove_entry(r, e);
+        r->evictions++;
+        return NULL;
+    }
+    return e;
+}
+
+static void remove_entry(struct cache_region *r, struct cache_entry *e) {
+    cache_off_t blk = block_of(r, e);
+    int64_t slot = index_find(r, NULL, 0, hash_key(ENTRY_KEY(e), e->key_len), blk);
+
+    index_ctrl(r)[slot] = CTRL_DELETED;
+    lru_unlink(r, e);
+    r->current_size -= e->size;
+    r->entries--;
+    r->class_size[e->cache_class] -= e->size;
+    r->class_entries[e->cache_class]--;
+    if (e->refs)
+        e->unlinked = 1;
+    else
+        heap_free(r, blk);
+}
+
+/* Evict the least recently used object of a class; 0 if it has none */
+static int remove_oldest_of(struct cache_region *r, int cache_class) {
+    if (!r->lru_tail[cache_class])
+        return 0;
+    remove_entry(r, entry_at(r, r->lru_tail[cache_class]));
+    r->evictions++;
+    r->class_evictions[cache_class]++;
+    return 1;
+}
+
+/* Remove Oldest Cache Entry of the lowest class that has one, never a pinned one */
+static int remove_oldest(struct cache_region *r) {
+    int c;
+
+    for (c = CACHE_LOW; c < CACHE_PINNED; c++)
+        if (remove_oldest_of(r, c))
+            return 1;
+    return 0;
+}
+
+/* Bytes pinned objects may hold: their budget, but never over half the cache */
+static uint64_t pinned_limit(struct cache_region *r) {
+    return r->pinned_budget < r->budget / 2 ? r->pinned_budget : r->budget / 2;
+}
+
+/* A fresh empty index; the heap was just laid out, so there is room */
+static void index_init(struct cache_region *r) {
+    r->index_slots = INDEX_MIN;
+    r->index_used = 0;
+    r->index = heap_alloc(r, INDEX_MIN * (1 + sizeof(uint32_t)));
+    memset(index_ctrl(r), CTRL_EMPTY, INDEX_MIN);
+}
+
+/* Forget every object, keeping the lock and the cumulative counters */
+static void cache_reset(struct cache_region *r) {
+    memset(r->lru_head, 0, sizeof(r->lru_head));
+    memset(r->lru_tail, 0, sizeof(r->lru_tail));
+    memset(r->class_size, 0, sizeof(r->class_size));
+    memset(r->class_entries, 0, sizeof(r->class_entries));
+    r->current_size = 0;
+    r->entries = 0;
+    r->generation++;
+    heap_init(r);
+    r->heap_limit = limit_for(r, r->budget);
+    index_init(r);
+}
+
+static void cache_lock(cache_t *cache) {
+    struct cache_region *r = cache->region;
+    int rc;
+
+    if (cache->owned)
+        return;
+    rc = pthread_mutex_lock(&r->lock);
+
+    if (rc == EOWNERDEAD) {
+        fprintf(stderr, "cache: a worker died holding the cache lock, flushing cache\n");
+        cache_reset(r);
+        r->recoveries++;
+        pthread_mutex_consistent(&r->lock);
+    } else if (rc != 0) {
+        posix_error(rc, "cache lock error");
+    }
+}
+
+static void cache_unlock(cache_t *cache) {
+    if (!cache->owned)
+        pthread_mutex_unlock(&cache->region->lock);
+}
+
+/*******************
+ * Public interface
+ *******************/
+
+/*
+ * cache_init - Map a fresh cache region holding up to budget bytes of
+ *     objects. Must run before forking workers so they inherit it.
+ *     Returns 0 on success, -1 with errno set on error.
+ */
+int cache_init(cache_t *cache, size_t budget) {
+    pthread_mutexattr_t attr;
+    struct cache_region *r;
+    size_t size = CACHE_RESERVE;
+    int fd;
+
+    if (budget > CACHE_MAX_BUDGET) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef SYS_memfd_create
+    /* A memfd (rather than an anonymous mapping) can be handed to another process */
+    if ((fd = syscall(SYS_memfd_create, "proxy-cache", MFD_CLOEXEC)) < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#else
+    fd = -1;
+    r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (r == MAP_FAILED) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->magic = CACHE_MAGIC;
+    r->version = CACHE_VERSION;
+    r->region_size = size;
+    r->budget = budget;
+    r->max_object = MAX_OBJECT_SIZE;
+    r->policy = POLICY_LRU;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&r->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cache_reset(r);
+
+    cache->region = r;
+    cache->region_size = size;
+    cache->fd = fd;
+    cache->owned = 0;
+    return 0;
+}
+
+/*
+ * cache_attach - Map an existing cache region from its memfd, e.g. one
+ *     handed over by the proxy being upgraded. Both processes may use the
+ *     region at the same time. Returns 0 on success, -1 if fd does not
+ *     hold a region this build understands.
+ */
+int cache_attach(cache_t *cache, int fd) {
+    struct cache_region *r;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct cache_region))
+        return -1;
+    r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r == MAP_FAILED)
+        return -1;
+    if (r->magic != CACHE_MAGIC || r->version != CACHE_VERSION ||
+        r->region_size != (uint64_t)st.st_size) {
+        munmap(r, st.st_size);
+        return -1;
+    }
+
+    cache->region = r;
+    cache->region_size = st.st_size;
+    cache->fd = fd;
+    cache->owned = 0;
+    return 0;
+}
+
+/*
+ * cache_lookup - Copy the object cached under key into buf. Returns its
+ *     size, or -1 on a miss (or if it does not fit in bufsize bytes).
+ */
+ssize_t cache_lookup(cache_t *cache, const char *key, char *buf, size_t bufsize) {
+    struct cache_region *r = cache->region;
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_key(key, key_len);
+    struct cache_entry *e;
+    ssize_t size = -1;
+
+    cache_lock(cache);
+    if ((e = find_fresh(r, key, key_len, hash)) && e->size <= bufsize) {
+        if (r->policy == POLICY_LRU) {
+            lru_unlink(r, e);
+            lru_push_front(r, e);
+        }
+        memcpy(buf, ENTRY_BODY(e), e->size);
+        size = e->size;
+        e->hits++;
+        r->hits++;
+    } else {
+        r->misses++;
+    }
+    cache_unlock(cache);
+    return size;
+}
+
+/*
+ * cache_acquire - Pin the object cached under key and describe where it
+ *     lies in the region, so it can be sent without copying it out.
+ *     Counts a hit or miss like cache_lookup. Returns 1 on a hit, and
+ *     the caller must then cache_release the reference; 0 on a miss.
+ */
+int cache_acquire(cache_t *cache, const char *key, cache_ref_t *ref) {
+    struct cache_region *r = cache->region;
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_key(key, key_len);
+    struct cache_entry *e;
+    int found = 0;
+
+    cache_lock(cache);
+    /* A pin count at its limit can't take another: serve it as a miss */
+    if ((e = find_fresh(r, key, key_len, hash)) && e->refs < ENTRY_LIMIT) {
+        if (r->policy == POLICY_LRU) {
+            lru_unlink(r, e);
+            lru_push_front(r, e);
+        }
+        /* A variant list is not a response: the lookup of the variant counts instead */
+        if (!(e->flags & CACHE_VARIANTS)) {
+            e->hits++;
+            r->hits++;
+        }
+        e->refs++;
+        ref->entry = block_of(r, e);
+        ref->generation = r->generation;
+        ref->data = ENTRY_BODY(e);
+        ref->size = e->size;
+        ref->hdr_len = e->hdr_len;
+        ref->status = e->status;
+        ref->stored = e->stored;
+        ref->flags = e->flags;
+        ref->offset = ENTRY_BODY(e) - (char *)r;
+        found = 1;
+    } else {
+        r->misses++;
+    }
+    cache_unlock(cache);
+    return found;
+}
+
+/* Drop a pin taken by cache_acquire, freeing the object if it was removed meanwhile */
+void cache_release(cache_t *cache, cache_ref_t *ref) {
+    struct cache_region *r = cache->region;
+    struct cache_entry *e;
+
+    cache_lock(cache);
+    if (ref->generation == r->generation) {
+        e = entry_at(r, ref->entry);
+        if (--e->refs == 0 && e->unlinked)
+            heap_free(r, ref->entry);
+    }
+    cache_unlock(cache);
+}
+
+/*
+ * cache_insert - Store a copy of buf under key, with what meta (which
+ *     may be NULL) says about it, evicting objects as needed. Objects
+ *     over the maximum object size are ignored, and so are objects that
+ *     would only fit by evicting pinned ones, and keys or header blocks
+ *     over 64K. A pinned object too big for the pinned budget is cached
+ *     as CACHE_HIGH instead.
+ */
+void cache_insert(cache_t *cache, const char *key, const char *buf, size_t size,
+                  const cache_meta_t *meta) {
+    struct cache_region *r = cache->region;
+    size_t key_len = strlen(key), hdr_len = meta ? meta->hdr_len : 0;
+    size_t payload = sizeof(struct cache_entry) + (meta && meta->expires ? 4 : 0) + key_len + size;
+    uint64_t hash = hash_key(key, key_len);
+    struct cache_entry *e;
+    cache_off_t blk;
+    int cache_class = meta ? meta->cache_class : CACHE_NORMAL;
+
+    if (key_len > ENTRY_LIMIT || hdr_len > ENTRY_LIMIT || payload >= MAX_BLOCK - ALIGNMENT)
+        return;
+    cache_lock(cache);
+    if (size > r->max_object || size > r->budget) {
+        cache_unlock(cache);
+        return;
+    }
+
+    /* Two workers missed on the same object: keep the newest copy */
+    if ((e = find_entry(r, key, key_len, hash)))
+        remove_entry(r, e);
+
+    if (cache_class == CACHE_PINNED && size > pinned_limit(r))
+        cache_class = CACHE_HIGH;
+    while (cache_class == CACHE_PINNED && r->class_size[CACHE_PINNED] + size > pinned_limit(r))
+        remove_oldest_of(r, CACHE_PINNED);
+
+    while (r->current_size + size > r->budget) {
+        if (!remove_oldest(r)) {
+            cache_unlock(cache);
+            return;
+        }
+    }
+
+    while (index_reserve(r) < 0 || !(blk = heap_alloc(r, payload))) {
+        if (!remove_oldest(r)) {
+            cache_unlock(cache);
+            return;
+        }
+    }
+
+    e = entry_at(r, blk);
+    e->size = size;
+    e->stored = time(NULL) - (meta ? meta->initial_age : 0);
+    e->hits = 0;
+    e->hdr_len = hdr_len;
+    e->key_len = key_len;
+    e->refs = 0;
+    e->status = meta && meta->status > 0 && meta->status < 1000 ? meta->status : 0;
+    e->cache_class = cache_class;
+    e->flags = meta ? meta->flags : 0;
+    e->unlinked = 0;
+    e->expiring = meta && meta->expires;
+    if (e->expiring)
+        ENTRY_EXPIRES(e) = meta->expires;
+    memcpy(ENTRY_KEY(e), key, key_len);
+    memcpy(ENTRY_BODY(e), buf, size);
+
+    index_put(r, hash, blk);
+    lru_push_front(r, e);
+    r->current_size += size;
+    r->entries++;
+    r->inserts++;
+    r->class_size[cache_class] += size;
+    r->class_entries[cache_class]++;
+
+    cache_unlock(cache);
+}
+
+/*
+ * cache_set_limits - Resize the cache in place and change its policy.
+ *     Shrinking evicts objects over the new limits and returns the freed
+ *     memory to the kernel; growing just lets the cache fill further.
+ *     Fails with ENOMEM, keeping the old limits, if what is left once
+ *     every unpinned object is gone still does not fit.
+ */
+int cache_set_limits(cache_t *cache, size_t budget, size_t max_object, int policy) {
+    struct cache_region *r = cache->region;
+    struct cache_entry *e;
+    cache_off_t blk, next;
+    uint64_t old_budget, old_max_object, old_heap_limit;
+    int shrinking, c, old_policy;
+
+    if (budget > CACHE_MAX_BUDGET || max_object > budget) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cache_lock(cache);
+    shrinking = budget < r->budget || max_object < r->max_object;
+    old_budget = r->budget;
+    old_max_object = r->max_object;
+    old_policy = r->policy;
+    old_heap_limit = r->heap_limit;
+    r->budget = budget;
+    r->max_object = max_object;
+    r->policy = policy;
+    r->heap_limit = limit_for(r, budget);
+
+    for (c = 0; c < CACHE_CLASSES; c++) {
+        for (blk = r->lru_head[c]; blk; blk = next) {
+            e = entry_at(r, blk);
+            next = long_off(e->lru_next);
+            if (e->size > max_object || blk + blk_size(r, blk) > r->heap_limit) {
+                remove_entry(r, e);
+                r->evictions++;
+                r->class_evictions[c]++;
+            }
+        }
+    }
+    while (r->class_size[CACHE_PINNED] > pinned_limit(r))
+        remove_oldest_of(r, CACHE_PINNED);
+    while (r->current_size > budget)
+        if (!remove_oldest(r))
+            goto toobig;
+    /* The index moves below the new limit too, at the size the entries left need */
+    while (r->index + blk_size(r, r->index) > r->heap_limit &&
+           index_rebuild(r, index_slots_for(r->entries)) < 0)
+        if (!remove_oldest(r))
+            goto toobig;
+    if (shrinking)
+        heap_release(r);
+    cache_unlock(cache);
+    return 0;
+
+toobig:
+    /* Only pinned objects are left; the old limits still hold what they need */
+    r->budget = old_budget;
+    r->max_object = old_max_object;
+    r->policy = old_policy;
+    r->heap_limit = old_heap_limit;
+    cache_unlock(cache);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * cache_set_pinned - Set how many bytes pinned objects may hold (at most
+ *     half the budget, whatever is asked), evicting the oldest of them
+ *     if they now hold more.
+ */
+void cache_set_pinned(cache_t *cache, size_t budget) {
+    struct cache_region *r = cache->region;
+
+    cache_lock(cache);
+    r->pinned_budget = budget;
+    while (r->class_size[CACHE_PINNED] > pinned_limit(r))
+        remove_oldest_of(r, CACHE_PINNED);
+    cache_unlock(cache);
+}
+
+/*
+ * cache_set_owned - Declare that only the calling thread will ever use
+ *     this cache, so it skips the lock. For caches private to one
+ *     thread, never for a region shared with other processes.
+ */
+void cache_set_owned(cache_t *cache) {
+    cache->owned = 1;
+}
+
+/* Hash of a key, the one the index uses; callers may use it to partition keys */
+uint64_t cache_key_hash(const char *key) {
+    return hash_key(key, strlen(key));
+}
+
+/* The current maximum object size, for sizing buffers */
+size_t cache_max_object(cache_t *cache) {
+    return __atomic_load_n(&cache->region->max_object, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_peek - Describe the object cached under key without counting a
+ *     hit or changing its eviction order. Returns 1 if present, else 0.
+ */
+int cache_peek(cache_t *cache, const char *key, cache_info_t *info) {
+    struct cache_region *r = cache->region;
+    size_t key_len = strlen(key);
+    struct cache_entry *e;
+    int found = 0;
+
+    cache_lock(cache);
+    if ((e = find_entry(r, key, key_len, hash_key(key, key_len))) && !is_stale(e)) {
+        info->key = NULL;
+        info->size = e->size;
+        info->stored = e->stored;
+        info->hits = e->hits;
+        info->status = e->status;
+        info->flags = e->flags;
+        info->cache_class = e->cache_class;
+        found = 1;
+    }
+    cache_unlock(cache);
+    return found;
+}
+
+/*
+ * cache_get_variants - Copy the variant list cached under key (see
+ *     vary.h) into buf, without counting a hit or changing its eviction
+ *     order. Returns its size, or -1 if key holds no list or it does not
+ *     fit in bufsize bytes.
+ */
+ssize_t cache_get_variants(cache_t *cache, const char *key, char *buf, size_t bufsize) {
+    struct cache_region *r = cache->region;
+    size_t key_len = strlen(key);
+    struct cache_entry *e;
+    ssize_t size = -1;
+
+    cache_lock(cache);
+    if ((e = find_entry(r, key, key_len, hash_key(key, key_len))) &&
+        (e->flags & CACHE_VARIANTS) && e->size <= bufsize) {
+        memcpy(buf, ENTRY_BODY(e), e->size);
+        size = e->size;
+    }
+    cache_unlock(cache);
+    return size;
+}
+
+/* Remove the object cached under key. Returns 1 if there was one. */
+int cache_purge(cache_t *cache, const char *key) {
+    struct cache_region *r = cache->region;
+    size_t key_len = strlen(key);
+    struct cache_entry *e;
+    int found = 0;
+
+    cache_lock(cache);
+    if ((e = find_entry(r, key, key_len, hash_key(key, key_len)))) {
+        remove_entry(r, e);
+        found = 1;
+    }
+    cache_unlock(cache);
+    return found;
+}
+
+/* Remove every object and return their memory to the kernel */
+void cache_purge_all(cache_t *cache) {
+    struct cache_region *r = cache->region;
+    int c;
+
+    /* One at a time rather than cache_reset, which would pull pinned objects from under their readers */
+
+    cache_lock(cache);
+    for (c = 0; c < CACHE_CLASSES; c++)
+        while (r->lru_head[c])
+            remove_entry(r, entry_at(r, r->lru_head[c]));
+    heap_release(r);
+    cache_unlock(cache);
+}
+
+/*
+ * cache_walk - Call fn on each object, class by class from pinned down
+ *     to low and from most to least recently used within a class,
+ *     stopping early if it returns nonzero. fn runs under the cache
+ *     lock, so it must be quick and must not call back into the cache.
+ */
+void cache_walk(cache_t *cache, int (*fn)(cache_info_t *info, void *arg), void *arg) {
+    struct cache_region *r = cache->region;
+    char *key = Malloc(ENTRY_LIMIT + 1);  /* Keys are stored without a NUL */
+    struct cache_entry *e;
+    cache_info_t info;
+    cache_off_t blk;
+    int c;
+
+    cache_lock(cache);
+    for (c = CACHE_CLASSES - 1; c >= 0; c--) {
+        for (blk = r->lru_head[c]; blk; blk = long_off(e->lru_next)) {
+            e = entry_at(r, blk);
+            memcpy(key, ENTRY_KEY(e), e->key_len);
+            key[e->key_len] = '\0';
+            info.key = key;
+            info.size = e->size;
+            info.stored = e->stored;
+            info.hits = e->hits;
+            info.status = e->status;
+            info.flags = e->flags;
+            info.cache_class = c;
+            if (fn(&info, arg))
+                goto done;
+        }
+    }
+ done:
+    cache_unlock(cache);
+    Free(key);
+}
+
+void cache_get_stats(cache_t *cache, cache_stats_t *stats) {
+    struct cache_region *r = cache->region;
+
+    cache_lock(cache);
+    stats->budget = r->budget;
+    stats->max_object = r->max_object;
+    stats->policy = r->policy;
+    stats->current_size = r->current_size;
+    stats->entries = r->entries;
+    stats->hits = r->hits;
+    stats->misses = r->misses;
+    stats->inserts = r->inserts;
+    stats->evictions = r->evictions;
+    stats->recoveries = r->recoveries;
+    stats->pinned_budget = pinned_limit(r);
+    memcpy(stats->class_size, r->class_size, sizeof(r->class_size));
+    memcpy(stats->class_entries, r->class_entries, sizeof(r->class_entries));
+    memcpy(stats->class_evictions, r->class_evictions, sizeof(r->class_evictions));
+    cache_unlock(cache);
+}
@@ -0,0 +1,124 @@
+/*
+ * cache.h - web object cache shared by every proxy worker
+ *
+ * The whole cache (index, LRU list and object storage) lives in one
+ * memory region backed by a memfd and mapped MAP_SHARED, so forked
+ * workers all see the same objects. Nothing inside the region holds a
+ * raw pointer: links are byte offsets from the start of the region,
+ * which keeps it valid wherever a process happens to map it.
+ *
+ * Each object has a priority class (CACHE_LOW .. CACHE_PINNED, see
+ * config.h) with its own LRU list; eviction empties the lower classes
+ * first. Pinned objects share a budget of their own, at most half the
+ * cache, and only push out each other.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "config.h"
+#include <stdint.h>
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/*
+ * Address space reserved for the region, and the largest budget it
+ * allows. Links inside the region are 32-bit offsets in 4-byte words,
+ * which reach 16 GB.
+ */
+#define CACHE_RESERVE    ((size_t)1 << 34)
+#define CACHE_MAX_BUDGET (CACHE_RESERVE / 2 - (2 << 20))
+
+/* Entry flags */
+#define CACHE_VARIANTS 1    /* Not a response: the variant list of a URL (see vary.h) */
+#define CACHE_ESI      2    /* A page template to assemble before sending (see esi.h) */
+
+/* Offset of an object inside the cache region (0 means none) */
+typedef uint64_t cache_off_t;
+
+struct cache_region;
+
+/* Per-process handle on the shared cache region */
+typedef struct {
+    struct cache_region *region;  /* Base of the shared mapping */
+    size_t region_size;           /* Bytes mapped */
+    int fd;                       /* memfd backing the region, or -1 */
+    int owned;                    /* One thread uses it: no locking (cache_set_owned) */
+} cache_t;
+
+/* Cumulative counters, a consistent copy taken under the cache lock */
+typedef struct {
+    uint64_t budget;        /* Max bytes of cached objects */
+    uint64_t max_object;
+    int policy;
+    uint64_t current_size;  /* Bytes of cached objects */
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t recoveries;    /* Times a worker died holding the lock */
+    uint64_t pinned_budget; /* Max bytes of pinned objects */
+    uint64_t class_size[CACHE_CLASSES];
+    uint64_t class_entries[CACHE_CLASSES];
+    uint64_t class_evictions[CACHE_CLASSES];
+} cache_stats_t;
+
+/* One cached object, as reported to inspection callers */
+typedef struct {
+    const char *key;        /* Valid only inside a cache_walk callback */
+    size_t size;
+    time_t stored;          /* When the origin sent it: cached, less the age it came with */
+    unsigned hits;
+    int status;
+    int flags;
+    int cache_class;
+} cache_info_t;
+
+/* What is known about a response when it is cached, kept beside it */
+typedef struct {
+    size_t hdr_len;         /* Prebuilt header block at the start of the object */
+    int status;             /* HTTP status, 0 if unknown */
+    unsigned initial_age;   /* Age the origin gave it, in seconds */
+    int flags;              /* CACHE_VARIANTS, CACHE_ESI */
+    time_t expires;         /* When it goes stale and is dropped, 0 for never */
+    int cache_class;        /* CACHE_LOW .. CACHE_PINNED */
+} cache_meta_t;
+
+/* A cached object pinned by cache_acquire; valid until cache_release */
+typedef struct {
+    cache_off_t entry;
+    uint64_t generation;
+    const char *data;       /* The object, inside the mapping */
+    size_t size;
+    size_t hdr_len;         /* Prebuilt header block at the start of data */
+    int status;
+    time_t stored;          /* As in cache_info_t, so its Age is now - stored */
+    int flags;
+    off_t offset;           /* Of data within cache->fd */
+} cache_ref_t;
+
+int cache_init(cache_t *cache, size_t budget);
+int cache_attach(cache_t *cache, int fd);
+ssize_t cache_lookup(cache_t *cache, const char *key, char *buf, size_t bufsize);
+int cache_acquire(cache_t *cache, const char *key, cache_ref_t *ref);
+void cache_release(cache_t *cache, cache_ref_t *ref);
+void cache_insert(cache_t *cache, const char *key, const char *buf, size_t size,
+                  const cache_meta_t *meta);
+int cache_set_limits(cache_t *cache, size_t budget, size_t max_object, int policy);
+void cache_set_pinned(cache_t *cache, size_t budget);
+size_t cache_max_object(cache_t *cache);
+void cache_set_owned(cache_t *cache);
+uint64_t cache_key_hash(const char *key);
+
+/* Inspection and administration */
+int cache_peek(cache_t *cache, const char *key, cache_info_t *info);
+ssize_t cache_get_variants(cache_t *cache, const char *key, char *buf, size_t bufsize);
+int cache_purge(cache_t *cache, const char *key);
+void cache_purge_all(cache_t *cache);
+void cache_walk(cache_t *cache, int (*fn)(cache_info_t *info, void *arg), void *arg);
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,147 @@
+/*
+ * cachebench.c - memory and lookup cost of the cache index at scale
+ *
+ * usage: ./cachebench [-n entries] [-s body] [-l lookups]
+ *
+ * Fills a cache with n small objects (API-style URLs as keys, bodies of
+ * the given size), then reports how much of the cache memfd they use:
+ * bytes per entry beyond the keys and bodies themselves, and entries
+ * per GB. Then times lookups of random cached keys (acquire and
+ * release, as a hit is served) and of absent ones. Per-lookup
+ * percentiles include the cost of reading the clock; the means don't.
+ */
+#include "cache.h"
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Bytes of the memfd backed by memory */
+static uint64_t cache_memory(cache_t *cache) {
+    struct stat st;
+
+    if (fstat(cache->fd, &st) < 0)
+        unix_error("fstat");
+    return (uint64_t)st.st_blocks * 512;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int make_key(char *key, long i) {
+    return sprintf(key, "http://api.example.com/v1/items/%ld", i);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Mean ns per lookup of keys from i in [base, base + range), and per-lookup times into lat */
+static double time_lookups(cache_t *cache, long count, long base, long range, uint64_t *lat, long *hits) {
+    char key[64];
+    cache_ref_t ref;
+    uint64_t seed = 88172645463325252ULL, start, t;
+    long i;
+
+    *hits = 0;
+    start = now_nsec();
+    for (i = 0; i < count; i++) {
+        make_key(key, base + xorshift(&seed) % range);
+        if (cache_acquire(cache, key, &ref)) {
+            cache_release(cache, &ref);
+            (*hits)++;
+        }
+    }
+    t = now_nsec() - start;
+
+    seed = 88172645463325252ULL;
+    for (i = 0; i < count; i++) {
+        make_key(key, base + xorshift(&seed) % range);
+        start = now_nsec();
+        if (cache_acquire(cache, key, &ref))
+            cache_release(cache, &ref);
+        lat[i] = now_nsec() - start;
+    }
+    qsort(lat, count, sizeof(uint64_t), cmp_u64);
+    return (double)t / count;
+}
+
+int main(int argc, char **argv) {
+    long entries = 10000000, lookups = 1000000, i, hits;
+    size_t body_size = 100, key_bytes = 0, budget;
+    uint64_t start, insert_nsec, empty, used, *lat;
+    char key[64], *body;
+    cache_meta_t meta;
+    cache_stats_t cs;
+    cache_t cache;
+    double mean;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            entries = atol(optarg);
+            break;
+        case 's':
+            body_size = atol(optarg);
+            break;
+        case 'l':
+            lookups = atol(optarg);
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc == 0 || optind != argc || entries < 1 || lookups < 1 || body_size < 1) {
+        fprintf(stderr, "usage: %s [-n entries] [-s body] [-l lookups]\n", argv[0]);
+        exit(1);
+    }
+
+    /* Room for every object, so nothing is evicted */
+    budget = CACHE_MAX_BUDGET;
+    if ((uint64_t)entries * body_size > budget)
+        app_error("entries * body exceeds the largest cache budget");
+    if (cache_init(&cache, budget) < 0)
+        unix_error("cache_init");
+    cache_set_limits(&cache, budget, body_size, POLICY_LRU);
+    empty = cache_memory(&cache);
+
+    body = Malloc(body_size);
+    memset(body, 'x', body_size);
+    memset(&meta, 0, sizeof(meta));
+    meta.cache_class = CACHE_NORMAL;
+    start = now_nsec();
+    for (i = 0; i < entries; i++) {
+        key_bytes += make_key(key, i);
+        cache_insert(&cache, key, body, body_size, &meta);
+    }
+    insert_nsec = now_nsec() - start;
+    used = cache_memory(&cache) - empty;
+    cache_get_stats(&cache, &cs);
+
+    printf("entries %lu\nbody_bytes %lu\nkey_bytes_avg %.1f\n", (unsigned long)cs.entries,
+           (unsigned long)body_size, (double)key_bytes / entries);
+    printf("memory_bytes %lu\noverhead_bytes_per_entry %.1f\nentries_per_gb %.0f\n",
+           (unsigned long)used, ((double)used - key_bytes - (double)body_size * entries) / entries,
+           entries / ((double)used / (1 << 30)));
+    printf("insert_nsec_avg %.0f\n", (double)insert_nsec / entries);
+
+    lat = Calloc(lookups, sizeof(uint64_t));
+    mean = time_lookups(&cache, lookups, 0, entries, lat, &hits);
+    printf("hit_lookups %ld\nhit_nsec_avg %.0f\nhit_nsec_p50 %lu\nhit_nsec_p99 %lu\nhit_nsec_max %lu\n",
+           hits, mean, (unsigned long)lat[lookups / 2], (unsigned long)lat[lookups * 99 / 100],
+           (unsigned long)lat[lookups - 1]);
+    mean = time_lookups(&cache, lookups, entries, entries, lat, &hits);
+    printf("miss_nsec_avg %.0f\nmiss_nsec_p50 %lu\nmiss_nsec_p99 %lu\n", mean,
+           (unsigned long)lat[lookups / 2], (unsigned long)lat[lookups * 99 / 100]);
+    return 0;
+}
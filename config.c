@@ -0,0 +1,728 @@
+/*
+ * config.c - configuration file parsing and snapshot management
+ */
+#include "config.h"
+#include "cache.h"
+#include <limits.h>
+
+static config_t *current = NULL;
+static unsigned long next_version = 1;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The supervisor forks workers while its admin thread may hold
+ * config_lock; take the lock across fork so no child starts with it held.
+ */
+static void config_atfork_prepare(void) { pthread_mutex_lock(&config_lock); }
+static void config_atfork_release(void) { pthread_mutex_unlock(&config_lock); }
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+static void config_register_atfork(void) {
+    pthread_atfork(config_atfork_prepare, config_atfork_release, config_atfork_release);
+}
+
+/* Configuration Defaults: the compile-time values the proxy always used */
+config_t *config_default(void) {
+    config_t *config = Calloc(1, sizeof(config_t));
+
+    config->workers = 0;
+    config->cache_size = MAX_CACHE_SIZE;
+    config->cache_autosize = 0;
+    config->cache_size_min = 256 << 10;
+    config->cache_pinned_size = 0;
+    config->max_object_size = MAX_OBJECT_SIZE;
+    config->max_object_adapt = 0;
+    config->max_object_min = 16 << 10;
+    config->max_object_max = 1 << 20;
+    config->cache_policy = POLICY_LRU;
+    config->cache_sendfile = 1;
+    config->esi = 0;
+    config->follow_redirects = 0;
+    config->client_timeout = 0;
+    config->upstream_timeout = 0;
+    config->drain_timeout = 30;
+    config->relay_buffer = MAXBUF;
+    config->zerocopy = 0;
+    config->zerocopy_threshold = 64 << 10;
+    config->sched_slots = 0;
+    config->sched_quantum = 64 << 10;
+    config->sched_aging = 1 << 20;
+    config->client_abort = ABORT_CANCEL;
+    config->abort_finish_percent = 50;
+    config->listen_backlog = LISTENQ;
+    config->shadow_percent = 0;
+    config->shadow_queue = 64;
+    config->shadow_connections = 2;
+    config->threads_min = 4;
+    config->threads_max = 0;
+    config->parent_select = PARENT_FAILOVER;
+    config->parent_pool = 8;
+    config->h2_connections = 2;
+    config->h2_streams = 100;
+    config->h2_window = 1 << 20;
+    return config;
+}
+
+const char *config_policy_name(int policy) {
+    return policy == POLICY_FIFO ? "fifo" : "lru";
+}
+
+const char *config_abort_name(int action) {
+    return action == ABORT_FINISH ? "finish" : "cancel";
+}
+
+static const char *class_names[CACHE_CLASSES] = {"low", "normal", "high", "pinned"};
+
+const char *config_class_name(int cache_class) {
+    return class_names[cache_class];
+}
+
+/* Returns the cache class named, or -1 if there is no such class */
+int config_parse_class(const char *name) {
+    int i;
+
+    for (i = 0; i < CACHE_CLASSES; i++)
+        if (!strcasecmp(name, class_names[i]))
+            return i;
+    return -1;
+}
+
+/* Returns the policy named, or -1 if there is no such policy */
+int config_parse_policy(const char *name) {
+    if (!strcasecmp(name, "lru"))
+        return POLICY_LRU;
+    if (!strcasecmp(name, "fifo"))
+        return POLICY_FIFO;
+    return -1;
+}
+
+/* Parse a size such as "1049000", "512K" or "64M" */
+int config_parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return -1;
+    switch (toupper((unsigned char)*end)) {
+    case 'G': v <<= 10;  /* Fall through */
+    case 'M': v <<= 10;  /* Fall through */
+    case 'K': v <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    if (*end != '\0')
+        return -1;
+    *out = v;
+    return 0;
+}
+
+static int parse_int(const char *s, int min, int max, int *out) {
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno || end == s || *end != '\0' || v < min || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+/* Split "host:port" into its parts; the port is required. "unix:<path>" is kept whole. */
+static int parse_hostport(const char *s, char *host, char *port) {
+    const char *colon = strrchr(s, ':');
+
+    if (IS_UNIX_ADDR(s)) {
+        if (strlen(s) >= CONFIG_HOSTLEN || !s[strlen(UNIX_PREFIX)])
+            return -1;
+        strcpy(host, s);
+        port[0] = '\0';
+        return 0;
+    }
+
+    if (!colon || colon == s || colon - s >= CONFIG_HOSTLEN || strlen(colon + 1) >= 16 ||
+        !*(colon + 1))
+        return -1;
+    memcpy(host, s, colon - s);
+    host[colon - s] = '\0';
+    strcpy(port, colon + 1);
+    return 0;
+}
+
+/* route <name> <host>[/<path>] [key=value ...] */
+static int parse_route(config_t *config, char **argv, int argc, char *err, size_t errlen) {
+    route_t *route;
+    char *slash;
+    int i;
+
+    if (argc < 3) {
+        snprintf(err, errlen, "route needs a name and a host");
+        return -1;
+    }
+    if (config->nroutes == MAX_ROUTES) {
+        snprintf(err, errlen, "more than %d routes", MAX_ROUTES);
+        return -1;
+    }
+    route = &config->routes[config->nroutes];
+    memset(route, 0, sizeof(*route));
+    route->cache_class = CACHE_NORMAL;
+
+    if (strlen(argv[1]) >= CONFIG_NAMELEN || strlen(argv[2]) >= CONFIG_HOSTLEN) {
+        snprintf(err, errlen, "route name or host too long");
+        return -1;
+    }
+    strcpy(route->name, argv[1]);
+    strcpy(route->host, argv[2]);
+    if ((slash = strchr(route->host, '/'))) {
+        strcpy(route->path, slash);
+        *slash = '\0';
+    }
+
+    for (i = 3; i < argc; i++) {
+        if (!strncmp(argv[i], "profile=", 8) && strlen(argv[i] + 8) < CONFIG_NAMELEN) {
+            strcpy(route->profile, argv[i] + 8);
+        } else if (!strncmp(argv[i], "cache=", 6)) {
+            if ((route->cache_class = config_parse_class(argv[i] + 6)) < 0) {
+                snprintf(err, errlen, "bad cache class '%s'", argv[i] + 6);
+                return -1;
+            }
+        } else if (!strncmp(argv[i], "proto=", 6)) {
+            if (!strcmp(argv[i] + 6, "h2c"))
+                route->h2 = 1;
+            else if (strcmp(argv[i] + 6, "http1")) {
+                snprintf(err, errlen, "bad upstream protocol '%s'", argv[i] + 6);
+                return -1;
+            }
+        } else if (!strncmp(argv[i], "upstream=", 9)) {
+            if (parse_hostport(argv[i] + 9, route->upstream_host, route->upstream_port) < 0) {
+                snprintf(err, errlen, "bad upstream '%s'", argv[i] + 9);
+                return -1;
+            }
+        } else {
+            snprintf(err, errlen, "unknown route option '%s'", argv[i]);
+            return -1;
+        }
+    }
+    config->nroutes++;
+    return 0;
+}
+
+/* profile <name> [option=value ...] */
+static int parse_profile(config_t *config, char **argv, int argc, char *err, size_t errlen) {
+    sock_profile_t *prof;
+    char *value;
+    size_t size;
+    int i;
+
+    if (argc < 2 || strlen(argv[1]) >= CONFIG_NAMELEN) {
+        snprintf(err, errlen, "profile needs a name");
+        return -1;
+    }
+    if (config_find_profile(config, argv[1])) {
+        snprintf(err, errlen, "profile %s defined twice", argv[1]);
+        return -1;
+    }
+    if (config->nprofiles == MAX_PROFILES) {
+        snprintf(err, errlen, "more than %d profiles", MAX_PROFILES);
+        return -1;
+    }
+    prof = &config->profiles[config->nprofiles];
+    memset(prof, -1, sizeof(*prof));
+    strcpy(prof->name, argv[1]);
+
+    for (i = 2; i < argc; i++) {
+        if (!(value = strchr(argv[i], '=')))
+            goto bad;
+        *value++ = '\0';
+        if (!strcmp(argv[i], "nodelay")) {
+            if (!strcmp(value, "on"))
+                prof->nodelay = 1;
+            else if (!strcmp(value, "off"))
+                prof->nodelay = 0;
+            else
+                goto bad;
+        } else if (!strcmp(argv[i], "fastopen")) {
+            if (parse_int(value, 0, 65535, &prof->fastopen) < 0)
+                goto bad;
+        } else if (!strcmp(argv[i], "defer_accept")) {
+            if (parse_int(value, 0, 3600, &prof->defer_accept) < 0)
+                goto bad;
+        } else if (!strcmp(argv[i], "rcvbuf") || !strcmp(argv[i], "sndbuf") ||
+                   !strcmp(argv[i], "notsent_lowat")) {
+            if (config_parse_size(value, &size) < 0 || size > INT_MAX)
+                goto bad;
+            *(argv[i][0] == 'r' ? &prof->rcvbuf : argv[i][0] == 's' ? &prof->sndbuf
+              : &prof->notsent_lowat) = size;
+        } else if (!strcmp(argv[i], "keepalive")) {
+            if (!strcmp(value, "off")) {
+                prof->keepidle = 0;
+            } else if (sscanf(value, "%d,%d,%d", &prof->keepidle, &prof->keepintvl, &prof->keepcnt) != 3 ||
+                       prof->keepidle < 1 || prof->keepintvl < 1 || prof->keepcnt < 1) {
+                goto bad;
+            }
+        } else if (!strcmp(argv[i], "backlog")) {
+            if (parse_int(value, 1, 65535, &prof->backlog) < 0)
+                goto bad;
+        } else if (!strcmp(argv[i], "busy_poll")) {
+            if (parse_int(value, 0, 1000000, &prof->busy_poll) < 0)
+                goto bad;
+        } else {
+            snprintf(err, errlen, "unknown profile option '%s'", argv[i]);
+            return -1;
+        }
+    }
+    config->nprofiles++;
+    return 0;
+
+ bad:
+    snprintf(err, errlen, "bad profile option '%s'", argv[i]);
+    return -1;
+}
+
+/* parent <host>:<port> */
+static int parse_parent(config_t *config, char **argv, int argc, char *err, size_t errlen) {
+    parent_t *parent;
+
+    if (argc != 2) {
+        snprintf(err, errlen, "expected 'parent <host>:<port>'");
+        return -1;
+    }
+    if (config->nparents == MAX_PARENTS) {
+        snprintf(err, errlen, "more than %d parents", MAX_PARENTS);
+        return -1;
+    }
+    parent = &config->parents[config->nparents];
+    if (parse_hostport(argv[1], parent->host, parent->port) < 0) {
+        snprintf(err, errlen, "bad parent '%s'", argv[1]);
+        return -1;
+    }
+    config->nparents++;
+    return 0;
+}
+
+/* parent_bypass <host> ... */
+static int parse_bypass(config_t *config, char **argv, int argc, char *err, size_t errlen) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (config->nbypass == MAX_BYPASS || strlen(argv[i]) >= CONFIG_HOSTLEN) {
+            snprintf(err, errlen, "too many or too long bypass hosts");
+            return -1;
+        }
+        strcpy(config->bypass[config->nbypass++], argv[i]);
+    }
+    return 0;
+}
+
+/* The kinds of line that aren't "key = value", by their first word */
+typedef struct {
+    const char *word;
+    int (*parse)(config_t *config, char **argv, int argc, char *err, size_t errlen);
+} line_type_t;
+
+static const line_type_t line_types[] = {
+    {"route", parse_route},
+    {"profile", parse_profile},
+    {"parent", parse_parent},
+    {"parent_bypass", parse_bypass},
+    {NULL, NULL}
+};
+
+static const line_type_t *line_type(const char *p) {
+    const line_type_t *t;
+    size_t n;
+
+    for (t = line_types; t->word; t++) {
+        n = strlen(t->word);
+        if (!strncmp(p, t->word, n) && isspace((unsigned char)p[n]))
+            return t;
+    }
+    return NULL;
+}
+
+static int parse_setting(config_t *config, char *key, char *value, char *err, size_t errlen) {
+    size_t size;
+    int policy;
+
+    if (!strcmp(key, "port")) {
+        if (strlen(value) >= sizeof(config->port))
+            goto bad;
+        strcpy(config->port, value);
+    } else if (!strcmp(key, "workers")) {
+        if (parse_int(value, 0, MAX_WORKERS, &config->workers) < 0)
+            goto bad;
+    } else if (!strcmp(key, "cores")) {
+        if (parse_int(value, 0, MAX_CORES, &config->cores) < 0)
+            goto bad;
+    } else if (!strcmp(key, "cache_size")) {
+        if (config_parse_size(value, &config->cache_size) < 0)
+            goto bad;
+    } else if (!strcmp(key, "max_object_size")) {
+        if (config_parse_size(value, &config->max_object_size) < 0 || config->max_object_size == 0)
+            goto bad;
+    } else if (!strcmp(key, "cache_autosize")) {
+        if (!strcmp(value, "on"))
+            config->cache_autosize = 1;
+        else if (!strcmp(value, "off"))
+            config->cache_autosize = 0;
+        else
+            goto bad;
+    } else if (!strcmp(key, "cache_pinned_size")) {
+        if (config_parse_size(value, &config->cache_pinned_size) < 0)
+            goto bad;
+    } else if (!strcmp(key, "cache_size_min")) {
+        if (config_parse_size(value, &config->cache_size_min) < 0)
+            goto bad;
+    } else if (!strcmp(key, "max_object_adapt")) {
+        if (!strcmp(value, "on"))
+            config->max_object_adapt = 1;
+        else if (!strcmp(value, "off"))
+            config->max_object_adapt = 0;
+        else
+            goto bad;
+    } else if (!strcmp(key, "max_object_min") || !strcmp(key, "max_object_max")) {
+        if (config_parse_size(value, key[12] == 'i' ? &config->max_object_min
+                              : &config->max_object_max) < 0)
+            goto bad;
+    } else if (!strcmp(key, "esi")) {
+        if (!strcmp(value, "on"))
+            config->esi = 1;
+        else if (!strcmp(value, "off"))
+            config->esi = 0;
+        else
+            goto bad;
+    } else if (!strcmp(key, "follow_redirects")) {
+        if (parse_int(value, 0, MAX_REDIRECTS, &config->follow_redirects) < 0)
+            goto bad;
+    } else if (!strcmp(key, "cache_policy")) {
+        if ((policy = config_parse_policy(value)) < 0)
+            goto bad;
+        config->cache_policy = policy;
+    } else if (!strcmp(key, "cache_sendfile")) {
+        if (!strcmp(value, "on"))
+            config->cache_sendfile = 1;
+        else if (!strcmp(value, "off"))
+            config->cache_sendfile = 0;
+        else
+            goto bad;
+    } else if (!strcmp(key, "client_timeout")) {
+        if (parse_int(value, 0, 86400, &config->client_timeout) < 0)
+            goto bad;
+    } else if (!strcmp(key, "upstream_timeout")) {
+        if (parse_int(value, 0, 86400, &config->upstream_timeout) < 0)
+            goto bad;
+    } else if (!strcmp(key, "drain_timeout")) {
+        if (parse_int(value, 0, 86400, &config->drain_timeout) < 0)
+            goto bad;
+    } else if (!strcmp(key, "relay_buffer")) {
+        if (config_parse_size(value, &size) < 0 || size < MIN_RELAY_BUFFER || size > MAX_RELAY_BUFFER)
+            goto bad;
+        config->relay_buffer = size;
+    } else if (!strcmp(key, "zerocopy")) {
+        if (!strcmp(value, "on"))
+            config->zerocopy = 1;
+        else if (!strcmp(value, "off"))
+            config->zerocopy = 0;
+        else
+            goto bad;
+    } else if (!strcmp(key, "zerocopy_threshold")) {
+        if (config_parse_size(value, &config->zerocopy_threshold) < 0)
+            goto bad;
+    } else if (!strcmp(key, "sched_slots")) {
+        if (parse_int(value, 0, 4096, &config->sched_slots) < 0)
+            goto bad;
+    } else if (!strcmp(key, "sched_quantum")) {
+        if (config_parse_size(value, &config->sched_quantum) < 0 || config->sched_quantum < 1024)
+            goto bad;
+    } else if (!strcmp(key, "sched_aging")) {
+        if (config_parse_size(value, &config->sched_aging) < 0)
+            goto bad;
+    } else if (!strcmp(key, "client_abort")) {
+        if (!strcmp(value, "cancel"))
+            config->client_abort = ABORT_CANCEL;
+        else if (!strcmp(value, "finish"))
+            config->client_abort = ABORT_FINISH;
+        else
+            goto bad;
+    } else if (!strcmp(key, "abort_finish_percent")) {
+        if (parse_int(value, 0, 100, &config->abort_finish_percent) < 0)
+            goto bad;
+    } else if (!strcmp(key, "listen_backlog")) {
+        if (parse_int(value, 1, 65535, &config->listen_backlog) < 0)
+            goto bad;
+    } else if (!strcmp(key, "shadow_upstream")) {
+        if (parse_hostport(value, config->shadow_host, config->shadow_port) < 0)
+            goto bad;
+    } else if (!strcmp(key, "shadow_percent")) {
+        if (parse_int(value, 0, 100, &config->shadow_percent) < 0)
+            goto bad;
+    } else if (!strcmp(key, "shadow_queue")) {
+        if (parse_int(value, 1, SHADOW_MAX_QUEUE, &config->shadow_queue) < 0)
+            goto bad;
+    } else if (!strcmp(key, "shadow_connections")) {
+        if (parse_int(value, 1, SHADOW_MAX_CONNECTIONS, &config->shadow_connections) < 0)
+            goto bad;
+    } else if (!strcmp(key, "threads_min")) {
+        if (parse_int(value, 1, POOL_MAX_THREADS, &config->threads_min) < 0)
+            goto bad;
+    } else if (!strcmp(key, "threads_max")) {
+        if (parse_int(value, 0, POOL_MAX_THREADS, &config->threads_max) < 0)
+            goto bad;
+    } else if (!strcmp(key, "parent_select")) {
+        if (!strcmp(value, "failover"))
+            config->parent_select = PARENT_FAILOVER;
+        else if (!strcmp(value, "hash"))
+            config->parent_select = PARENT_HASH;
+        else
+            goto bad;
+    } else if (!strcmp(key, "parent_pool")) {
+        if (parse_int(value, 0, 1024, &config->parent_pool) < 0)
+            goto bad;
+    } else if (!strcmp(key, "h2_connections")) {
+        if (parse_int(value, 1, H2_MAX_CONNECTIONS, &config->h2_connections) < 0)
+            goto bad;
+    } else if (!strcmp(key, "h2_streams")) {
+        if (parse_int(value, 1, H2_MAX_STREAMS, &config->h2_streams) < 0)
+            goto bad;
+    } else if (!strcmp(key, "h2_window")) {
+        if (config_parse_size(value, &config->h2_window) < 0 ||
+            config->h2_window < H2_MIN_WINDOW || config->h2_window > H2_MAX_WINDOW)
+            goto bad;
+    } else if (!strcmp(key, "listen_profile") || !strcmp(key, "upstream_profile")) {
+        if (strlen(value) >= CONFIG_NAMELEN)
+            goto bad;
+        strcpy(key[0] == 'l' ? config->listen_profile : config->upstream_profile, value);
+    } else if (!strcmp(key, "admin_socket")) {
+        if (strlen(value) >= sizeof(config->admin_socket))
+            goto bad;
+        strcpy(config->admin_socket, value);
+    } else if (!strcmp(key, "access_log")) {
+        if (strlen(value) >= sizeof(config->access_log))
+            goto bad;
+        strcpy(config->access_log, value);
+    } else if (!strcmp(key, "instrument")) {
+        if (!strcmp(value, "on"))
+            config->instrument = 1;
+        else if (!strcmp(value, "off"))
+            config->instrument = 0;
+        else
+            goto bad;
+    } else {
+        snprintf(err, errlen, "unknown setting '%s'", key);
+        return -1;
+    }
+    return 0;
+
+ bad:
+    snprintf(err, errlen, "bad value '%s' for %s", value, key);
+    return -1;
+}
+
+/* The first profile name referred to but not defined, or NULL */
+static char *missing_profile(config_t *config) {
+    int i;
+
+    if (config->listen_profile[0] && !config_find_profile(config, config->listen_profile))
+        return config->listen_profile;
+    if (config->upstream_profile[0] && !config_find_profile(config, config->upstream_profile))
+        return config->upstream_profile;
+    for (i = 0; i < config->nroutes; i++)
+        if (config->routes[i].profile[0] && !config_find_profile(config, config->routes[i].profile))
+            return config->routes[i].profile;
+    return NULL;
+}
+
+/*
+ * config_load - Parse the configuration file at path into a new snapshot
+ *     (not yet installed). Returns NULL and describes the first problem
+ *     in errbuf if the file can't be read or has an error.
+ */
+config_t *config_load(const char *path, char *errbuf, size_t errlen) {
+    char line[MAXLINE], err[MAXLINE], *argv[16], *p, *eq, *key, *value, *save;
+    const line_type_t *type;
+    config_t *config;
+    int lineno = 0, argc;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r"))) {
+        snprintf(errbuf, errlen, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+    config = config_default();
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        p = line + strspn(line, " \t");
+
+        if ((type = line_type(p))) {
+            argc = 0;
+            for (p = strtok_r(p, " \t\r\n", &save); p && argc < 16; p = strtok_r(NULL, " \t\r\n", &save))
+                argv[argc++] = p;
+            if (type->parse(config, argv, argc, err, sizeof(err)) < 0)
+                goto fail;
+        } else if ((eq = strchr(p, '='))) {
+            *eq = '\0';
+            key = strtok_r(p, " \t", &save);
+            if (!key || strtok_r(NULL, " \t", &save) ||
+                !(value = strtok_r(eq + 1, " \t\r\n", &save)) || strtok_r(NULL, " \t\r\n", &save)) {
+                snprintf(err, sizeof(err), "expected 'key = value'");
+                goto fail;
+            }
+            if (parse_setting(config, key, value, err, sizeof(err)) < 0)
+                goto fail;
+        } else if (*p && !isspace((unsigned char)*p)) {
+            snprintf(err, sizeof(err), "expected 'key = value', or a route, profile or parent line");
+            goto fail;
+        }
+    }
+    fclose(fp);
+
+    if (config->cache_size > CACHE_MAX_BUDGET) {
+        snprintf(errbuf, errlen, "%s: cache_size is over the %lu byte limit", path,
+                 (unsigned long)CACHE_MAX_BUDGET);
+        free(config);
+        return NULL;
+    }
+    if (config->max_object_size > config->cache_size) {
+        snprintf(errbuf, errlen, "%s: max_object_size is larger than cache_size", path);
+        free(config);
+        return NULL;
+    }
+    if (config->cores && config->max_object_size > config->cache_size / config->cores) {
+        snprintf(errbuf, errlen, "%s: max_object_size is larger than a core's share of cache_size", path);
+        free(config);
+        return NULL;
+    }
+    if (config->cache_autosize && (config->cache_size_min > config->cache_size ||
+                                   config->cache_size_min < config->max_object_size)) {
+        snprintf(errbuf, errlen, "%s: cache_size_min must be between max_object_size and cache_size", path);
+        free(config);
+        return NULL;
+    }
+    if (config->cache_pinned_size > config->cache_size / 2) {
+        snprintf(errbuf, errlen, "%s: cache_pinned_size is over half of cache_size", path);
+        free(config);
+        return NULL;
+    }
+    if (config->max_object_adapt && config->max_object_min > config->max_object_max) {
+        snprintf(errbuf, errlen, "%s: max_object_min is larger than max_object_max", path);
+        free(config);
+        return NULL;
+    }
+    if (config->esi && config->cores) {
+        snprintf(errbuf, errlen, "%s: esi is not available in core mode", path);
+        free(config);
+        return NULL;
+    }
+    if (config->follow_redirects && config->cores) {
+        snprintf(errbuf, errlen, "%s: follow_redirects is not available in core mode", path);
+        free(config);
+        return NULL;
+    }
+    if (config->threads_max && config->threads_min > config->threads_max) {
+        snprintf(errbuf, errlen, "%s: threads_min is larger than threads_max", path);
+        free(config);
+        return NULL;
+    }
+    if ((p = missing_profile(config))) {
+        snprintf(errbuf, errlen, "%s: no profile named %s", path, p);
+        free(config);
+        return NULL;
+    }
+    return config;
+
+ fail:
+    snprintf(errbuf, errlen, "%s:%d: %s", path, lineno, err);
+    fclose(fp);
+    free(config);
+    return NULL;
+}
+
+/*
+ * config_install - Make config the current snapshot. The previous one is
+ *     freed once the last request using it lets go.
+ */
+void config_install(config_t *config) {
+    config_t *old;
+
+    pthread_once(&atfork_once, config_register_atfork);
+    pthread_mutex_lock(&config_lock);
+    config->version = next_version++;
+    config->refcount = 1;       /* The reference held by "current" */
+    old = current;
+    current = config;
+    pthread_mutex_unlock(&config_lock);
+
+    if (old)
+        config_put(old);
+}
+
+/* Take a reference to the current snapshot */
+config_t *config_get(void) {
+    config_t *config;
+
+    pthread_mutex_lock(&config_lock);
+    config = current;
+    config->refcount++;
+    pthread_mutex_unlock(&config_lock);
+    return config;
+}
+
+void config_put(config_t *config) {
+    int last;
+
+    pthread_mutex_lock(&config_lock);
+    last = (--config->refcount == 0);
+    pthread_mutex_unlock(&config_lock);
+    if (last)
+        free(config);
+}
+
+static int host_matches(const char *pattern, const char *host) {
+    size_t plen, hlen;
+
+    if (!strcmp(pattern, "*"))
+        return 1;
+    if (!strncmp(pattern, "*.", 2)) {
+        plen = strlen(pattern + 1);
+        hlen = strlen(host);
+        return hlen > plen && !strcasecmp(host + hlen - plen, pattern + 1);
+    }
+    return !strcasecmp(pattern, host);
+}
+
+/* Return the first route matching host and path, or NULL */
+route_t *config_match_route(config_t *config, const char *host, const char *path) {
+    int i;
+
+    for (i = 0; i < config->nroutes; i++) {
+        route_t *route = &config->routes[i];
+        if (host_matches(route->host, host) &&
+            !strncmp(path, route->path, strlen(route->path)))
+            return route;
+    }
+    return NULL;
+}
+
+/* The profile called name, or NULL if there is none (or name is "") */
+sock_profile_t *config_find_profile(config_t *config, const char *name) {
+    int i;
+
+    for (i = 0; name[0] && i < config->nprofiles; i++)
+        if (!strcmp(config->profiles[i].name, name))
+            return &config->profiles[i];
+    return NULL;
+}
+
+/* Whether misses for host go straight to the origin even though there are parents */
+int config_bypass_parent(config_t *config, const char *host) {
+    int i;
+
+    for (i = 0; i < config->nbypass; i++)
+        if (host_matches(config->bypass[i], host))
+            return 1;
+    return 0;
+}
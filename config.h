@@ -0,0 +1,189 @@
+/*
+ * config.h - runtime configuration with versioned snapshots
+ *
+ * The configuration file is read at startup and again on SIGHUP. Each
+ * successful load produces a new immutable snapshot; a request takes a
+ * reference to the current snapshot when it starts and keeps using it
+ * until it finishes, so a reload never changes settings under a request
+ * that is already running. A file that fails to parse leaves the
+ * current snapshot in place.
+ *
+ * File format: one "key = value" per line, or one of these per line:
+ *
+ *   route <name> <host>[/<path-prefix>] [upstream=<host>:<port> | upstream=unix:<path>]
+ *         [profile=<name>] [cache=low|normal|high|pinned] [proto=http1|h2c]
+ *   profile <name> [<option>=<value> ...]
+ *   parent <host>:<port>
+ *   parent_bypass <host> ...
+ *
+ * where <host> is an exact name, "*.suffix" or "*". A profile is a named
+ * set of socket options (see sock_profile_t); parents are tried in the
+ * order given. Blank lines and text after '#' are ignored.
+ */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "csapp.h"
+
+#define MAX_ROUTES      64
+#define MAX_PROFILES    16
+#define MAX_PARENTS     8
+#define MAX_BYPASS      32
+#define CONFIG_NAMELEN  64
+#define CONFIG_HOSTLEN  256
+
+/* Cache eviction policies */
+#define POLICY_LRU  0
+#define POLICY_FIFO 1
+
+/*
+ * Cache priority classes. Eviction takes the least recently used object
+ * of the lowest class that has any; pinned objects are never evicted to
+ * make room, only to keep within their own budget (cache_pinned_size).
+ */
+#define CACHE_LOW     0
+#define CACHE_NORMAL  1
+#define CACHE_HIGH    2
+#define CACHE_PINNED  3
+#define CACHE_CLASSES 4
+
+/* What to do with an upstream fetch when its client disconnects */
+#define ABORT_CANCEL 0       /* Stop reading from the origin at once */
+#define ABORT_FINISH 1       /* Finish into the cache if worth it */
+
+/* How a miss picks among parent proxies */
+#define PARENT_FAILOVER 0    /* The first one up, in order */
+#define PARENT_HASH     1    /* By hash of the origin host, then the next ones up */
+
+typedef struct {
+    char name[CONFIG_NAMELEN];
+    char host[CONFIG_HOSTLEN];           /* Exact host, "*.suffix" or "*" */
+    char path[CONFIG_HOSTLEN];           /* Path prefix, "" matches any */
+    char upstream_host[CONFIG_HOSTLEN];  /* Origin override or unix:<path>, "" for none */
+    char upstream_port[16];
+    char profile[CONFIG_NAMELEN];        /* Socket profile for upstreams, "" for the default */
+    int cache_class;                     /* CACHE_LOW .. CACHE_PINNED for what it caches */
+    int h2;                              /* Upstream speaks HTTP/2 with prior knowledge (see h2.h) */
+} route_t;
+
+/*
+ * Socket tuning profile. -1 leaves an option at the system default.
+ * Applied to a listener, accepted sockets inherit it.
+ */
+typedef struct {
+    char name[CONFIG_NAMELEN];
+    int nodelay;                /* nodelay=on|off: TCP_NODELAY */
+    int fastopen;               /* fastopen=<n>: TFO queue length on a listener; nonzero on an upstream connects with TFO */
+    int defer_accept;           /* defer_accept=<seconds>: TCP_DEFER_ACCEPT */
+    int rcvbuf;                 /* rcvbuf=<size>: SO_RCVBUF */
+    int sndbuf;                 /* sndbuf=<size>: SO_SNDBUF */
+    int notsent_lowat;          /* notsent_lowat=<size>: TCP_NOTSENT_LOWAT */
+    int keepidle;               /* keepalive=<idle>,<interval>,<count> in seconds, or off (0) */
+    int keepintvl;
+    int keepcnt;
+    int backlog;                /* backlog=<n>: listen() backlog, listeners only */
+    int busy_poll;              /* busy_poll=<usec>: SO_BUSY_POLL */
+} sock_profile_t;
+
+/* A parent proxy that misses are sent through */
+typedef struct {
+    char host[CONFIG_HOSTLEN];
+    char port[16];
+} parent_t;
+
+typedef struct config {
+    unsigned long version;
+    int refcount;
+
+    /* Startup only: changing these needs a restart or an upgrade */
+    char port[CONFIG_HOSTLEN];  /* TCP port, or unix:<path> */
+    char admin_socket[108];     /* Unix socket path, "" for none */
+
+    int workers;                /* 0: one threaded process */
+    int cores;                  /* Core mode: a thread per core, each owning a cache shard; 0: off */
+    size_t cache_size;          /* Cache budget in bytes; the most it may grow to if autosized */
+    int cache_autosize;         /* Follow memory pressure (see memwatch.h) */
+    size_t cache_size_min;      /* Least budget when autosized */
+    size_t cache_pinned_size;   /* Share of cache_size pinned objects may hold */
+    size_t max_object_size;
+    int max_object_adapt;       /* Tune max_object_size to traffic (see adapt.h) */
+    size_t max_object_min;      /* Bounds for it when tuned */
+    size_t max_object_max;
+    int cache_policy;
+    int cache_sendfile;         /* Send hits from the cache memfd with sendfile */
+    int esi;                    /* Assemble ESI page templates (see esi.h) */
+    int follow_redirects;       /* Redirect hops to follow for the client, 0: none */
+    int client_timeout;         /* Seconds, 0 for none */
+    int upstream_timeout;
+    int drain_timeout;
+    size_t relay_buffer;        /* Bytes per read when relaying a response */
+    int zerocopy;               /* MSG_ZEROCOPY for large client writes */
+    size_t zerocopy_threshold;  /* Smaller writes are plain copies */
+    int sched_slots;            /* Concurrent sends per process, 0: no scheduling */
+    size_t sched_quantum;       /* Bytes sent per slot grant */
+    size_t sched_aging;         /* Priority bytes gained per second of waiting */
+    int client_abort;           /* ABORT_CANCEL or ABORT_FINISH */
+    int abort_finish_percent;   /* Finish only once this much has arrived */
+    int listen_backlog;
+    char shadow_host[CONFIG_HOSTLEN];   /* Mirror sampled requests here, "" for none */
+    char shadow_port[16];
+    int shadow_percent;         /* Share of requests mirrored */
+    int shadow_queue;           /* Mirrors waiting per process before new ones drop */
+    int shadow_connections;     /* Mirror threads (and connections) per process */
+    int threads_min;            /* Connection thread pool bounds, per process; */
+    int threads_max;            /* threads_max 0: a thread per connection */
+    char access_log[CONFIG_HOSTLEN];  /* "" for stderr */
+    int instrument;             /* Access log on at startup or reload */
+
+    int nroutes;
+    route_t routes[MAX_ROUTES];
+
+    int nprofiles;
+    sock_profile_t profiles[MAX_PROFILES];
+    char listen_profile[CONFIG_NAMELEN];    /* "" for none */
+    char upstream_profile[CONFIG_NAMELEN];  /* For routes that don't name one */
+
+    int nparents;
+    parent_t parents[MAX_PARENTS];
+    int parent_select;          /* PARENT_FAILOVER or PARENT_HASH */
+    int parent_pool;            /* Idle connections kept per parent, per process */
+
+    int h2_connections;         /* HTTP/2 connections per upstream, per process */
+    int h2_streams;             /* Concurrent streams per connection */
+    size_t h2_window;           /* Receive window per stream, bytes */
+    int nbypass;
+    char bypass[MAX_BYPASS][CONFIG_HOSTLEN];  /* Hosts fetched directly, not via a parent */
+} config_t;
+
+/* Bounds enforced when loading (MAX_WORKERS also for -w) */
+#define MAX_WORKERS 64
+#define MIN_RELAY_BUFFER 512
+#define MAX_RELAY_BUFFER (1 << 20)
+#define SHADOW_MAX_QUEUE 4096
+#define SHADOW_MAX_CONNECTIONS 64
+#define MAX_CORES 64
+#define POOL_MAX_THREADS 4096
+#define MAX_REDIRECTS 10
+#define H2_MAX_CONNECTIONS 16
+#define H2_MAX_STREAMS 256
+#define H2_MIN_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+
+config_t *config_default(void);
+config_t *config_load(const char *path, char *errbuf, size_t errlen);
+const char *config_policy_name(int policy);
+const char *config_abort_name(int action);
+const char *config_class_name(int cache_class);
+int config_parse_class(const char *name);
+int config_parse_policy(const char *name);
+int config_parse_size(const char *s, size_t *out);
+
+void config_install(config_t *config);
+config_t *config_get(void);
+void config_put(config_t *config);
+
+route_t *config_match_route(config_t *config, const char *host, const char *path);
+sock_profile_t *config_find_profile(config_t *config, const char *name);
+int config_bypass_parent(config_t *config, const char *host);
+
+#endif /* __CONFIG_H__ */
@@ -0,0 +1,112 @@
+/*
+ * cores.c - shared-nothing thread-per-core plumbing
+ */
+#include "cores.h"
+#include <sys/syscall.h>
+
+static core_t *cores = NULL;
+static int ncores = 0;
+
+/* Returns 0, or -1 if the ring is full */
+int spsc_push(spsc_ring_t *ring, void *item) {
+    unsigned tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == CORE_RING_SIZE)
+        return -1;
+    ring->slots[tail & (CORE_RING_SIZE - 1)] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Returns the oldest item, or NULL if the ring is empty */
+void *spsc_pop(spsc_ring_t *ring) {
+    unsigned head = ring->head;
+    void *item;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    item = ring->slots[head & (CORE_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+/*
+ * cores_init - Set up n cores, each with a shard of budget / n bytes.
+ *     The shards are marked owned by the core threads, which must be
+ *     the only ones to use them. Returns 0, or -1 with errno set.
+ */
+int cores_init(int n, size_t budget) {
+    int i;
+
+    cores = Calloc(n, sizeof(core_t));
+    for (i = 0; i < n; i++) {
+        cores[i].id = i;
+        if (cache_init(&cores[i].cache, budget / n) < 0 || pipe(cores[i].wake) < 0)
+            return -1;
+        cache_set_owned(&cores[i].cache);
+        fcntl(cores[i].wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(cores[i].wake[1], F_SETFL, O_NONBLOCK);
+        if (posix_memalign((void **)&cores[i].rings, 64, n * sizeof(spsc_ring_t)))
+            return -1;
+        memset(cores[i].rings, 0, n * sizeof(spsc_ring_t));
+    }
+    ncores = n;
+    return 0;
+}
+
+int cores_count(void) {
+    return ncores;
+}
+
+core_t *cores_get(int id) {
+    return &cores[id];
+}
+
+/* The core owning key; the high hash bits, since the index buckets use the low ones */
+int cores_owner(const char *key) {
+    return (cache_key_hash(key) >> 32) % ncores;
+}
+
+/* Pin the calling thread to a CPU for core id, best effort */
+void cores_pin(int id) {
+#if defined(__linux__) && defined(SYS_sched_setaffinity)
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN), cpu;
+
+    if (cpus < 1)
+        return;
+    cpu = id % cpus % 1024;
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#endif
+}
+
+void cores_wake(core_t *core) {
+    char c = 0;
+
+    /* A full pipe already has the core's attention */
+    if (write(core->wake[1], &c, 1) < 0 && errno != EAGAIN)
+        fprintf(stderr, "core %d: wake failed: %s\n", core->id, strerror(errno));
+}
+
+/* Post msg to core's mailbox from any thread, and wake it */
+void cores_post(core_t *core, core_msg_t *msg) {
+    msg->next = __atomic_load_n(&core->mailbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&core->mailbox, &msg->next, msg, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    cores_wake(core);
+}
+
+/* Empty core's mailbox; returns the messages oldest first. Owner only. */
+core_msg_t *cores_take_mail(core_t *core) {
+    core_msg_t *msg = __atomic_exchange_n(&core->mailbox, NULL, __ATOMIC_ACQUIRE), *list = NULL, *next;
+
+    for (; msg; msg = next) {
+        next = msg->next;
+        msg->next = list;
+        list = msg;
+    }
+    return list;
+}
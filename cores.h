@@ -0,0 +1,65 @@
+/*
+ * cores.h - shared-nothing thread-per-core plumbing
+ *
+ * In core mode (cores = N) the proxy runs one thread per core, each
+ * pinned to a CPU and owning outright a private cache shard: the keys
+ * whose hash falls in its slice. Only the owner ever touches a shard,
+ * so shards take no lock (cache_set_owned).
+ *
+ * Cores talk through two kinds of queue, neither of which locks:
+ *
+ *   - every ordered pair of cores has a single-producer single-consumer
+ *     ring, on which the accepting core hands a connection to the core
+ *     that owns its URI;
+ *   - every core has a mailbox any thread may post to (a lock-free
+ *     stack the owner empties in one exchange), for work that comes
+ *     from outside the cores: responses to store, and connections that
+ *     could not take a ring.
+ *
+ * A core is woken through its pipe after anything is queued for it.
+ */
+#ifndef __CORES_H__
+#define __CORES_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include <stdint.h>
+
+#define CORE_RING_SIZE  256     /* Power of two */
+
+/* Single-producer single-consumer ring of pointers */
+typedef struct {
+    unsigned head __attribute__((aligned(64)));  /* Next to take; written by the consumer */
+    unsigned tail __attribute__((aligned(64)));  /* Next free; written by the producer */
+    void *slots[CORE_RING_SIZE];
+} spsc_ring_t;
+
+/* Header of a mailbox message; the sender embeds it first in its own struct */
+typedef struct core_msg {
+    struct core_msg *next;
+    int kind;
+} core_msg_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    int wake[2];                /* Pipe: a byte means "look at your queues" */
+    cache_t cache;              /* The shard this core owns */
+    spsc_ring_t *rings;         /* rings[i]: connections handed over by core i */
+    core_msg_t *mailbox;
+    unsigned long config_version;  /* Of the settings last applied to the shard */
+} core_t;
+
+int spsc_push(spsc_ring_t *ring, void *item);
+void *spsc_pop(spsc_ring_t *ring);
+
+int cores_init(int n, size_t budget);
+int cores_count(void);
+core_t *cores_get(int id);
+int cores_owner(const char *key);
+void cores_pin(int id);
+void cores_wake(core_t *core);
+void cores_post(core_t *core, core_msg_t *msg);
+core_msg_t *cores_take_mail(core_t *core);
+
+#endif /* __CORES_H__ */
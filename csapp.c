@@ -742,6 +742,8 @@ void V(sem_t *sem)
  * The Rio package - Robust I/O functions
  ****************************************/
 
+__thread syscall_counts_t syscall_counts;
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -753,6 +755,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
+	COUNT_SYSCALL(reads);
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* Interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
@@ -779,6 +782,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
+	COUNT_SYSCALL(writes);
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
@@ -807,6 +811,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	COUNT_SYSCALL(reads);
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
@@ -937,10 +942,66 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /******************************** 
  * Client/server helper functions
  ********************************/
+/*
+ * Unix-domain sockets: a hostname (open_clientfd) or port (open_listenfd)
+ * of the form "unix:<path>" names a socket file rather than an address.
+ */
+static int unix_sockaddr(char *name, struct sockaddr_un *addr) {
+    char *path = name + strlen(UNIX_PREFIX);
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int open_unix_clientfd(char *hostname, sock_setup_t setup, void *arg) {
+    struct sockaddr_un addr;
+    int clientfd;
+
+    if (unix_sockaddr(hostname, &addr) < 0)
+        return -1;
+    if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (setup)
+        setup(clientfd, arg);
+    COUNT_SYSCALL(connects);
+    if (connect(clientfd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
+static int open_unix_listenfd(char *port) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int listenfd;
+
+    if (unix_sockaddr(port, &addr) < 0)
+        return -1;
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    /* Replace a socket file left by an earlier server, but nothing else */
+    if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(addr.sun_path);
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. A hostname of
+ *     "unix:<path>" connects to that Unix-domain socket; port is unused.
  *
  *     On error, returns: 
  *       -2 for getaddrinfo error
@@ -948,9 +1009,20 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
+    return open_clientfd_setup(hostname, port, NULL, NULL);
+}
+
+/*
+ * open_clientfd_setup - open_clientfd, calling setup(fd, arg) on each
+ *     socket it tries before that socket connects (to set options).
+ */
+int open_clientfd_setup(char *hostname, char *port, sock_setup_t setup, void *arg) {
     int clientfd, rc;
     struct addrinfo hints, *listp, *p;
 
+    if (IS_UNIX_ADDR(hostname))
+        return open_unix_clientfd(hostname, setup, arg);
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
@@ -966,8 +1038,11 @@ int open_clientfd(char *hostname, char *port) {
         /* Create a socket descriptor */
         if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
             continue; /* Socket failed, try the next */
+        if (setup)
+            setup(clientfd, arg);
 
         /* Connect to the server */
+        COUNT_SYSCALL(connects);
         if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
             break; /* Success */
         if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
@@ -987,7 +1062,8 @@ int open_clientfd(char *hostname, char *port) {
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. A port of
+ *     "unix:<path>" listens on that Unix-domain socket instead.
  *
  *     On error, returns: 
  *       -2 for getaddrinfo error
@@ -999,6 +1075,9 @@ int open_listenfd(char *port)
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
 
+    if (IS_UNIX_ADDR(port))
+        return open_unix_listenfd(port);
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -60,6 +61,23 @@ extern char **environ; /* Defined by libc */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
 
+/* "unix:<path>" in place of a host or port names a Unix-domain socket */
+#define UNIX_PREFIX "unix:"
+#define IS_UNIX_ADDR(s) (strncmp((s), UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0)
+
+/*
+ * I/O system calls made by this thread: the Rio functions and client
+ * connects count themselves, other callers use COUNT_SYSCALL. Read as
+ * a before and after difference to charge them to a request.
+ */
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long connects;
+} syscall_counts_t;
+extern __thread syscall_counts_t syscall_counts;
+#define COUNT_SYSCALL(kind) (syscall_counts.kind++)
+
 /* Our own error-handling functions */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
@@ -187,7 +205,9 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Reentrant protocol-independent client/server helpers */
+typedef void (*sock_setup_t)(int fd, void *arg);
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_setup(char *hostname, char *port, sock_setup_t setup, void *arg);
 int open_listenfd(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
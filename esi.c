@@ -0,0 +1,226 @@
+/*
+ * esi.c - edge-side include assembly
+ */
+#include "esi.h"
+#include "http.h"
+#include "stats.h"
+
+/* One <esi:include>, fetched on its own thread */
+typedef struct {
+    const char *tag_start;      /* In the template body */
+    const char *tag_end;
+    char key[MAXLINE];          /* Absolute URL, the cache key */
+    int ttl;                    /* From the tag, -1 for none */
+    const char *client_headers;
+    cache_t *cache;
+    esi_fetch_t fetch;          /* How a miss is fetched, with fetch_arg */
+    void *fetch_arg;
+    char *body;                 /* Malloc'd fragment body, NULL if it failed */
+    size_t len;
+    pthread_t tid;
+} esi_include_t;
+
+/* Headers of the template not passed on: the assembled page has its own framing */
+static const char *dropped_headers[] = {
+    "Content-Length", "Connection", "Proxy-Connection", "Keep-Alive", "Transfer-Encoding",
+    "Surrogate-Control", NULL
+};
+
+/* Whether the response headers (hdr_end bytes at resp) mark a page template */
+int esi_is_template(const char *resp, size_t hdr_end) {
+    char value[MAXLINE];
+
+    return http_find_header(resp, hdr_end, "Surrogate-Control", value, sizeof(value)) &&
+        strstr(value, "ESI/1.0") != NULL;
+}
+
+/* Copy the value of attribute name in the tag [p, end) into value (size bytes); 1 if found */
+static int tag_attr(const char *p, const char *end, const char *name, char *value, size_t size) {
+    size_t n = strlen(name), len;
+    const char *v, *close;
+    char quote;
+
+    for (; p + n + 2 < end; p++) {
+        if (strncmp(p, name, n) || p[n] != '=' || !isspace((unsigned char)p[-1]))
+            continue;
+        quote = p[n + 1];
+        v = p + n + 2;
+        if ((quote != '"' && quote != '\'') || !(close = memchr(v, quote, end - v)))
+            return 0;
+        len = close - v < (ssize_t)size ? (size_t)(close - v) : size - 1;
+        memcpy(value, v, len);
+        value[len] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/* TTL for a fragment response: the tag's, else its max-age; 0 for none */
+static int fragment_ttl(int tag_ttl, const char *resp, size_t hdr_end) {
+    long fresh;
+
+    if (tag_ttl >= 0)
+        return tag_ttl;
+    return (fresh = http_freshness(resp, hdr_end)) > 0 ? fresh : 0;
+}
+
+/* Fetch an include's fragment through the cache */
+static void *fetch_include(void *arg) {
+    esi_include_t *inc = arg;
+    char *resp, *object;
+    size_t hdr_end;
+    ssize_t got, size;
+    cache_ref_t ref;
+    cache_meta_t meta;
+    int hit, ttl;
+
+    /* The key is the URL clients use too: only a plain 2xx response cached there will do */
+    hit = cache_acquire(inc->cache, inc->key, &ref);
+    if (hit && ((ref.flags & (CACHE_VARIANTS | CACHE_ESI)) || ref.status / 100 != 2)) {
+        cache_release(inc->cache, &ref);
+        hit = 0;
+    }
+    if (hit) {
+        inc->len = ref.size - ref.hdr_len;
+        inc->body = Malloc(inc->len + 1);
+        memcpy(inc->body, ref.data + ref.hdr_len, inc->len);
+        cache_release(inc->cache, &ref);
+        STAT_ADD(esi_fragment_hits, 1);
+        return NULL;
+    }
+
+    /* Only http URLs are fetched; the key, whatever else it is, misses */
+    if (strncasecmp(inc->key, "http://", 7)) {
+        STAT_ADD(esi_fragment_errors, 1);
+        return NULL;
+    }
+    resp = Malloc(ESI_MAX_FRAGMENT);
+    got = inc->fetch(inc->fetch_arg, inc->key, inc->client_headers, resp, ESI_MAX_FRAGMENT);
+    hdr_end = got > 0 ? http_header_end(resp, got) : 0;
+    if (!hdr_end || http_status(resp, got) / 100 != 2) {
+        STAT_ADD(esi_fragment_errors, 1);
+        Free(resp);
+        return NULL;
+    }
+    inc->len = got - hdr_end;
+    inc->body = Malloc(inc->len + 1);
+    memcpy(inc->body, resp + hdr_end, inc->len);
+    STAT_ADD(esi_fragments, 1);
+
+    if ((ttl = fragment_ttl(inc->ttl, resp, hdr_end)) > 0) {
+        object = Malloc(got + 64);
+        size = http_build_cached(resp, got, object, got + 64, &meta.hdr_len, &meta.status,
+                                 &meta.initial_age);
+        meta.flags = 0;
+        meta.expires = time(NULL) + ttl;
+        meta.cache_class = CACHE_NORMAL;
+        if (size >= 0)
+            cache_insert(inc->cache, inc->key, object, size, &meta);
+        Free(object);
+    }
+    Free(resp);
+    return NULL;
+}
+
+/* First occurrence of the n-byte needle in [p, end), or NULL */
+static const char *find_bytes(const char *p, const char *end, const char *needle, size_t n) {
+    for (; p + n <= end && (p = memchr(p, needle[0], end - p - n + 1)); p++)
+        if (!memcmp(p, needle, n))
+            return p;
+    return NULL;
+}
+
+/* Find the includes in body, filling incs; returns how many */
+static int find_includes(const char *uri, const char *body, size_t len, esi_include_t *incs) {
+    const char *p = body, *end = body + len, *close;
+    char src[MAXLINE], ttl[16];
+    size_t origin_len;
+    int n = 0;
+
+    /* Relative sources resolve against the page's scheme, host and port */
+    origin_len = strncasecmp(uri, "http://", 7) ? 0 : 7 + strcspn(uri + 7, "/");
+    while (n < ESI_MAX_INCLUDES && (p = find_bytes(p, end, "<esi:include", 12))) {
+        if (!(close = memchr(p, '>', end - p)))
+            break;
+        incs[n].tag_start = p;
+        incs[n].tag_end = close + 1;
+        /* Unless it closes itself, the closing tag is part of it too */
+        if (close[-1] != '/' && end - incs[n].tag_end >= 14 &&
+            !memcmp(incs[n].tag_end, "</esi:include>", 14))
+            incs[n].tag_end += 14;
+        incs[n].key[0] = '\0';
+        /* A source with no URL, or too long for one, is left out */
+        if (tag_attr(p, close, "src", src, sizeof(src)) &&
+            snprintf(incs[n].key, MAXLINE, "%.*s%s", src[0] == '/' ? (int)origin_len : 0, uri,
+                     src) >= MAXLINE)
+            incs[n].key[0] = '\0';
+        incs[n].ttl = tag_attr(p, close, "ttl", ttl, sizeof(ttl)) ? atoi(ttl) : -1;
+        p = incs[n++].tag_end;
+    }
+    return n;
+}
+
+/*
+ * esi_serve - Assemble the page whose template has the headers hdrs
+ *     (hdr_len bytes: a status line and header lines, with or without
+ *     the blank line) and body, and stream it to fd. Fragments not in
+ *     cache are fetched with fetch(fetch_arg, ...). Returns the bytes
+ *     sent, or -1 if the client went away.
+ */
+ssize_t esi_serve(int fd, cache_t *cache, const char *uri, const char *hdrs, size_t hdr_len,
+                  const char *body, size_t body_len, const char *client_headers,
+                  esi_fetch_t fetch, void *fetch_arg) {
+    esi_include_t *incs = Malloc(ESI_MAX_INCLUDES * sizeof(esi_include_t));
+    const char *p, *end = hdrs + hdr_len, *eol, *text = body;
+    char *head = Malloc(hdr_len + 64);
+    size_t n, o = 0, sent = 0;
+    int count, i, j, skip, ok;
+
+    STAT_ADD(esi_pages, 1);
+    count = find_includes(uri, body, body_len, incs);
+    for (i = 0; i < count; i++) {
+        incs[i].client_headers = client_headers;
+        incs[i].cache = cache;
+        incs[i].fetch = fetch;
+        incs[i].fetch_arg = fetch_arg;
+        incs[i].body = NULL;
+        if (!incs[i].key[0] || pthread_create(&incs[i].tid, NULL, fetch_include, &incs[i]) != 0)
+            incs[i].key[0] = '\0';
+    }
+
+    /* The template's status and headers, less its framing */
+    for (p = hdrs; p < end && (eol = memchr(p, '\n', end - p)) && eol - p > 1; p = eol + 1) {
+        n = eol + 1 - p;
+        for (j = 0, skip = 0; dropped_headers[j] && !skip && p != hdrs; j++)
+            skip = !strncasecmp(p, dropped_headers[j], strlen(dropped_headers[j])) &&
+                p[strlen(dropped_headers[j])] == ':';
+        if (!skip) {
+            memcpy(head + o, p, n);
+            o += n;
+        }
+    }
+    o += sprintf(head + o, "Connection: close\r\n\r\n");
+    ok = rio_writen(fd, head, o) == (ssize_t)o;
+    sent += ok ? o : 0;
+    Free(head);
+
+    /* Text goes out as soon as it is reached; each fragment is waited for in turn */
+    for (i = 0; i <= count; i++) {
+        n = (i < count ? incs[i].tag_start : body + body_len) - text;
+        if (ok && n && (ok = rio_writen(fd, (char *)text, n) == (ssize_t)n))
+            sent += n;
+        if (i == count)
+            break;
+        text = incs[i].tag_end;
+        if (!incs[i].key[0])
+            continue;
+        pthread_join(incs[i].tid, NULL);
+        if (ok && incs[i].body && incs[i].len &&
+            (ok = rio_writen(fd, incs[i].body, incs[i].len) == (ssize_t)incs[i].len))
+            sent += incs[i].len;
+        if (incs[i].body)
+            Free(incs[i].body);
+    }
+    Free(incs);
+    return ok ? (ssize_t)sent : -1;
+}
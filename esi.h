@@ -0,0 +1,46 @@
+/*
+ * esi.h - edge-side include assembly
+ *
+ * With esi on, a response carrying Surrogate-Control: content="ESI/1.0"
+ * is a page template. It is cached as it came (marked CACHE_ESI) and
+ * never sent as is: each time it is served, hit or miss, its
+ * <esi:include src="..."/> tags are replaced by the fragments they name.
+ *
+ * All of a page's fragments are requested at once, each on its own
+ * thread, through the cache: a fresh cached copy is used, else the
+ * fragment is fetched the way a miss for its URL would be (its route's
+ * upstream, a parent or h2c, under upstream_timeout), with the client's
+ * request headers so personalized fragments come out right, and cached
+ * for its TTL. The TTL is the tag's ttl attribute in seconds if it has one, else
+ * the fragment's Cache-Control s-maxage or max-age (http_freshness);
+ * without either, the fragment is not cached. The page is streamed
+ * in document order: the text before a fragment goes out at once, and
+ * only the fragment itself is waited for. It is close-delimited, since
+ * its length is not known up front.
+ *
+ * A fragment that fails or isn't 2xx is left out. Fragments are not
+ * themselves processed for ESI. Not available in core mode.
+ */
+#ifndef __ESI_H__
+#define __ESI_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define ESI_MAX_INCLUDES 64             /* Further tags in a page are dropped */
+#define ESI_MAX_FRAGMENT (1 << 20)      /* Bytes of a fragment response kept */
+
+/*
+ * Fetches the absolute http URL url upstream with the request headers
+ * headers, putting up to size bytes of its response in resp. Returns
+ * the bytes read, or -1 if it failed or the response was cut off.
+ */
+typedef ssize_t (*esi_fetch_t)(void *arg, const char *url, const char *headers, char *resp,
+                               size_t size);
+
+int esi_is_template(const char *resp, size_t hdr_end);
+ssize_t esi_serve(int fd, cache_t *cache, const char *uri, const char *hdrs, size_t hdr_len,
+                  const char *body, size_t body_len, const char *client_headers,
+                  esi_fetch_t fetch, void *fetch_arg);
+
+#endif /* __ESI_H__ */
@@ -0,0 +1,1098 @@
+/*
+ * h2.c - multiplexed HTTP/2 connections to upstreams
+ */
+#include "h2.h"
+#include "sockopt.h"
+#include "stats.h"
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+
+/* Frame types and flags (RFC 7540, section 6) */
+#define FRAME_DATA          0x0
+#define FRAME_HEADERS       0x1
+#define FRAME_PRIORITY      0x2
+#define FRAME_RST_STREAM    0x3
+#define FRAME_SETTINGS      0x4
+#define FRAME_PUSH_PROMISE  0x5
+#define FRAME_PING          0x6
+#define FRAME_GOAWAY        0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION  0x9
+
+#define FLAG_END_STREAM  0x1
+#define FLAG_ACK         0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED      0x8
+#define FLAG_PRIORITY    0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE      0x1
+#define SETTINGS_ENABLE_PUSH            0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+
+#define ERROR_NONE        0x0
+#define ERROR_PROTOCOL    0x1
+#define ERROR_CANCEL      0x8
+#define ERROR_COMPRESSION 0x9
+
+#define FRAME_HEADER      9
+#define DEFAULT_FRAME     16384         /* Largest frame we may send; we never ask for more */
+#define BLOCK_MAX         (1 << 18)     /* Largest response header block taken */
+#define TABLE_ENTRIES     (H2_TABLE_SIZE / 32)
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* Bytes gathered for writing later */
+typedef struct {
+    char *data;
+    size_t len, size;
+} h2_buf_t;
+
+typedef struct h2_stream {
+    uint32_t id;
+    int fd;                     /* Our end of the requester's socket pair, -1 once closed */
+    int refs;                   /* The connection's and the requester's */
+    int ok;                     /* The whole response reached the requester's socket */
+    int ended;                  /* END_STREAM seen: close once pending is written */
+    int head_sent;              /* The final response headers are out */
+    h2_buf_t pending;           /* Response bytes the requester's socket had no room for */
+    size_t received;            /* DATA bytes since the stream window was last reopened */
+    struct h2_stream *next;
+} h2_stream_t;
+
+/* HPACK dynamic table, newest entry first */
+typedef struct {
+    char *name[TABLE_ENTRIES];  /* Name and value in one allocation */
+    char *value[TABLE_ENTRIES];
+    int count;
+    size_t size, max_size;
+} hpack_table_t;
+
+typedef struct h2_conn {
+    char key[CONFIG_HOSTLEN + 16];  /* host:port of its upstream */
+    int fd;                     /* -1 while connecting */
+    int wake[2];                /* A new stream to poll for, or frames to send */
+    pthread_mutex_t out_lock;
+    h2_buf_t out;               /* Frames queued for its thread to send, under out_lock */
+    int connected;              /* Preface sent, and its thread running */
+    int dead;                   /* No new streams: going away, failed or idle */
+    int nstreams;
+    int max_streams;            /* Ours, or the upstream's if less */
+    int stream_limit;           /* h2_streams when it was opened */
+    uint32_t next_id;
+    uint32_t window;            /* Initial stream window we advertised */
+    size_t received;            /* DATA bytes since the connection window was last reopened */
+    time_t idle_since;
+    h2_stream_t *streams;
+
+    /* Owned by the connection's thread */
+    hpack_table_t table;
+    char *in;                   /* Frames read but not yet handled */
+    size_t in_len;
+    h2_buf_t block;             /* Header block being reassembled from CONTINUATIONs */
+    int in_block;
+    uint32_t block_stream;
+    int block_flags;
+    struct h2_conn *next;
+} h2_conn_t;
+
+/* Header block being turned into an HTTP/1.1 head for a stream */
+typedef struct {
+    h2_stream_t *stream;
+    h2_buf_t head;
+    int status;
+} head_ctx_t;
+
+/* Connections and their streams: h2_lock, then a connection's out_lock */
+static pthread_mutex_t h2_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t h2_cond = PTHREAD_COND_INITIALIZER;  /* A stream or connection freed up */
+static h2_conn_t *conns = NULL;
+
+/* RFC 7541, appendix A */
+static const char *static_table[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""},
+    {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+    {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* RFC 7541, appendix B: code and length in bits for each symbol, 256 being EOS */
+static const struct {
+    uint32_t code;
+    int bits;
+} huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/* The code is canonical: per length, first code, count, and where its symbols start */
+static uint32_t huffman_first[31];
+static int huffman_count[31], huffman_start[31];
+static short huffman_symbols[257];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void) {
+    int bits, sym, n = 0;
+
+    for (bits = 1; bits <= 30; bits++) {
+        huffman_start[bits] = n;
+        for (sym = 0; sym < 257; sym++) {
+            if (huffman_codes[sym].bits != bits)
+                continue;
+            if (!huffman_count[bits]++)
+                huffman_first[bits] = huffman_codes[sym].code;
+            huffman_symbols[n++] = sym;
+        }
+    }
+}
+
+/* Decode len Huffman-coded bytes at in to out (room for len * 8 / 5); returns the length, or -1 */
+static ssize_t huffman_decode(const unsigned char *in, size_t len, char *out) {
+    uint32_t code = 0;
+    size_t i, o = 0;
+    int bits = 0, bit, sym;
+
+    pthread_once(&huffman_once, huffman_init);
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((in[i] >> bit) & 1);
+            if (++bits > 30)
+                return -1;
+            if (huffman_count[bits] && code >= huffman_first[bits] &&
+                code - huffman_first[bits] < (uint32_t)huffman_count[bits]) {
+                if ((sym = huffman_symbols[huffman_start[bits] + code - huffman_first[bits]]) == 256)
+                    return -1;
+                out[o++] = sym;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    /* Up to 7 bits of padding, the start of EOS (all ones) */
+    return bits < 8 && code == (1u << bits) - 1 ? (ssize_t)o : -1;
+}
+
+static void buf_append(h2_buf_t *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->size) {
+        buf->size = (buf->len + len) * 2;
+        buf->data = Realloc(buf->data, buf->size);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buf_free(h2_buf_t *buf) {
+    Free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Decode an HPACK integer with a prefix of bits at *p; returns 0, or -1 if malformed */
+static int decode_int(const unsigned char **p, const unsigned char *end, int bits, size_t *value) {
+    size_t max = (1u << bits) - 1;
+    int shift = 0;
+
+    if (*p >= end)
+        return -1;
+    *value = *(*p)++ & max;
+    if (*value < max)
+        return 0;
+    do {
+        if (*p >= end || shift > 28)
+            return -1;
+        *value += (size_t)(**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    return 0;
+}
+
+/* Decode an HPACK string at *p into a new allocation (NUL-terminated); returns it, or NULL */
+static char *decode_string(const unsigned char **p, const unsigned char *end, size_t *len) {
+    int huffman = *p < end && (**p & 0x80);
+    ssize_t n;
+    size_t raw;
+    char *s;
+
+    if (decode_int(p, end, 7, &raw) < 0 || raw > (size_t)(end - *p))
+        return NULL;
+    s = Malloc(huffman ? raw * 8 / 5 + 1 : raw + 1);
+    if (huffman) {
+        if ((n = huffman_decode(*p, raw, s)) < 0) {
+            Free(s);
+            return NULL;
+        }
+        *len = n;
+    } else {
+        memcpy(s, *p, raw);
+        *len = raw;
+    }
+    s[*len] = '\0';
+    *p += raw;
+    return s;
+}
+
+/* Drop the oldest entries until size fits the table */
+static void table_evict(hpack_table_t *t, size_t size) {
+    while (t->count && t->size + size > t->max_size) {
+        t->count--;
+        t->size -= strlen(t->name[t->count]) + strlen(t->value[t->count]) + 32;
+        Free(t->name[t->count]);
+    }
+}
+
+static void table_add(hpack_table_t *t, const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t size = nlen + vlen + 32;
+    char *entry;
+
+    table_evict(t, size);
+    if (size > t->max_size)
+        return;  /* Bigger than the table: it just empties it */
+    entry = Malloc(nlen + vlen + 2);
+    memcpy(entry, name, nlen + 1);
+    memcpy(entry + nlen + 1, value, vlen + 1);
+    memmove(t->name + 1, t->name, t->count * sizeof(char *));
+    memmove(t->value + 1, t->value, t->count * sizeof(char *));
+    t->name[0] = entry;
+    t->value[0] = entry + nlen + 1;
+    t->count++;
+    t->size += size;
+}
+
+/* Entry index (1-based, static then dynamic) into *name and *value; returns 0, or -1 */
+static int table_get(hpack_table_t *t, size_t index, const char **name, const char **value) {
+    if (index >= 1 && index <= 61) {
+        *name = static_table[index - 1][0];
+        *value = static_table[index - 1][1];
+        return 0;
+    }
+    if (index < 62 || index - 62 >= (size_t)t->count)
+        return -1;
+    *name = t->name[index - 62];
+    *value = t->value[index - 62];
+    return 0;
+}
+
+typedef void (*header_fn)(void *arg, const char *name, const char *value, size_t vlen);
+
+/*
+ * hpack_decode - Decode the header block at block, updating the dynamic
+ *     table t, and call emit with each header. Returns 0, or -1 if the
+ *     block is malformed (the table can no longer be trusted).
+ */
+static int hpack_decode(hpack_table_t *t, const unsigned char *block, size_t len, header_fn emit, void *arg) {
+    const unsigned char *p = block, *end = block + len;
+    const char *name, *value;
+    char *new_name, *new_value;
+    size_t index, nlen, vlen;
+    int bits, indexing;
+
+    while (p < end) {
+        if (*p & 0x80) {  /* Indexed */
+            if (decode_int(&p, end, 7, &index) < 0 || table_get(t, index, &name, &value) < 0)
+                return -1;
+            emit(arg, name, value, strlen(value));
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20) {  /* Table size update */
+            if (decode_int(&p, end, 5, &index) < 0 || index > H2_TABLE_SIZE)
+                return -1;
+            t->max_size = index;
+            table_evict(t, 0);
+            continue;
+        }
+        /* A literal: with incremental indexing, or without, or never indexed */
+        indexing = (*p & 0xc0) == 0x40;
+        bits = indexing ? 6 : 4;
+        if (decode_int(&p, end, bits, &index) < 0)
+            return -1;
+        new_name = NULL;
+        if (index) {
+            if (table_get(t, index, &name, &value) < 0)
+                return -1;
+            nlen = strlen(name);
+        } else if (!(name = new_name = decode_string(&p, end, &nlen))) {
+            return -1;
+        }
+        if (!(new_value = decode_string(&p, end, &vlen))) {
+            Free(new_name);
+            return -1;
+        }
+        emit(arg, name, new_value, vlen);
+        if (indexing)
+            table_add(t, name, nlen, new_value, vlen);
+        Free(new_name);
+        Free(new_value);
+    }
+    return 0;
+}
+
+/* Encode an HPACK integer with a prefix of bits, the flags in first; returns its length */
+static size_t encode_int(unsigned char *out, int bits, unsigned char first, size_t value) {
+    size_t max = (1u << bits) - 1, n = 0;
+
+    if (value < max) {
+        out[n++] = first | value;
+        return n;
+    }
+    out[n++] = first | max;
+    for (value -= max; value >= 0x80; value >>= 7)
+        out[n++] = (value & 0x7f) | 0x80;
+    out[n++] = value;
+    return n;
+}
+
+/* A string literal, not Huffman coded */
+static size_t encode_string(unsigned char *out, const char *s, size_t len) {
+    size_t n = encode_int(out, 7, 0, len);
+
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+/* A literal header, never indexed, with a static table name if index */
+static size_t encode_header(unsigned char *out, size_t index, const char *name, size_t nlen,
+                            const char *value, size_t vlen) {
+    size_t n = encode_int(out, 4, 0x10, index);
+
+    if (!index)
+        n += encode_string(out + n, name, nlen);
+    return n + encode_string(out + n, value, vlen);
+}
+
+/* Headers HTTP/2 forbids or carries otherwise (RFC 7540, section 8.1.2.2) */
+static const char *skip_headers[] = {
+    "host", "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "te", NULL
+};
+
+/*
+ * encode_request - The HEADERS block for GET path from authority, with
+ *     the client's forwarded headers (as lines) and the proxy's
+ *     User-Agent. Returns its length, or -1 if it won't fit in out.
+ */
+static ssize_t encode_request(unsigned char *out, size_t size, const char *authority,
+                              const char *path, const char *headers) {
+    static const char user_agent[] =
+        "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
+    char name[MAXLINE];
+    const char *line, *colon, *eol, *value;
+    size_t n, nlen, vlen, i;
+    int skip;
+
+    if (strlen(authority) + strlen(path) + sizeof(user_agent) + 32 > size)
+        return -1;
+    out[0] = 0x82;  /* :method GET */
+    out[1] = 0x86;  /* :scheme http */
+    n = 2;
+    n += encode_header(out + n, 4, NULL, 0, path, strlen(path));
+    n += encode_header(out + n, 1, NULL, 0, authority, strlen(authority));
+    n += encode_header(out + n, 58, NULL, 0, user_agent, sizeof(user_agent) - 1);
+
+    for (line = headers; *line; line = eol) {
+        eol = strchr(line, '\n');
+        eol = eol ? eol + 1 : line + strlen(line);
+        if (!(colon = memchr(line, ':', eol - line)) || (nlen = colon - line) >= sizeof(name))
+            continue;
+        for (i = 0; i < nlen; i++)
+            name[i] = tolower((unsigned char)line[i]);
+        name[nlen] = '\0';
+        for (i = 0, skip = 0; skip_headers[i] && !skip; i++)
+            skip = !strcmp(name, skip_headers[i]);
+        for (value = colon + 1; value < eol && (*value == ' ' || *value == '\t'); value++)
+            ;
+        for (vlen = eol - value; vlen && isspace((unsigned char)value[vlen - 1]); vlen--)
+            ;
+        if (skip)
+            continue;
+        if (n + nlen + vlen + 16 > size)
+            return -1;
+        n += encode_header(out + n, 0, name, nlen, value, vlen);
+    }
+    return n;
+}
+
+/* Queue one frame for the connection's thread to send; out_lock keeps frames whole between threads */
+static void queue_frame(h2_conn_t *c, int type, int flags, uint32_t id, const void *payload, size_t len) {
+    unsigned char header[FRAME_HEADER];
+
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, id);
+    pthread_mutex_lock(&c->out_lock);
+    buf_append(&c->out, header, FRAME_HEADER);
+    if (len)
+        buf_append(&c->out, payload, len);
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+/* Send the frames queued so far; the connection's thread only, never under h2_lock. Returns 0, or -1 */
+static int send_queued(h2_conn_t *c) {
+    h2_buf_t out;
+    int rc;
+
+    pthread_mutex_lock(&c->out_lock);
+    out = c->out;
+    memset(&c->out, 0, sizeof(c->out));
+    pthread_mutex_unlock(&c->out_lock);
+    rc = out.len && rio_writen(c->fd, out.data, out.len) < 0 ? -1 : 0;
+    buf_free(&out);
+    return rc;
+}
+
+static void write_u32_frame(h2_conn_t *c, int type, uint32_t id, uint32_t value) {
+    unsigned char payload[4];
+
+    put32(payload, value);
+    queue_frame(c, type, 0, id, payload, 4);
+}
+
+static void stream_put(h2_stream_t *s) {
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        buf_free(&s->pending);
+        Free(s);
+    }
+}
+
+static h2_stream_t *find_stream(h2_conn_t *c, uint32_t id) {
+    h2_stream_t *s;
+
+    for (s = c->streams; s && s->id != id; s = s->next)
+        ;
+    return s;
+}
+
+/* Take s off the connection, closing our end; h2_lock held, connection thread only */
+static void remove_stream(h2_conn_t *c, h2_stream_t *s) {
+    h2_stream_t **link;
+
+    for (link = &c->streams; *link != s; link = &(*link)->next)
+        ;
+    *link = s->next;
+    close(s->fd);
+    if (--c->nstreams == 0)
+        c->idle_since = time(NULL);
+    stream_put(s);
+    pthread_cond_broadcast(&h2_cond);
+}
+
+/* A stream the upstream reset or never answered: the requester sees EOF, and h2_done says so */
+static void fail_stream(h2_conn_t *c, h2_stream_t *s) {
+    STAT_ADD(h2_errors, 1);
+    remove_stream(c, s);
+}
+
+/* No more streams on c, and those open fail; h2_lock held */
+static void fail_connection(h2_conn_t *c) {
+    c->dead = 1;
+    while (c->streams)
+        fail_stream(c, c->streams);
+}
+
+/* A connection error: tell the upstream why, and give up on it */
+static void connection_error(h2_conn_t *c, uint32_t code) {
+    unsigned char payload[8];
+
+    put32(payload, 0);
+    put32(payload + 4, code);
+    queue_frame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+    fail_connection(c);
+}
+
+/* Reopen s's window by what the requester has taken, once it is half used */
+static void reopen_window(h2_conn_t *c, h2_stream_t *s) {
+    size_t taken = s->received - s->pending.len;
+
+    if (s->received >= s->pending.len && taken >= c->window / 2) {
+        write_u32_frame(c, FRAME_WINDOW_UPDATE, s->id, taken);
+        s->received -= taken;
+    }
+}
+
+/* Write out what the requester's socket takes; the stream is done once it is all out */
+static void flush_stream(h2_conn_t *c, h2_stream_t *s) {
+    ssize_t n = 0;
+
+    if (s->pending.len) {
+        n = send(s->fd, s->pending.data, s->pending.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0)
+            n = 0;  /* Full, or the requester is gone and poll will say so */
+        memmove(s->pending.data, s->pending.data + n, s->pending.len - n);
+        s->pending.len -= n;
+    }
+    if (s->ended && !s->pending.len) {
+        __atomic_store_n(&s->ok, 1, __ATOMIC_RELEASE);
+        remove_stream(c, s);
+        return;
+    }
+    if (n)
+        reopen_window(c, s);
+}
+
+static void deliver(h2_stream_t *s, const char *data, size_t len) {
+    buf_append(&s->pending, data, len);
+}
+
+static const char *reason_phrase(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+/* One response header, as an HTTP/1.1 line; :status comes first */
+static void head_header(void *arg, const char *name, const char *value, size_t vlen) {
+    head_ctx_t *ctx = arg;
+    char line[64];
+
+    if (!strcmp(name, ":status")) {
+        ctx->status = atoi(value);
+        snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", ctx->status, reason_phrase(ctx->status));
+        buf_append(&ctx->head, line, strlen(line));
+    } else if (name[0] != ':' && ctx->status > 0) {
+        buf_append(&ctx->head, name, strlen(name));
+        buf_append(&ctx->head, ": ", 2);
+        buf_append(&ctx->head, value, vlen);
+        buf_append(&ctx->head, "\r\n", 2);
+    }
+}
+
+/* A whole header block: the response head, an interim response, or trailers */
+static int end_block(h2_conn_t *c) {
+    h2_stream_t *s = find_stream(c, c->block_stream);
+    head_ctx_t ctx;
+    int rc;
+
+    memset(&ctx, 0, sizeof(ctx));
+    rc = hpack_decode(&c->table, (unsigned char *)c->block.data, c->block.len, head_header, &ctx);
+    c->block.len = 0;
+    if (rc < 0) {
+        buf_free(&ctx.head);
+        return -1;
+    }
+    if (s && !s->head_sent && ctx.status >= 200) {
+        buf_append(&ctx.head, "Connection: close\r\n\r\n", 21);
+        deliver(s, ctx.head.data, ctx.head.len);
+        s->head_sent = 1;
+    }
+    buf_free(&ctx.head);
+    if (s && (c->block_flags & FLAG_END_STREAM)) {
+        s->ended = 1;
+        flush_stream(c, s);
+    }
+    return 0;
+}
+
+/* Strip padding (and priority) from a frame's payload; returns 0, or -1 if malformed */
+static int unpad(int flags, int priority, const unsigned char **p, size_t *len) {
+    size_t pad = 0;
+
+    if (flags & FLAG_PADDED) {
+        if (*len < 1)
+            return -1;
+        pad = **p;
+        (*p)++;
+        (*len)--;
+    }
+    if (priority && (flags & FLAG_PRIORITY)) {
+        if (*len < 5)
+            return -1;
+        *p += 5;
+        *len -= 5;
+    }
+    if (pad > *len)
+        return -1;
+    *len -= pad;
+    return 0;
+}
+
+/* Handle one frame from the upstream; h2_lock held. Returns 0, or an error code for GOAWAY */
+static int handle_frame(h2_conn_t *c, int type, int flags, uint32_t id, const unsigned char *p, size_t len) {
+    h2_stream_t *s, *next;
+    size_t i, flow = len;
+    uint32_t value;
+
+    if (c->in_block && type != FRAME_CONTINUATION)
+        return ERROR_PROTOCOL;  /* A header block must not be interleaved */
+
+    switch (type) {
+    case FRAME_DATA:
+        if (!id || unpad(flags, 0, &p, &len) < 0)
+            return ERROR_PROTOCOL;
+        if ((c->received += flow) >= H2_MAX_WINDOW / 2) {
+            write_u32_frame(c, FRAME_WINDOW_UPDATE, 0, c->received);
+            c->received = 0;
+        }
+        if (!(s = find_stream(c, id)))
+            return 0;  /* Already reset */
+        s->received += flow;
+        deliver(s, (const char *)p, len);
+        if (flags & FLAG_END_STREAM)
+            s->ended = 1;
+        flush_stream(c, s);
+        return 0;
+
+    case FRAME_HEADERS:
+        if (!id || unpad(flags, 1, &p, &len) < 0)
+            return ERROR_PROTOCOL;
+        c->in_block = 1;
+        c->block_stream = id;
+        c->block_flags = flags;
+        /* Fall through: the fragment starts the block */
+    case FRAME_CONTINUATION:
+        if (!c->in_block || id != c->block_stream || c->block.len + len > BLOCK_MAX)
+            return ERROR_PROTOCOL;
+        buf_append(&c->block, p, len);
+        if (!(flags & FLAG_END_HEADERS))
+            return 0;
+        c->in_block = 0;
+        return end_block(c) < 0 ? ERROR_COMPRESSION : 0;
+
+    case FRAME_RST_STREAM:
+        if ((s = find_stream(c, id)))
+            fail_stream(c, s);
+        return 0;
+
+    case FRAME_SETTINGS:
+        if (flags & FLAG_ACK)
+            return 0;
+        if (len % 6)
+            return ERROR_PROTOCOL;
+        for (i = 0; i < len; i += 6) {
+            value = get32(p + i + 2);
+            if ((p[i] << 8 | p[i + 1]) == SETTINGS_MAX_CONCURRENT_STREAMS)
+                c->max_streams = value < (uint32_t)c->stream_limit ? (int)value : c->stream_limit;
+        }
+        queue_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        pthread_cond_broadcast(&h2_cond);
+        return 0;
+
+    case FRAME_PING:
+        if (len != 8)
+            return ERROR_PROTOCOL;
+        if (!(flags & FLAG_ACK))
+            queue_frame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+        return 0;
+
+    case FRAME_GOAWAY:
+        if (len < 8)
+            return ERROR_PROTOCOL;
+        /* Streams after the last one it took will never be answered */
+        value = get32(p) & 0x7fffffff;
+        c->dead = 1;
+        for (s = c->streams; s; s = next) {
+            next = s->next;
+            if (s->id > value)
+                fail_stream(c, s);
+        }
+        return 0;
+
+    case FRAME_PUSH_PROMISE:
+        return ERROR_PROTOCOL;  /* Refused in our SETTINGS */
+
+    default:  /* PRIORITY, WINDOW_UPDATE (we send no bodies), and extensions */
+        return 0;
+    }
+}
+
+/* Handle the whole frames read so far; h2_lock held. Returns 0, or -1 if the connection failed */
+static int handle_input(h2_conn_t *c) {
+    unsigned char *f;
+    size_t len, used = 0;
+    int code;
+
+    while (c->in_len - used >= FRAME_HEADER) {
+        f = (unsigned char *)c->in + used;
+        len = f[0] << 16 | f[1] << 8 | f[2];
+        if (len > H2_FRAME_SIZE) {
+            connection_error(c, ERROR_PROTOCOL);
+            return -1;
+        }
+        if (c->in_len - used < FRAME_HEADER + len)
+            break;
+        if ((code = handle_frame(c, f[3], f[4], get32(f + 5) & 0x7fffffff, f + FRAME_HEADER, len))) {
+            connection_error(c, code);
+            return -1;
+        }
+        used += FRAME_HEADER + len;
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    return 0;
+}
+
+static void free_connection(h2_conn_t *c) {
+    while (c->table.count)
+        Free(c->table.name[--c->table.count]);
+    if (c->fd >= 0)
+        close(c->fd);
+    close(c->wake[0]);
+    close(c->wake[1]);
+    pthread_mutex_destroy(&c->out_lock);
+    buf_free(&c->out);
+    buf_free(&c->block);
+    Free(c->in);
+    Free(c);
+}
+
+/*
+ * conn_thread - Run a connection: read and handle the upstream's frames,
+ *     write stream data on to requesters as their sockets take it, and
+ *     reset streams whose requester closed its end. It alone writes to
+ *     the upstream, sending what was queued outside h2_lock. A failure
+ *     fails this connection's streams, never the process. Frees the
+ *     connection once it is dead (or idle too long) with no streams left.
+ */
+static void *conn_thread(void *arg) {
+    h2_conn_t *c = arg, **link;
+    struct pollfd fds[H2_MAX_STREAMS + 2];
+    h2_stream_t *polled[H2_MAX_STREAMS + 2], *s;
+    char drain[64];
+    ssize_t n;
+    int nfds, ready, i;
+
+    Pthread_detach(pthread_self());
+    for (;;) {
+        pthread_mutex_lock(&h2_lock);
+        if (!c->nstreams && !c->dead && time(NULL) - c->idle_since > H2_IDLE_MAX)
+            connection_error(c, ERROR_NONE);
+        if (c->dead && !c->nstreams) {
+            for (link = &conns; *link != c; link = &(*link)->next)
+                ;
+            *link = c->next;
+            pthread_cond_broadcast(&h2_cond);
+            pthread_mutex_unlock(&h2_lock);
+            send_queued(c);  /* A GOAWAY, say */
+            free_connection(c);
+            return NULL;
+        }
+        fds[0].fd = c->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = c->wake[0];
+        fds[1].events = POLLIN;
+        nfds = 2;
+        for (s = c->streams; s && nfds < H2_MAX_STREAMS + 2; s = s->next) {
+            /* The requester never writes: readable means it closed its end */
+            fds[nfds].fd = s->fd;
+            fds[nfds].events = POLLIN | (s->pending.len ? POLLOUT : 0);
+            polled[nfds++] = s;
+        }
+        pthread_mutex_unlock(&h2_lock);
+
+        if (send_queued(c) < 0 || ((ready = poll(fds, nfds, 1000)) < 0 && errno != EINTR)) {
+            /* This connection is lost, and only its streams fail with it */
+            pthread_mutex_lock(&h2_lock);
+            fail_connection(c);
+            pthread_mutex_unlock(&h2_lock);
+            continue;
+        }
+        if (ready < 0)
+            continue;
+        if (fds[1].revents)
+            while (read(c->wake[0], drain, sizeof(drain)) > 0)
+                ;
+
+        pthread_mutex_lock(&h2_lock);
+        for (i = 2; i < nfds; i++) {
+            s = polled[i];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                /* The client went away: stop the upstream sending the rest */
+                if (!s->ended) {
+                    write_u32_frame(c, FRAME_RST_STREAM, s->id, ERROR_CANCEL);
+                    STAT_ADD(h2_cancelled, 1);
+                }
+                remove_stream(c, s);
+            } else if (fds[i].revents & POLLOUT) {
+                flush_stream(c, s);
+            }
+        }
+        if (fds[0].revents) {
+            COUNT_SYSCALL(reads);
+            n = read(c->fd, c->in + c->in_len, 2 * (FRAME_HEADER + H2_FRAME_SIZE) - c->in_len);
+            if (n > 0) {
+                c->in_len += n;
+                handle_input(c);
+            } else if (n == 0 || errno != EINTR) {
+                fail_connection(c);
+            }
+        }
+        pthread_mutex_unlock(&h2_lock);
+    }
+}
+
+/*
+ * conn_open - Connect c to its upstream and start the connection: the
+ *     preface, our SETTINGS, and the connection window opened all the
+ *     way. Returns 0, or -1 if it could not.
+ */
+static int conn_open(h2_conn_t *c, char *host, char *port, sock_profile_t *profile) {
+    unsigned char settings[5 * 6], increment[4];
+    static const struct {
+        int id;
+        uint32_t value;
+    } ours[] = {
+        {SETTINGS_HEADER_TABLE_SIZE, H2_TABLE_SIZE},
+        {SETTINGS_ENABLE_PUSH, 0},
+        {SETTINGS_MAX_CONCURRENT_STREAMS, 0},   /* For pushes, which we refuse */
+        {SETTINGS_MAX_FRAME_SIZE, H2_FRAME_SIZE},
+        {SETTINGS_INITIAL_WINDOW_SIZE, 0},      /* Filled in below */
+    };
+    int i, one = 1;
+    pthread_t tid;
+
+    if ((c->fd = open_clientfd_setup(host, port, profile ? sockopt_setup_upstream : NULL, profile)) < 0)
+        return -1;
+    /* Frames are small and interleaved; Nagle would hold them back */
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    for (i = 0; i < 5; i++) {
+        settings[i * 6] = ours[i].id >> 8;
+        settings[i * 6 + 1] = ours[i].id;
+        put32(settings + i * 6 + 2, ours[i].id == SETTINGS_INITIAL_WINDOW_SIZE ? c->window : ours[i].value);
+    }
+    put32(increment, H2_MAX_WINDOW - 65535);
+    queue_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    queue_frame(c, FRAME_WINDOW_UPDATE, 0, 0, increment, 4);
+    c->in = Malloc(2 * (FRAME_HEADER + H2_FRAME_SIZE));
+    c->idle_since = time(NULL);
+    if (rio_writen(c->fd, (void *)preface, sizeof(preface) - 1) < 0 || send_queued(c) < 0 ||
+        pthread_create(&tid, NULL, conn_thread, c) != 0) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    STAT_ADD(h2_connections, 1);
+    return 0;
+}
+
+/*
+ * h2_request - Send GET path to the upstream at host:port (connecting
+ *     with profile, if any) as a stream on a pooled HTTP/2 connection,
+ *     with the client's forwarded headers (lines, as from
+ *     process_headers). Returns 0 with the response to read from
+ *     req->fd, or -1 if no connection could be had, none had room for
+ *     a stream in time, or the request is too big for one frame.
+ *     Finish with h2_done.
+ */
+int h2_request(config_t *config, char *host, char *port, sock_profile_t *profile,
+               const char *authority, const char *path, const char *headers, h2_req_t *req) {
+    unsigned char block[DEFAULT_FRAME];
+    ssize_t block_len = encode_request(block, sizeof(block), authority, path, headers);
+    char key[CONFIG_HOSTLEN + 16];
+    h2_conn_t *c, *best, **link;
+    h2_stream_t *s;
+    struct timespec deadline;
+    int count, sv[2], wake[2], sndbuf;
+
+    if (block_len < 0 || snprintf(key, sizeof(key), "%s:%s", host, port) >= (int)sizeof(key))
+        return -1;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config->upstream_timeout > 0 ? config->upstream_timeout : H2_WAIT_MAX;
+
+    /* The least loaded connection with room; a new one if there may be more; or wait */
+    pthread_mutex_lock(&h2_lock);
+    for (;;) {
+        best = NULL;
+        count = 0;
+        for (c = conns; c; c = c->next) {
+            if (c->dead || strcmp(c->key, key))
+                continue;
+            count++;
+            if (c->connected && c->nstreams < c->max_streams && (!best || c->nstreams < best->nstreams))
+                best = c;
+        }
+        if (best || count >= config->h2_connections) {
+            if (best)
+                break;
+            if (pthread_cond_timedwait(&h2_cond, &h2_lock, &deadline) == ETIMEDOUT) {
+                pthread_mutex_unlock(&h2_lock);
+                STAT_ADD(h2_timeouts, 1);
+                return -1;
+            }
+            continue;
+        }
+        if (pipe(wake) < 0) {
+            pthread_mutex_unlock(&h2_lock);
+            return -1;
+        }
+        /* Listed while connecting so others wait for it rather than open more */
+        c = Calloc(1, sizeof(h2_conn_t));
+        strcpy(c->key, key);
+        c->fd = -1;
+        c->next_id = 1;
+        c->window = config->h2_window;
+        c->stream_limit = c->max_streams = config->h2_streams;
+        pthread_mutex_init(&c->out_lock, NULL);
+        c->table.max_size = H2_TABLE_SIZE;
+        c->wake[0] = wake[0];
+        c->wake[1] = wake[1];
+        fcntl(c->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(c->wake[1], F_SETFL, O_NONBLOCK);
+        c->next = conns;
+        conns = c;
+        pthread_mutex_unlock(&h2_lock);
+
+        if (conn_open(c, host, port, profile) < 0) {
+            pthread_mutex_lock(&h2_lock);
+            for (link = &conns; *link != c; link = &(*link)->next)  /* No thread: freed here */
+                ;
+            *link = c->next;
+            pthread_cond_broadcast(&h2_cond);
+            pthread_mutex_unlock(&h2_lock);
+            free_connection(c);
+            return -1;
+        }
+        pthread_mutex_lock(&h2_lock);
+        c->connected = 1;
+        pthread_cond_broadcast(&h2_cond);
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        pthread_mutex_unlock(&h2_lock);
+        return -1;
+    }
+    /* Room for a window's worth, so the requester's socket is seldom what holds a stream back */
+    sndbuf = best->window;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    s = Calloc(1, sizeof(h2_stream_t));
+    s->fd = sv[0];
+    s->refs = 2;
+    s->id = best->next_id;
+    best->next_id += 2;
+    s->next = best->streams;
+    best->streams = s;
+    best->nstreams++;
+    if (best->next_id > 0x7fffffff)
+        best->dead = 1;  /* Out of stream ids: the next request opens another connection */
+
+    /* Queued under h2_lock, as stream ids must go out in order; the connection's thread sends it */
+    queue_frame(best, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, s->id, block, block_len);
+    /* A full pipe has woken it already; should the write fail otherwise, its poll times out in a second */
+    while (write(best->wake[1], "", 1) < 0 && errno == EINTR)
+        ;
+    pthread_mutex_unlock(&h2_lock);
+
+    STAT_ADD(h2_streams, 1);
+    req->fd = sv[1];
+    req->stream = s;
+    return 0;
+}
+
+/*
+ * h2_done - Finish with a request's stream, closing req->fd; if the
+ *     response wasn't all read, the stream is reset. Returns 1 if the
+ *     whole response was delivered, else 0.
+ */
+int h2_done(h2_req_t *req) {
+    int ok = __atomic_load_n(&req->stream->ok, __ATOMIC_ACQUIRE);
+
+    Close(req->fd);
+    stream_put(req->stream);
+    return ok;
+}
@@ -0,0 +1,55 @@
+/*
+ * h2.h - multiplexed HTTP/2 connections to upstreams
+ *
+ * Routes with proto=h2c send their misses to the upstream as HTTP/2
+ * streams over cleartext connections opened with prior knowledge (no
+ * Upgrade round trip), so many concurrent misses to one busy origin
+ * share a few sockets instead of needing one each. Each process keeps up
+ * to h2_connections per upstream host:port, each carrying up to
+ * h2_streams concurrent streams (or fewer if the upstream says so); a
+ * miss takes the least loaded connection, opens another while there is
+ * room, and otherwise waits for a stream to finish: for upstream_timeout
+ * (H2_WAIT_MAX without one), then it fails with a 502.
+ *
+ * A thread per connection reads its frames and hands each stream's
+ * response to the requesting thread through one end of a socket pair,
+ * rewritten as HTTP/1.1 (status line, headers, Connection: close) with
+ * the body after it and EOF at the end of the stream. The relay reads
+ * it like any upstream socket.
+ *
+ * Flow control is sized for bulk bodies: every stream starts with an
+ * h2_window receive window and the connection window is opened all the
+ * way, and windows are reopened in batches once half is used rather
+ * than frame by frame. A stream's window reopens only as the requester
+ * reads, so a slow client holds back its own stream and no other.
+ * Closing the requester's end before the response is in (the client
+ * went away) resets the stream with CANCEL, so the upstream stops
+ * sending it.
+ *
+ * Only what the proxy needs is implemented: GET requests without a
+ * body, HPACK decoding with Huffman and the dynamic table, and requests
+ * encoded with literals that are never indexed. Server push is refused
+ * in the initial SETTINGS.
+ */
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "csapp.h"
+#include "config.h"
+
+#define H2_FRAME_SIZE      (1 << 16)    /* Largest frame the upstream may send us */
+#define H2_TABLE_SIZE      4096         /* HPACK dynamic table the upstream may use */
+#define H2_IDLE_MAX        30           /* Seconds a connection with no streams is kept */
+#define H2_WAIT_MAX        30           /* Seconds a miss waits for a stream without upstream_timeout */
+
+/* A request's stream, from h2_request */
+typedef struct {
+    int fd;                     /* Read the response here, as HTTP/1.1 */
+    struct h2_stream *stream;
+} h2_req_t;
+
+int h2_request(config_t *config, char *host, char *port, sock_profile_t *profile,
+               const char *authority, const char *path, const char *headers, h2_req_t *req);
+int h2_done(h2_req_t *req);
+
+#endif /* __H2_H__ */
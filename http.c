@@ -0,0 +1,171 @@
+/*
+ * http.c - HTTP/1.x response parsing for the relay and the cache
+ */
+#include "http.h"
+
+/* Headers that describe one connection rather than the response, or that each hit gets afresh */
+static const char *hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+    "Age", "Content-Length", "X-Proxy-Cache", NULL
+};
+
+/* Length of the header line at p (through its '\n'), or 0 if it doesn't end by end */
+static size_t line_length(const char *p, const char *end) {
+    const char *eol = memchr(p, '\n', end - p);
+
+    return eol ? (size_t)(eol + 1 - p) : 0;
+}
+
+/* Whether the header line at p (of n bytes) is named name */
+static int header_is(const char *p, size_t n, const char *name) {
+    size_t len = strlen(name);
+
+    return n > len && p[len] == ':' && !strncasecmp(p, name, len);
+}
+
+/* Offset just past the blank line ending the headers in buf, or 0 if they don't end in it */
+size_t http_header_end(const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+    size_t n;
+
+    while (p < end && (n = line_length(p, end))) {
+        p += n;
+        if (n <= 2 && (n == 1 || p[-2] == '\r'))
+            return p - buf;
+    }
+    return 0;
+}
+
+/*
+ * http_response_length - Total length (headers plus body) of the
+ *     response starting at buf, from its Content-Length header. Returns
+ *     -1 if the headers are incomplete in buf or carry no length.
+ */
+ssize_t http_response_length(const char *buf, size_t len) {
+    size_t hdr_end = http_header_end(buf, len);
+    char value[32];
+
+    if (!hdr_end || !http_find_header(buf, hdr_end, "Content-Length", value, sizeof(value)))
+        return -1;
+    return hdr_end + strtoll(value, NULL, 10);
+}
+
+/* The status code from the status line at buf, or -1 */
+int http_status(const char *buf, size_t len) {
+    int status;
+
+    if (len < 12 || strncmp(buf, "HTTP/", 5))
+        return -1;
+    buf = memchr(buf, ' ', len);
+    if (!buf || sscanf(buf, " %3d", &status) != 1)
+        return -1;
+    return status;
+}
+
+/*
+ * http_find_header - Copy the value of the first header called name in
+ *     the headers at buf into value, without surrounding whitespace.
+ *     Returns 1 if found, else 0.
+ */
+int http_find_header(const char *buf, size_t len, const char *name, char *value, size_t valuelen) {
+    const char *p = buf, *end = buf + len, *v, *vend;
+    size_t n, namelen = strlen(name);
+
+    /* Skip the status line */
+    if (!(n = line_length(p, end)))
+        return 0;
+    for (p += n; p < end && (n = line_length(p, end)) > 2; p += n) {
+        if (!header_is(p, n, name))
+            continue;
+        for (v = p + namelen + 1; *v == ' ' || *v == '\t'; v++)
+            ;
+        for (vend = p + n; vend > v && isspace((unsigned char)vend[-1]); vend--)
+            ;
+        if (valuelen) {
+            n = (size_t)(vend - v) < valuelen ? (size_t)(vend - v) : valuelen - 1;
+            memcpy(value, v, n);
+            value[n] = '\0';
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * http_keep_alive - Whether the connection that brought the response
+ *     headers at buf (hdr_len bytes) stays open after the response:
+ *     HTTP/1.1 persists unless told to close, 1.0 only with keep-alive.
+ *     Either way the body must have a length to know where it ends.
+ */
+int http_keep_alive(const char *buf, size_t hdr_len) {
+    char value[32];
+
+    if (http_response_length(buf, hdr_len) < 0)
+        return 0;
+    if (http_find_header(buf, hdr_len, "Connection", value, sizeof(value)) ||
+        http_find_header(buf, hdr_len, "Proxy-Connection", value, sizeof(value)))
+        return !strcasecmp(value, "keep-alive");
+    return strncmp(buf, "HTTP/1.0", 8) != 0;
+}
+
+/* Whether status sends the client elsewhere, with a Location */
+int http_is_redirect(int status) {
+    return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+}
+
+/*
+ * http_freshness - Seconds the response with the headers at buf may be
+ *     cached for, from Cache-Control s-maxage or max-age. Returns 0 if
+ *     no-store, no-cache or private rule it out, -1 if nothing is said.
+ */
+long http_freshness(const char *buf, size_t hdr_len) {
+    char value[MAXLINE], *p;
+
+    if (!http_find_header(buf, hdr_len, "Cache-Control", value, sizeof(value)))
+        return -1;
+    if (strstr(value, "no-store") || strstr(value, "no-cache") || strstr(value, "private"))
+        return 0;
+    if ((p = strstr(value, "s-maxage=")))
+        return atol(p + 9);
+    if ((p = strstr(value, "max-age=")))
+        return atol(p + 8);
+    return -1;
+}
+
+/*
+ * http_build_cached - Rewrite a complete response for the cache: the
+ *     status line and end-to-end headers, then a Content-Length for the
+ *     body as received (unless it is chunked), so the framing holds on
+ *     a persistent connection too. The block is left open (no blank
+ *     line) so Age and Connection can be appended when it is sent; the
+ *     body follows it. Writes at most len + 64 bytes to out. Returns the
+ *     size written, with the block's length in *hdr_len, or -1 if resp
+ *     is not a complete set of response headers.
+ */
+ssize_t http_build_cached(const char *resp, size_t len, char *out, size_t outsize,
+                          size_t *hdr_len, int *status, unsigned *age) {
+    size_t hdr_end = http_header_end(resp, len), n, o = 0;
+    const char *p = resp, *end = resp + hdr_end;
+    char value[32];
+    int chunked, i, skip;
+
+    if (!hdr_end || (*status = http_status(resp, len)) < 0 || outsize < len + 64)
+        return -1;
+    *age = http_find_header(resp, hdr_end, "Age", value, sizeof(value)) ? strtoul(value, NULL, 10) : 0;
+    chunked = http_find_header(resp, hdr_end, "Transfer-Encoding", value, sizeof(value));
+
+    for (; p < end && (n = line_length(p, end)) > 2; p += n) {
+        for (i = 0, skip = 0; hop_headers[i] && !skip && p != resp; i++)
+            skip = header_is(p, n, hop_headers[i]);
+        if (skip)
+            continue;
+        memcpy(out + o, p, n);
+        o += n;
+    }
+    if (!chunked)
+        o += sprintf(out + o, "Content-Length: %lu\r\n", (unsigned long)(len - hdr_end));
+    *hdr_len = o;
+
+    memcpy(out + o, resp + hdr_end, len - hdr_end);
+    return o + len - hdr_end;
+}
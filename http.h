@@ -0,0 +1,23 @@
+/*
+ * http.h - HTTP/1.x response parsing for the relay and the cache
+ *
+ * Responses are handled as raw bytes as they came from the origin;
+ * these helpers find their way around the status line and headers
+ * without copying them.
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+size_t http_header_end(const char *buf, size_t len);
+ssize_t http_response_length(const char *buf, size_t len);
+int http_status(const char *buf, size_t len);
+int http_find_header(const char *buf, size_t len, const char *name, char *value, size_t valuelen);
+int http_keep_alive(const char *buf, size_t hdr_len);
+int http_is_redirect(int status);
+long http_freshness(const char *buf, size_t hdr_len);
+ssize_t http_build_cached(const char *resp, size_t len, char *out, size_t outsize,
+                          size_t *hdr_len, int *status, unsigned *age);
+
+#endif /* __HTTP_H__ */
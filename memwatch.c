@@ -0,0 +1,209 @@
+/*
+ * memwatch.c - cache budget that follows memory pressure
+ */
+#include "memwatch.h"
+#include "stats.h"
+#include <poll.h>
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_t *mem_cache;
+static int mem_enabled = 0, mem_started = 0;
+static size_t budget_min, budget_max;   /* From the last configuration applied */
+
+/* Where the cgroup's files are, "" if not found */
+static char cgroup_limit[MAXLINE], cgroup_usage[MAXLINE], cgroup_pressure[MAXLINE];
+
+static int file_exists(const char *path) {
+    return access(path, R_OK) == 0;
+}
+
+/*
+ * find_cgroup - Locate this process's memory cgroup files: under the
+ *     path /proc/self/cgroup gives, or at the mount root when the
+ *     container's cgroup namespace puts it there. v2 first, then v1.
+ */
+static void find_cgroup(void) {
+    char line[MAXLINE], v2[MAXLINE] = "", v1[MAXLINE] = "", *p;
+    char *roots[2];
+    FILE *fp;
+    int i;
+
+    if ((fp = fopen("/proc/self/cgroup", "r"))) {
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (!strncmp(line, "0::", 3))
+                snprintf(v2, sizeof(v2), "%s", strcmp(line + 3, "/") ? line + 3 : "");
+            else if ((p = strstr(line, ":memory:")))
+                snprintf(v1, sizeof(v1), "%s", strcmp(p + 8, "/") ? p + 8 : "");
+        }
+        fclose(fp);
+    }
+
+    roots[0] = v2;
+    roots[1] = "";
+    for (i = 0; i < 2 && !cgroup_limit[0]; i++) {
+        snprintf(line, sizeof(line), "/sys/fs/cgroup%s/memory.max", roots[i]);
+        if (!file_exists(line))
+            continue;
+        strcpy(cgroup_limit, line);
+        snprintf(cgroup_usage, sizeof(cgroup_usage), "/sys/fs/cgroup%s/memory.current", roots[i]);
+        snprintf(cgroup_pressure, sizeof(cgroup_pressure), "/sys/fs/cgroup%s/memory.pressure", roots[i]);
+    }
+    roots[0] = v1;
+    for (i = 0; i < 2 && !cgroup_limit[0]; i++) {
+        snprintf(line, sizeof(line), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes", roots[i]);
+        if (!file_exists(line))
+            continue;
+        strcpy(cgroup_limit, line);
+        snprintf(cgroup_usage, sizeof(cgroup_usage), "/sys/fs/cgroup/memory%s/memory.usage_in_bytes", roots[i]);
+    }
+    if (!cgroup_pressure[0] || !file_exists(cgroup_pressure))
+        strcpy(cgroup_pressure, "/proc/pressure/memory");
+}
+
+/* A number of bytes from a cgroup file; 0 for none, unreadable, or unlimited ("max", or near 2^63) */
+static uint64_t read_bytes(const char *path) {
+    char buf[64];
+    uint64_t v;
+    FILE *fp;
+
+    if (!path[0] || !(fp = fopen(path, "r")))
+        return 0;
+    v = fgets(buf, sizeof(buf), fp) ? strtoull(buf, NULL, 10) : 0;
+    fclose(fp);
+    return v >= (1ULL << 62) ? 0 : v;
+}
+
+/* The some avg10 of a PSI file, in percent, or 0 */
+static double psi_avg10(const char *path) {
+    double avg = 0;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r")))
+        return 0;
+    if (fscanf(fp, "some avg10=%lf", &avg) != 1)
+        avg = 0;
+    fclose(fp);
+    return avg;
+}
+
+/* A PSI trigger on path to poll for POLLPRI, or -1 if the kernel refuses one */
+static int psi_trigger(const char *path) {
+    char trigger[64];
+    int fd, n;
+
+    if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+        return -1;
+    n = snprintf(trigger, sizeof(trigger), "some %d %d", MEM_PSI_STALL, MEM_PSI_WINDOW);
+    if (write(fd, trigger, n + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *memwatch_thread(void *arg) {
+    struct pollfd pfd;
+    time_t now, calm_since = time(NULL);
+    uint64_t limit, usage, excess;
+    size_t min, max, target, step;
+    cache_stats_t cs;
+    int stalled, pressure, enabled;
+    char why[64];
+
+    Pthread_detach(pthread_self());
+    find_cgroup();
+    pfd.fd = psi_trigger(cgroup_pressure);
+    pfd.events = POLLPRI;
+    fprintf(stderr, "Cache autosize: cgroup limit %s, PSI %s%s\n",
+            cgroup_limit[0] ? cgroup_limit : "none", cgroup_pressure,
+            pfd.fd < 0 ? " (polled)" : "");
+
+    for (;;) {
+        stalled = 0;
+        if (pfd.fd >= 0) {
+            pfd.revents = 0;
+            if (poll(&pfd, 1, MEM_INTERVAL * 1000) > 0 && (pfd.revents & POLLPRI))
+                stalled = 1;
+            if (pfd.revents & (POLLERR | POLLNVAL)) {
+                /* The trigger is gone (its cgroup removed, say) and would fail every poll at once */
+                fprintf(stderr, "Cache autosize: PSI trigger on %s failed, polling it instead\n",
+                        cgroup_pressure);
+                close(pfd.fd);
+                pfd.fd = -1;
+                stalled = psi_avg10(cgroup_pressure) >= MEM_PSI_AVG;
+            }
+        } else {
+            sleep(MEM_INTERVAL);
+            stalled = psi_avg10(cgroup_pressure) >= MEM_PSI_AVG;
+        }
+
+        pthread_mutex_lock(&mem_lock);
+        enabled = mem_enabled;
+        min = budget_min;
+        max = budget_max;
+        pthread_mutex_unlock(&mem_lock);
+        if (!enabled)
+            continue;
+
+        limit = read_bytes(cgroup_limit);
+        usage = limit ? read_bytes(cgroup_usage) : 0;
+        excess = usage * 100 > limit * MEM_HIGH ? usage - limit * MEM_HIGH / 100 : 0;
+        __atomic_store_n(&proxy_stats->mem_limit, limit, __ATOMIC_RELAXED);
+        __atomic_store_n(&proxy_stats->mem_usage, usage, __ATOMIC_RELAXED);
+        pressure = stalled || excess;
+        if (stalled)
+            STAT_ADD(mem_stalls, 1);
+
+        cache_get_stats(mem_cache, &cs);
+        now = time(NULL);
+        target = cs.budget;
+        if (pressure) {
+            calm_since = now;
+            step = (cs.budget > min ? cs.budget - min : 0) * MEM_SHRINK / 100;
+            step = step > excess ? step : excess;
+            target = step < cs.budget ? cs.budget - step : 0;
+            snprintf(why, sizeof(why), "%s", stalled ? "memory stall" : "near the cgroup limit");
+        } else if (now - calm_since >= MEM_CALM && (!limit || usage * 100 < limit * MEM_LOW)) {
+            step = max * MEM_GROW / 100;
+            if (limit && step > limit * MEM_LOW / 100 - usage)
+                step = limit * MEM_LOW / 100 - usage;
+            target = cs.budget + step;
+            snprintf(why, sizeof(why), "no pressure for %lds", (long)(now - calm_since));
+        }
+        target = target < min ? min : target > max ? max : target;
+        if (target == cs.budget)
+            continue;
+
+        /* A smaller budget evicts what no longer fits and hands the memory back */
+        if (cache_set_limits(mem_cache, target, cs.max_object < target ? cs.max_object : target,
+                             cs.policy) < 0)
+            continue;
+        if (target < cs.budget)
+            STAT_ADD(mem_shrinks, 1);
+        else
+            STAT_ADD(mem_grows, 1);
+        fprintf(stderr, "Cache budget %lu -> %lu (%s; usage %lu of limit %lu)\n",
+                (unsigned long)cs.budget, (unsigned long)target, why,
+                (unsigned long)usage, (unsigned long)limit);
+    }
+    return NULL;
+}
+
+/*
+ * memwatch_configure - Apply cache_autosize and its bounds to cache,
+ *     starting the monitor the first time it is turned on. Turning it
+ *     off leaves the budget at cache_size, as any reload does.
+ */
+void memwatch_configure(config_t *config, cache_t *cache) {
+    pthread_t tid;
+
+    pthread_mutex_lock(&mem_lock);
+    mem_cache = cache;
+    mem_enabled = config->cache_autosize && !config->cores;
+    budget_min = config->cache_size_min;
+    budget_max = config->cache_size;
+    if (mem_enabled && !mem_started && pthread_create(&tid, NULL, memwatch_thread, NULL) == 0)
+        mem_started = 1;
+    pthread_mutex_unlock(&mem_lock);
+}
@@ -0,0 +1,43 @@
+/*
+ * memwatch.h - cache budget that follows memory pressure
+ *
+ * With cache_autosize on, a monitor thread in the process that owns the
+ * configuration (the supervisor in prefork mode) moves the cache budget
+ * between cache_size_min and cache_size. Every MEM_INTERVAL seconds, or
+ * at once when the kernel reports a memory stall, it looks at:
+ *
+ *   - the cgroup's memory limit and usage (v2 memory.max and
+ *     memory.current, or v1 memory.limit_in_bytes and
+ *     memory.usage_in_bytes). Usage over MEM_HIGH percent of the limit
+ *     is pressure, and the cache gives up at least the excess.
+ *   - PSI: a trigger on the cgroup's memory.pressure (or
+ *     /proc/pressure/memory) for MEM_PSI_STALL usec of stall per
+ *     MEM_PSI_WINDOW, or where triggers are refused, a some avg10 of
+ *     MEM_PSI_AVG percent or more.
+ *
+ * Under pressure the budget drops by MEM_SHRINK percent of what it has
+ * above the minimum, evicting in this thread rather than in requests,
+ * and the freed memory goes back to the kernel. After MEM_CALM seconds
+ * without pressure, and with usage under MEM_LOW percent of any limit,
+ * it regrows by MEM_GROW percent of the maximum per check.
+ */
+#ifndef __MEMWATCH_H__
+#define __MEMWATCH_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "config.h"
+
+#define MEM_INTERVAL   2        /* Seconds between checks */
+#define MEM_HIGH       90       /* Percent of the cgroup limit that is pressure */
+#define MEM_LOW        75       /* Percent of it below which the cache may regrow */
+#define MEM_PSI_STALL  150000   /* usec of stall per window that triggers */
+#define MEM_PSI_WINDOW 2000000  /* usec; unprivileged triggers need multiples of 2s */
+#define MEM_PSI_AVG    10       /* some avg10 that counts as pressure without a trigger */
+#define MEM_CALM       30       /* Seconds without pressure before regrowing */
+#define MEM_SHRINK     25       /* Percent of the budget above the minimum given up */
+#define MEM_GROW       10       /* Percent of the maximum regained per check */
+
+void memwatch_configure(config_t *config, cache_t *cache);
+
+#endif /* __MEMWATCH_H__ */
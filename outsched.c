@@ -0,0 +1,109 @@
+/*
+ * outsched.c - size-aware output scheduling
+ */
+#include "outsched.h"
+#include "stats.h"
+#include <poll.h>
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sched_slots = 0;         /* 0: scheduling is off */
+static size_t sched_aging;          /* Bytes of priority gained per second of waiting */
+static int active = 0;              /* Slots held */
+static sched_ticket_t *waiters = NULL;
+
+/* Priority of a waiter: remaining bytes less its waiting credit (lower goes first) */
+static size_t effective(sched_ticket_t *t, uint64_t now) {
+    uint64_t credit = (now - t->since) * sched_aging / 1000000;
+
+    return credit >= t->remaining ? 0 : t->remaining - credit;
+}
+
+/* Hand free slots to the best waiters; sched_lock must be held */
+static void grant_waiters(void) {
+    sched_ticket_t **link, **best;
+    uint64_t now;
+
+    while (waiters && (sched_slots == 0 || active < sched_slots)) {
+        now = stats_now_usec();
+        for (best = link = &waiters; *link; link = &(*link)->next)
+            if (effective(*link, now) < effective(*best, now))
+                best = link;
+        (*best)->granted = 1;
+        pthread_cond_signal(&(*best)->cond);
+        *best = (*best)->next;
+        active++;
+    }
+}
+
+/* Set the number of send slots (0 turns scheduling off) and the aging rate */
+void sched_configure(int slots, size_t aging) {
+    pthread_mutex_lock(&sched_lock);
+    sched_slots = slots;
+    sched_aging = aging;
+    grant_waiters();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+int sched_enabled(void) {
+    return __atomic_load_n(&sched_slots, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * sched_acquire - Wait for a send slot for a response with remaining
+ *     bytes still to go. The caller sends one quantum, then calls
+ *     sched_release, and acquires again for the next.
+ */
+void sched_acquire(sched_ticket_t *ticket, size_t remaining) {
+    ticket->remaining = remaining;
+    pthread_mutex_lock(&sched_lock);
+    if (sched_slots == 0 || (active < sched_slots && !waiters)) {
+        active++;
+        pthread_mutex_unlock(&sched_lock);
+        return;
+    }
+
+    ticket->since = stats_now_usec();
+    ticket->granted = 0;
+    pthread_cond_init(&ticket->cond, NULL);
+    ticket->next = waiters;
+    waiters = ticket;
+    while (!ticket->granted)
+        pthread_cond_wait(&ticket->cond, &sched_lock);
+    pthread_cond_destroy(&ticket->cond);
+    pthread_mutex_unlock(&sched_lock);
+
+    STAT_ADD(sched_waits, 1);
+    STAT_ADD(sched_wait_usec, stats_now_usec() - ticket->since);
+}
+
+void sched_release(sched_ticket_t *ticket) {
+    pthread_mutex_lock(&sched_lock);
+    active--;
+    grant_waiters();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * sched_wait_writable - The socket fd (sent to with MSG_DONTWAIT, or
+ *     non-blocking) is full: give up the slot until it polls writable,
+ *     for no longer than its send timeout, then wait for a slot again
+ *     at the priority it was acquired with. Returns 0 with the slot
+ *     held, or -1 (the slot held all the same) if fd failed or timed out.
+ */
+int sched_wait_writable(sched_ticket_t *ticket, int fd) {
+    struct pollfd pfd;
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+    int timeout = -1, rc;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, &len) == 0 && (tv.tv_sec || tv.tv_usec))
+        timeout = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    sched_release(ticket);
+    STAT_ADD(sched_yields, 1);
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+        ;
+    sched_acquire(ticket, ticket->remaining);
+    return rc > 0 && (pfd.revents & POLLOUT) ? 0 : -1;
+}
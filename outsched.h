@@ -0,0 +1,45 @@
+/*
+ * outsched.h - size-aware output scheduling
+ *
+ * Each request thread sends its response in quanta, and before each
+ * quantum asks for one of a fixed number of send slots. When the slots
+ * are all taken, a freed slot goes to the waiter with the fewest bytes
+ * left to send (shortest remaining processing time first), so small
+ * responses and cache hits overtake bulk transfers instead of queueing
+ * behind them. A waiter's remaining bytes are discounted by how long it
+ * has waited, so a large response cannot starve: it keeps getting
+ * quanta, just at a lower priority.
+ *
+ * A slot is held only while the client's socket takes the quantum
+ * without blocking. Once its send buffer is full the slot is given up
+ * until the socket polls writable again (sched_wait_writable), so slow
+ * or stalled readers hold no slots and cannot keep others waiting.
+ *
+ * The slots are per process; in prefork mode each worker schedules its
+ * own connections.
+ */
+#ifndef __OUTSCHED_H__
+#define __OUTSCHED_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* Bytes assumed left for a response of unknown length */
+#define SCHED_UNKNOWN_SIZE (1 << 20)
+
+/* One request's place in the scheduler */
+typedef struct sched_ticket {
+    size_t remaining;           /* Bytes left to send, the priority */
+    uint64_t since;             /* When it started waiting, in usec */
+    int granted;
+    pthread_cond_t cond;
+    struct sched_ticket *next;  /* In the wait list */
+} sched_ticket_t;
+
+void sched_configure(int slots, size_t aging);
+int sched_enabled(void);
+void sched_acquire(sched_ticket_t *ticket, size_t remaining);
+void sched_release(sched_ticket_t *ticket);
+int sched_wait_writable(sched_ticket_t *ticket, int fd);
+
+#endif /* __OUTSCHED_H__ */
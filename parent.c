@@ -0,0 +1,146 @@
+/*
+ * parent.c - parent proxy selection and pooled parent connections
+ */
+#include "parent.h"
+#include "cache.h"
+#include "sockopt.h"
+#include "stats.h"
+#include <netinet/tcp.h>
+
+/* An idle pooled connection */
+typedef struct idle_conn {
+    char key[CONFIG_HOSTLEN + 16];  /* host:port of its parent */
+    int fd;
+    time_t since;
+    struct idle_conn *next;
+} idle_conn_t;
+
+static pthread_mutex_t parent_lock = PTHREAD_MUTEX_INITIALIZER;
+static idle_conn_t *idle = NULL;
+
+/* When each configured parent may be tried again, by position and host:port */
+static struct {
+    char key[CONFIG_HOSTLEN + 16];
+    time_t retry_at;
+} health[MAX_PARENTS];
+
+static void parent_key(parent_t *parent, char *key) {
+    sprintf(key, "%s:%s", parent->host, parent->port);
+}
+
+/* A pooled connection the parent has closed, or written to unasked, is no use */
+static int still_open(int fd) {
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* An open idle connection to key from the pool, or -1; parent_lock held */
+static int pool_take(const char *key) {
+    idle_conn_t **link = &idle, *conn;
+    time_t now = time(NULL);
+    int fd, fresh;
+
+    while ((conn = *link)) {
+        if (strcmp(conn->key, key)) {
+            link = &conn->next;
+            continue;
+        }
+        *link = conn->next;
+        fd = conn->fd;
+        fresh = now - conn->since <= PARENT_IDLE_MAX;
+        Free(conn);
+        if (fresh && still_open(fd))
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+/* Whether the parent at index was refused recently; parent_lock held */
+static int is_down(int index, const char *key, time_t now) {
+    if (strcmp(health[index].key, key)) {  /* The configuration changed */
+        strcpy(health[index].key, key);
+        health[index].retry_at = 0;
+    }
+    return health[index].retry_at > now;
+}
+
+/*
+ * parent_connect - Connect to a parent for a miss on host: a pooled
+ *     connection if there is one (unless fresh), else a new one
+ *     (applying profile, if any). Parents recently refused are tried
+ *     only if all are. Returns the descriptor (also in pc), or -1 if no
+ *     parent could be reached.
+ */
+int parent_connect(config_t *config, const char *host, sock_profile_t *profile, int fresh,
+                   parent_conn_t *pc) {
+    int n = config->nparents, start, pass, i, idx, down, one = 1;
+    char key[CONFIG_HOSTLEN + 16];
+    parent_t *parent;
+    time_t now = time(NULL);
+
+    start = config->parent_select == PARENT_HASH ? cache_key_hash(host) % n : 0;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < n; i++) {
+            idx = (start + i) % n;
+            parent = &config->parents[idx];
+            parent_key(parent, key);
+
+            pthread_mutex_lock(&parent_lock);
+            down = is_down(idx, key, now);
+            pc->fd = down == pass && !fresh ? pool_take(key) : -1;
+            pthread_mutex_unlock(&parent_lock);
+            if (down != pass)
+                continue;
+
+            pc->index = idx;
+            pc->reused = pc->fd >= 0;
+            if (pc->reused) {
+                STAT_ADD(parent_reused, 1);
+                return pc->fd;
+            }
+            pc->fd = open_clientfd_setup(parent->host, parent->port,
+                                         profile ? sockopt_setup_upstream : NULL, profile);
+            pthread_mutex_lock(&parent_lock);
+            health[idx].retry_at = pc->fd < 0 ? now + PARENT_RETRY : 0;
+            pthread_mutex_unlock(&parent_lock);
+            if (pc->fd >= 0) {
+                /* Requests go out in a few writes; on a kept connection Nagle would hold them */
+                setsockopt(pc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                return pc->fd;
+            }
+            STAT_ADD(parent_failovers, 1);
+        }
+    }
+    return -1;
+}
+
+/*
+ * parent_done - Finish with a parent connection: pool it if reusable
+ *     (the whole response was read and the parent keeps the connection)
+ *     and the pool has room for its parent, else close it.
+ */
+void parent_done(config_t *config, parent_conn_t *pc, int reusable) {
+    idle_conn_t *conn, *p;
+    int count = 0;
+
+    if (reusable && config->parent_pool > 0 && pc->index < config->nparents) {
+        conn = Malloc(sizeof(idle_conn_t));
+        parent_key(&config->parents[pc->index], conn->key);
+        pthread_mutex_lock(&parent_lock);
+        for (p = idle; p; p = p->next)
+            count += !strcmp(p->key, conn->key);
+        if (count < config->parent_pool) {
+            conn->fd = pc->fd;
+            conn->since = time(NULL);
+            conn->next = idle;
+            idle = conn;
+            pthread_mutex_unlock(&parent_lock);
+            return;
+        }
+        pthread_mutex_unlock(&parent_lock);
+        Free(conn);
+    }
+    Close(pc->fd);
+}
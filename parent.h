@@ -0,0 +1,39 @@
+/*
+ * parent.h - parent proxy selection and pooled parent connections
+ *
+ * With parent lines in the configuration, misses (other than for routes
+ * with their own upstream, and bypassed hosts) are sent to a parent
+ * proxy in absolute form instead of to the origin. The parent is the
+ * first one up in the configured order (failover) or, with
+ * parent_select = hash, the one the origin host hashes to, so each
+ * parent's cache sees a stable share of hosts; a parent that refuses a
+ * connection is skipped for PARENT_RETRY seconds.
+ *
+ * Requests to a parent ask it to keep the connection open. When its
+ * response says it will and gives a Content-Length, the connection goes
+ * back to a per-process pool for the next miss to that parent. The
+ * parent may close a pooled connection just as a request goes out on
+ * it; a miss that gets nothing back on one is retried once on a new
+ * connection.
+ */
+#ifndef __PARENT_H__
+#define __PARENT_H__
+
+#include "csapp.h"
+#include "config.h"
+
+#define PARENT_RETRY    5       /* Seconds a parent that refused a connection is skipped */
+#define PARENT_IDLE_MAX 30      /* Seconds a pooled connection may sit idle */
+
+/* A connection to a parent, from parent_connect */
+typedef struct {
+    int fd;
+    int index;                  /* Into config->parents */
+    int reused;                 /* Taken from the pool */
+} parent_conn_t;
+
+int parent_connect(config_t *config, const char *host, sock_profile_t *profile, int fresh,
+                   parent_conn_t *pc);
+void parent_done(config_t *config, parent_conn_t *pc, int reusable);
+
+#endif /* __PARENT_H__ */
@@ -0,0 +1,204 @@
+/*
+ * pool.c - adaptive pool of connection threads
+ *
+ * The pool and its sizing thread start on the first connection
+ * submitted in each process, so prefork workers get their own. A reload
+ * takes effect at the next sizing decision; with threads_max back at 0
+ * the accept loop stops submitting and the pool retires once idle.
+ */
+#include "pool.h"
+#include "stats.h"
+#include <sys/resource.h>
+
+/* A connection waiting for a thread */
+typedef struct {
+    pool_fn_t fn;
+    void *arg;
+    uint64_t queued;            /* stats_now_usec() when submitted */
+} pool_job_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready = PTHREAD_COND_INITIALIZER;   /* A job, or threads to retire */
+static pthread_cond_t pool_room = PTHREAD_COND_INITIALIZER;    /* The queue has room */
+
+/* Bounds, from the last configuration applied */
+static int threads_min, threads_max;
+
+static pool_job_t queue[POOL_QUEUE];
+static int queue_head = 0, queue_len = 0;
+static int nthreads = 0, busy = 0, retiring = 0;
+static pid_t pool_pid;                  /* The threads counted belong to this process */
+
+/* Since the last sizing decision */
+static uint64_t jobs, wait_usec, busy_usec, blocked_usec;
+static int busy_peak;
+
+void pool_configure(config_t *config) {
+    pthread_mutex_lock(&pool_lock);
+    threads_min = config->threads_min;
+    __atomic_store_n(&threads_max, config->threads_max, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Whether connections should be submitted to the pool */
+int pool_enabled(void) {
+    return __atomic_load_n(&threads_max, __ATOMIC_RELAXED) > 0;
+}
+
+static uint64_t thread_cpu_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t process_cpu_usec(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+        ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void *pool_thread(void *arg) {
+    pool_job_t job;
+    uint64_t start, wall, cpu, wait;
+
+    Pthread_detach(pthread_self());
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!queue_len && !retiring)
+            pthread_cond_wait(&pool_ready, &pool_lock);
+        if (!queue_len)
+            break;
+        job = queue[queue_head];
+        queue_head = (queue_head + 1) % POOL_QUEUE;
+        queue_len--;
+        if (++busy > busy_peak)
+            busy_peak = busy;
+        pthread_cond_signal(&pool_room);
+        pthread_mutex_unlock(&pool_lock);
+
+        /* Wall time the thread was not on a CPU was spent blocked */
+        start = stats_now_usec();
+        cpu = thread_cpu_usec();
+        job.fn(job.arg);
+        wall = stats_now_usec() - start;
+        cpu = thread_cpu_usec() - cpu;
+        cpu = cpu < wall ? cpu : wall;
+        wait = start - job.queued;
+
+        STAT_ADD(pool_jobs, 1);
+        STAT_ADD(pool_wait_usec, wait);
+        STAT_ADD(pool_busy_usec, wall);
+        STAT_ADD(pool_blocked_usec, wall - cpu);
+        pthread_mutex_lock(&pool_lock);
+        busy--;
+        jobs++;
+        wait_usec += wait;
+        busy_usec += wall;
+        blocked_usec += wall - cpu;
+    }
+    retiring--;
+    nthreads--;
+    pthread_mutex_unlock(&pool_lock);
+    STAT_ADD(pool_threads, -1);
+    return NULL;
+}
+
+/* Start threads until there are n not retiring; pool_lock held */
+static void add_threads(int n) {
+    pthread_t tid;
+
+    while (nthreads - retiring < n && pthread_create(&tid, NULL, pool_thread, NULL) == 0) {
+        nthreads++;
+        STAT_ADD(pool_threads, 1);
+    }
+}
+
+/* Decide the pool's size every POOL_INTERVAL ms (see pool.h) */
+static void *pool_sizer(void *arg) {
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN), calm = 0, n, want, cpu, blocked, queued;
+    uint64_t now, last = stats_now_usec(), cpu_now, cpu_last = process_cpu_usec();
+    uint64_t avg_wait, oldest;
+
+    Pthread_detach(pthread_self());
+    ncpus = ncpus > 0 ? ncpus : 1;
+    for (;;) {
+        usleep(POOL_INTERVAL * 1000);
+        now = stats_now_usec();
+        cpu_now = process_cpu_usec();
+        cpu = (cpu_now - cpu_last) * 100 / ((now - last) * ncpus);
+        last = now;
+        cpu_last = cpu_now;
+
+        pthread_mutex_lock(&pool_lock);
+        n = nthreads - retiring;
+        avg_wait = jobs ? wait_usec / jobs : 0;
+        oldest = queue_len ? now - queue[queue_head].queued : 0;
+        /* With nothing finished in the interval the threads are stuck on something slow */
+        blocked = busy_usec ? blocked_usec * 100 / busy_usec : 100;
+        queued = avg_wait > POOL_WAIT_HIGH || oldest > POOL_WAIT_HIGH;
+        calm = !queued && busy_peak * 2 < n ? calm + 1 : 0;
+
+        want = n;
+        if (n < threads_min && threads_max > 0) {
+            want = threads_min;
+        } else if (n > threads_max) {
+            want = threads_max;
+        } else if (queued && blocked >= POOL_BLOCKED_HIGH && cpu < POOL_CPU_HIGH) {
+            want = n + (n > 2 ? n / 2 : 1);
+            want = want < threads_max ? want : threads_max;
+        } else if (calm >= POOL_SHRINK_AFTER) {
+            want = n - (n > 4 ? n / 4 : 1);
+            want = want > threads_min ? want : threads_min;
+        }
+
+        if (want > n) {
+            add_threads(want);
+            want = nthreads - retiring;
+            STAT_ADD(pool_grows, 1);
+        } else if (want < n) {
+            retiring += n - want;
+            pthread_cond_broadcast(&pool_ready);
+            STAT_ADD(pool_shrinks, 1);
+        }
+        if (want != n)
+            calm = 0;
+        jobs = wait_usec = busy_usec = blocked_usec = 0;
+        busy_peak = busy;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (want != n)
+            fprintf(stderr, "Process %d pool %d -> %d threads (queue wait %lu us, blocked %d%%, cpu %d%%)\n",
+                    (int)getpid(), n, want, (unsigned long)(avg_wait > oldest ? avg_wait : oldest),
+                    blocked, cpu);
+    }
+    return NULL;
+}
+
+/*
+ * pool_submit - Queue fn(arg) for a pool thread, starting the pool in
+ *     this process if need be. Blocks while the queue is full.
+ */
+void pool_submit(pool_fn_t fn, void *arg) {
+    pool_job_t *job;
+    pthread_t tid;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_pid != getpid()) {  /* Forked: the parent's threads aren't here */
+        nthreads = busy = retiring = queue_len = 0;
+        pool_pid = getpid();
+        Pthread_create(&tid, NULL, pool_sizer, NULL);
+    }
+    add_threads(threads_min);
+
+    while (queue_len == POOL_QUEUE)
+        pthread_cond_wait(&pool_room, &pool_lock);
+    job = &queue[(queue_head + queue_len++) % POOL_QUEUE];
+    job->fn = fn;
+    job->arg = arg;
+    job->queued = stats_now_usec();
+    pthread_cond_signal(&pool_ready);
+    pthread_mutex_unlock(&pool_lock);
+}
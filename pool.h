@@ -0,0 +1,42 @@
+/*
+ * pool.h - adaptive pool of connection threads
+ *
+ * With threads_max set, accepted connections queue for a pool of
+ * threads instead of getting a thread each. A sizing thread looks at
+ * the pool every POOL_INTERVAL ms and resizes it within
+ * [threads_min, threads_max]:
+ *
+ *   grow    connections waited in the queue longer than POOL_WAIT_HIGH
+ *           on average (or the oldest still waiting has), the threads
+ *           spent at least POOL_BLOCKED_HIGH percent of their busy time
+ *           off the CPU (blocked on clients and origins, so more threads
+ *           help), and the process used under POOL_CPU_HIGH percent of
+ *           the machine's CPU. Grows by half, at least one thread.
+ *   shrink  POOL_SHRINK_AFTER intervals in a row without queueing and
+ *           with under half the threads busy; a quarter of the threads,
+ *           at least one, go once idle.
+ *
+ * Growing is quick and shrinking slow, so a burst does not make the
+ * pool thrash. Each resize is logged to stderr with its reasons, and
+ * the pool_* counters in the admin stats carry the inputs.
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+#include "config.h"
+
+#define POOL_QUEUE        1024  /* Connections waiting; the accept loop blocks beyond this */
+#define POOL_INTERVAL     500   /* ms between sizing decisions */
+#define POOL_WAIT_HIGH    2000  /* usec of queueing that calls for more threads */
+#define POOL_BLOCKED_HIGH 50    /* Percent of busy time off the CPU */
+#define POOL_CPU_HIGH     85    /* Percent of all CPUs above which the pool holds */
+#define POOL_SHRINK_AFTER 10    /* Calm intervals before shrinking */
+
+typedef void (*pool_fn_t)(void *arg);
+
+void pool_configure(config_t *config);
+int pool_enabled(void);
+void pool_submit(pool_fn_t fn, void *arg);
+
+#endif /* __POOL_H__ */
@@ -1,242 +1,1784 @@
 #include <stdio.h>
 #include "csapp.h"
-//
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "cache.h"
+#include "config.h"
+#include "stats.h"
+#include "admin.h"
+#include "upgrade.h"
+#include "zerocopy.h"
+#include "http.h"
+#include "outsched.h"
+#include "sockopt.h"
+#include "shadow.h"
+#include "parent.h"
+#include "pool.h"
+#include "adapt.h"
+#include "memwatch.h"
+#include "vary.h"
+#include "esi.h"
+#include "h2.h"
+#include "cores.h"
+#include <poll.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#endif
 
 /* Headers */
 static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_connection = "Proxy-Connection: close\r\n";
+static const char *keep_alive_hdrs = "Connection: keep-alive\r\nProxy-Connection: keep-alive\r\n";
 
-/* Cache Block Structure */
-typedef struct cache_node {
-    char url[MAXLINE];
-    char content[MAX_OBJECT_SIZE];
-    int content_size;
-    int access_time;
-    struct cache_node *next_ptr;
-} cache_node_t;
+/* Prefork mode: a crashed worker is respawned, but not in a tight loop */
+#define RESPAWN_DELAY 1   /* Seconds to wait if a worker dies right after starting */
 
-/* Web Cache Structure */
+/* Smallest cached body sent with sendfile rather than in the hit's writev */
+#define SENDFILE_MIN (16 << 10)
+
+/* How send_cached moves a hit's body */
+#define SEND_COPY     0
+#define SEND_SENDFILE 1
+#define SEND_ZEROCOPY 2
+
+/* Relay buffers a connection may have in flight with MSG_ZEROCOPY */
+#define ZEROCOPY_POOL 4
+
+/* Core mode: how long an accepting core waits for a request line before leaving it to a thread */
+#define CORE_PEEK_WAIT  100  /* ms */
+#define CORE_PEEK_RETRY 1    /* ms to wait for more of a partly arrived line */
+
+/* Kinds of core mailbox message */
+#define MAIL_CONN    0
+#define MAIL_STORE   1
+#define MAIL_RELEASE 2
+
+/* Why a response is held back from the client until it is all in */
+#define HELD_ESI      1  /* A page template, to assemble */
+#define HELD_REDIRECT 2  /* A redirect, to follow instead */
+
+cache_t global_cache;
+
+/* Configuration file (NULL for built-in defaults) and command-line overrides */
+static char *config_path = NULL;
+static int cli_workers = -1;
+static char *cli_port = NULL;
+
+/*
+ * Control signals (SIGHUP reload, SIGUSR2 upgrade, SIGQUIT graceful stop,
+ * and SIGCHLD, SIGTERM, SIGINT in the supervisor) are forwarded through a self-pipe,
+ * so the accept and supervisor loops handle them outside signal context
+ * whichever thread the kernel delivers them to.
+ */
+static int control_pipe[2] = {-1, -1};
+
+/* Core mode: the socket the cores accept on, and whether they should stop */
+static int core_listen_fd = -1;
+static int cores_stopping = 0;
+
+/* In-flight connections, so a stopping process can drain them */
+static int active_conns = 0;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_done = PTHREAD_COND_INITIALIZER;
+
+/* An accepted connection, handed to its thread */
 typedef struct {
-    cache_node_t *first;
-    int current_size;
-    int readers;
-    sem_t read_lock;
-    sem_t write_lock;
-} cache_manager;
+    int fd;
+    char addr[NI_MAXHOST + NI_MAXSERV + 1];  /* host:port, for the access log */
+    cache_t *cache;             /* Where to look the URI up; NULL if it is known to miss */
+    int core;                   /* Core mode: the core owning the URI, else -1 */
+    size_t max_object;
+    char uri[MAXLINE];          /* Core mode: the URI, peeked at when accepted */
+    int pinned;                 /* Core mode: the owner found the URI cached and pinned it */
+    cache_ref_t ref;
+} client_conn_t;
 
-cache_manager global_cache;
-int access_counter = 0;
+/* Core mode: a connection an accepting core is waiting on for its request line */
+typedef struct {
+    client_conn_t *conn;
+    uint64_t deadline;          /* stats_now_usec() at which it is left to a thread */
+    uint64_t retry;             /* Part of the line is in: look again then, 0 if not */
+} core_peek_t;
+
+/* Core mode: a connection for the core owning its URI, posted by a thread */
+typedef struct {
+    core_msg_t msg;
+    client_conn_t *conn;
+} conn_mail_t;
+
+/* Core mode: a hit's pin for the owning core to drop, from the thread that sent it */
+typedef struct {
+    core_msg_t msg;
+    cache_ref_t ref;
+} release_mail_t;
+
+/* Core mode: a response for the owning core to cache */
+typedef struct {
+    core_msg_t msg;
+    char *key;
+    char *object;
+    size_t size;
+    cache_meta_t meta;
+} store_mail_t;
+
+/* What a request did, for the counters and the access log */
+typedef struct {
+    char method[MAXLINE];
+    char uri[MAXLINE];
+    int outcome;
+    int status;                 /* Response status, -1 for none */
+    size_t bytes;
+    const char *headers;        /* The client's request headers, once read (for Vary) */
+    char *mirror;               /* Copy of the request for the shadow upstream, or NULL */
+    size_t mirror_len;
+    cache_t *cache;             /* As in client_conn_t */
+    int core;
+    size_t max_object;
+    cache_ref_t *pinned;        /* Core mode: the hit, if the owner pinned one; NULL once used */
+    int cache_class;            /* From its route, for what it caches */
+    char route[CONFIG_NAMELEN]; /* Name of the route it matched, "-" for none */
+    uint64_t cpu_start;         /* Thread CPU time at its start, 0 if not measured */
+    uint64_t cpu_lookup;        /* ... and once the cache lookup had its answer */
+} request_t;
+
+/* Where a miss went, from upstream_open */
+typedef struct {
+    int fd;                     /* Read the response here */
+    char *host;                 /* What was connected to, for error pages */
+    char *port;
+    int via_parent;
+    int h2;
+    parent_conn_t parent;       /* If via_parent */
+    h2_req_t h2req;             /* If h2 */
+} upstream_t;
 
 /* Function Declarations */
 void handle_sigpipe(int sig);
-void process_request(int client_fd);
+void handle_control(int sig);
+void control_init(int *signals, int nsignals);
+int control_read(void);
+config_t *load_config(char *errbuf, size_t errlen);
+int reload_config(int listen_fd, int apply_shared);
+void apply_shared_config(config_t *config, int listen_fd);
+void apply_local_config(config_t *config);
+void serve(int listen_fd, int standalone);
+client_conn_t *accept_client(int listen_fd);
+void serve_cores(int listen_fd);
+void *core_main(void *arg);
+void core_apply_config(core_t *core);
+void core_accept(core_t *core, core_peek_t **peeks, int *npeeks, int *cap);
+int core_peek(core_t *core, core_peek_t *peek, uint64_t now);
+void core_route(core_t *core, client_conn_t *conn);
+void core_serve(core_t *core, client_conn_t *conn);
+void core_read_mail(core_t *core);
+void *peek_thread(void *arg);
+int peek_line(int fd, char *uri);
+int peek_uri(int fd, char *uri, int timeout_ms);
+void drain_connections(void);
+int start_upgrade(int listen_fd);
+void run_prefork(int listen_fd);
+pid_t spawn_worker(int listen_fd);
+void set_timeout(int fd, int seconds);
+void process_request(int client_fd, config_t *config, request_t *req);
+int upstream_open(config_t *config, route_t *route, char *host, char *port, char *path,
+                  const char *request_header, char *headers, int fresh, upstream_t *up);
+int upstream_close(config_t *config, upstream_t *up, int ended, int kept);
+ssize_t fetch_fragment(void *arg, const char *url, const char *headers, char *resp, size_t size);
 void send_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 void extract_uri(char *uri, char *host, char *path, char *port, char *request_header);
 void *handle_client(void *arg);
-void initialize_cache(cache_manager *cache);
-cache_node_t *check_cache(cache_manager *cache, char *uri);
-void add_to_cache(cache_manager *cache, char *uri, char *buffer, int size);
-int update_counter() { return ++access_counter; }
-void remove_oldest(cache_manager *cache);
-void process_headers(rio_t *client_rio, int server_fd);
+void pool_client(void *arg);
+void serve_client(client_conn_t *conn);
+int process_headers(rio_t *client_rio, int server_fd, int keep_alive, char *copy);
+void mirror_request(request_t *req, const char *request_header, const char *client_headers);
+ssize_t send_cached(int fd, config_t *config, request_t *req, cache_ref_t *ref);
+void release_hit(request_t *req, cache_ref_t *ref);
+void zerocopy_account(zc_sock_t *zs, size_t bytes);
+ssize_t send_iov(int fd, struct iovec *iov, int iovcnt, int flags, sched_ticket_t *ticket);
+ssize_t send_zerocopy(zc_sock_t *zs, const char *buf, size_t len, sched_ticket_t *ticket);
+int send_cache_file(int fd, int cache_fd, off_t offset, size_t len, sched_ticket_t *ticket);
+void store_response(request_t *req, const char *uri, const char *resp, size_t len, int flags);
+int redirect_target(config_t *config, const char *uri, route_t *route, const char *resp,
+                    size_t hdr_len, char *target);
+int finish_after_abort(config_t *config, ssize_t expected, size_t total, size_t max_object);
 
 /* Main Function */
 int main(int argc, char **argv) {
-    int listen_fd, *client_fd;
-    char host[MAXLINE], port[MAXLINE];
-    socklen_t client_len;
-    struct sockaddr_storage client_addr;
-    pthread_t thread_id;
+    int listen_fd, cache_fd, opt, bad_usage = 0;
+    char errbuf[MAXLINE];
+    upgrade_fds_t inherited;
+    config_t *config;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "c:w:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_path = optarg;
+            break;
+        case 'w':
+            cli_workers = atoi(optarg);
+            bad_usage |= cli_workers < 0 || cli_workers > MAX_WORKERS;
+            break;
+        default:
+            bad_usage = 1;
+        }
+    }
+    if (optind < argc)
+        cli_port = argv[optind++];
+    if (!(config = load_config(errbuf, sizeof(errbuf))))
+        app_error(errbuf);
+    if (bad_usage || optind != argc || !config->port[0]) {
+        fprintf(stderr, "Usage: %s [-c config] [-w workers] <port | unix:path>\n", argv[0]);
+        fprintf(stderr, "  -c FILE  read settings from FILE, again on SIGHUP\n");
+        fprintf(stderr, "  -w N     prefork N worker processes (1-%d) sharing one cache\n", MAX_WORKERS);
+        fprintf(stderr, "  The port may instead come from the configuration file.\n");
+        fprintf(stderr, "  SIGUSR2 upgrades to a new binary in place, SIGQUIT stops gracefully\n");
         exit(1);
     }
+    config_install(config);
 
     Signal(SIGPIPE, handle_sigpipe);
-    initialize_cache(&global_cache);
-    listen_fd = Open_listenfd(argv[1]);
+    upgrade_init(argc, argv);
+    stats_init();
+
+    /* Started by an upgrade: take over the old process's socket and cache */
+    if (upgrade_inherit(&inherited) < 0)
+        app_error("upgrade handoff failed");
+    listen_fd = upgrade_find_fd(&inherited, UPGRADE_FD_LISTEN);
+    cache_fd = upgrade_find_fd(&inherited, UPGRADE_FD_CACHE);
+
+    /* The cache must exist before any fork so every worker maps the same region */
+    if (cache_fd < 0 || cache_attach(&global_cache, cache_fd) < 0) {
+        if (cache_fd >= 0)
+            fprintf(stderr, "Inherited cache has an incompatible layout, starting empty\n");
+        if (cache_init(&global_cache, config->cache_size) < 0)
+            unix_error("cache_init error");
+    }
+    adapt_init(&global_cache);
+    if (listen_fd < 0)
+        listen_fd = Open_listenfd(config->port);
+    apply_shared_config(config, listen_fd);
+    apply_local_config(config);
+    /* Core mode leaves the shared cache unused: the admin socket gets none to act on */
+    if (config->admin_socket[0] &&
+        admin_start(config->admin_socket, config->cores ? NULL : &global_cache) < 0)
+        app_error("could not start the admin socket");
+
+    /* Workers poll the shared socket, so only one of them wins each accept */
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    if (config->workers > 0) {
+        run_prefork(listen_fd);
+    } else if (config->cores > 0) {
+        int signals[] = {SIGHUP, SIGUSR2, SIGQUIT};
+        control_init(signals, 3);
+        upgrade_ready();
+        serve_cores(listen_fd);
+    } else {
+        int signals[] = {SIGHUP, SIGUSR2, SIGQUIT};
+        control_init(signals, 3);
+        upgrade_ready();
+        serve(listen_fd, 1);
+    }
+    return 0;
+}
+
+/* Read the configuration file, if any, and apply command-line overrides */
+config_t *load_config(char *errbuf, size_t errlen) {
+    config_t *config = config_path ? config_load(config_path, errbuf, errlen) : config_default();
+
+    if (!config)
+        return NULL;
+    if (cli_workers >= 0)
+        config->workers = cli_workers;
+    if (cli_port)
+        snprintf(config->port, sizeof(config->port), "%s", cli_port);
+    if (config->workers > 0 && config->cores > 0) {
+        snprintf(errbuf, errlen, "workers and cores can't both be set");
+        free(config);
+        return NULL;
+    }
+    return config;
+}
+
+/* Apply the settings that live in shared state rather than in snapshots */
+void apply_shared_config(config_t *config, int listen_fd) {
+    if (cache_set_limits(&global_cache, config->cache_size, config->max_object_size,
+                         config->cache_policy) < 0)
+        fprintf(stderr, "Could not resize cache to %lu bytes\n", (unsigned long)config->cache_size);
+    cache_set_pinned(&global_cache, config->cache_pinned_size);
+
+    sockopt_apply_listener(listen_fd, config_find_profile(config, config->listen_profile),
+                           config->listen_backlog);
+
+    __atomic_store_n(&proxy_stats->instrument, config->instrument, __ATOMIC_RELAXED);
+    adapt_configure(config);
+    memwatch_configure(config, &global_cache);
+}
+
+/* Apply the settings each process keeps for itself */
+void apply_local_config(config_t *config) {
+    stats_set_log(config->access_log);
+    sched_configure(config->sched_slots, config->sched_aging);
+    shadow_configure(config);
+    pool_configure(config);
+}
+
+/*
+ * reload_config - Load the configuration file again and install it as the
+ *     current snapshot. Requests already running keep their snapshot. In
+ *     prefork mode only the supervisor passes apply_shared, so the cache
+ *     and listening socket are reconfigured once. Returns 0 on success,
+ *     -1 if the file was rejected and the old settings remain.
+ */
+int reload_config(int listen_fd, int apply_shared) {
+    char errbuf[MAXLINE];
+    config_t *config, *old;
+
+    if (!config_path) {
+        fprintf(stderr, "No configuration file to reload\n");
+        return -1;
+    }
+    if (!(config = load_config(errbuf, sizeof(errbuf)))) {
+        fprintf(stderr, "Reload rejected, keeping current settings: %s\n", errbuf);
+        return -1;
+    }
+
+    old = config_get();
+    if (strcmp(old->port, config->port))
+        fprintf(stderr, "Port change to %s ignored until restart or upgrade\n", config->port);
+    snprintf(config->port, sizeof(config->port), "%s", old->port);
+    if ((old->workers == 0) != (config->workers == 0)) {
+        fprintf(stderr, "Switching between threaded and prefork mode needs a restart\n");
+        config->workers = old->workers;
+    }
+    if (old->cores != config->cores) {
+        fprintf(stderr, "Changing the number of cores needs a restart\n");
+        config->cores = old->cores;
+    }
+    config_put(old);
+
+    if (apply_shared)
+        apply_shared_config(config, listen_fd);
+    apply_local_config(config);
+    config_install(config);
+    fprintf(stderr, "Process %d loaded configuration version %lu\n", (int)getpid(), config->version);
+    return 0;
+}
+
+/* Control Signal Handler: forward the signal to the self-pipe */
+void handle_control(int sig) {
+    int olderrno = errno;
+    unsigned char c = sig;
+
+    if (write(control_pipe[1], &c, 1) < 0)
+        ;  /* Pipe full: a signal is already pending */
+    errno = olderrno;
+}
+
+/* Create this process's control pipe and route the given signals to it */
+void control_init(int *signals, int nsignals) {
+    struct sigaction action;
+    int i;
+
+    if (control_pipe[0] >= 0) {
+        close(control_pipe[0]);
+        close(control_pipe[1]);
+    }
+    if (pipe(control_pipe) < 0)
+        unix_error("pipe error");
+    for (i = 0; i < 2; i++) {
+        fcntl(control_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(control_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_control;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    for (i = 0; i < nsignals; i++)
+        sigaction(signals[i], &action, NULL);
+}
+
+/* Return the next pending control signal, or 0 if there is none */
+int control_read(void) {
+    unsigned char c;
+
+    return read(control_pipe[0], &c, 1) == 1 ? c : 0;
+}
+
+/*
+ * serve - Accept loop: one detached thread per connection. Returns after
+ *     SIGQUIT, or after a successful SIGUSR2 upgrade when standalone (in
+ *     prefork mode the supervisor runs upgrades), once in-flight
+ *     connections have drained. SIGHUP reloads the configuration.
+ */
+void serve(int listen_fd, int standalone) {
+    int sig;
+    client_conn_t *conn;
+    struct pollfd fds[2];
+    pthread_t thread_id;
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = control_pipe[0];
+    fds[1].events = POLLIN;
 
     while (1) {
-        client_len = sizeof(client_addr);
-        client_fd = Malloc(sizeof(int));
-        *client_fd = Accept(listen_fd, (SA *)&client_addr, &client_len);
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while ((sig = control_read())) {
+                if (sig == SIGQUIT)
+                    goto stop;
+                if (sig == SIGHUP)
+                    reload_config(listen_fd, standalone);
+                if (sig == SIGUSR2 && standalone && start_upgrade(listen_fd) == 0)
+                    goto stop;
+            }
+        }
+        if (!(fds[0].revents & POLLIN) || !(conn = accept_client(listen_fd)))
+            continue;
+        conn->cache = &global_cache;
+        conn->core = -1;
+        conn->max_object = cache_max_object(&global_cache);
+        if (pool_enabled())
+            pool_submit(pool_client, conn);
+        else
+            Pthread_create(&thread_id, NULL, handle_client, conn);
+    }
+
+ stop:
+    drain_connections();
+}
+
+/* Accept a connection on listen_fd and count it in flight. Returns NULL if there was none. */
+client_conn_t *accept_client(int listen_fd) {
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    struct sockaddr_storage client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    client_conn_t *conn;
+    int fd;
 
-        Getnameinfo((SA *) &client_addr, client_len, host, MAXLINE, port, MAXLINE, 0);
-        printf("Connection from %s:%s\n", host, port);
+    if ((fd = accept(listen_fd, (SA *)&client_addr, &client_len)) < 0) {
+        /* Lost the race to another worker, or the client gave up */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+            fprintf(stderr, "accept error: %s\n", strerror(errno));
+        return NULL;
+    }
 
-        Pthread_create(&thread_id, NULL, handle_client, client_fd);
+    if (client_addr.ss_family == AF_UNIX) {
+        strcpy(host, "unix");
+        strcpy(port, "-");
+    } else {
+        Getnameinfo((SA *) &client_addr, client_len, host, NI_MAXHOST, port, NI_MAXSERV, 0);
     }
+    printf("Connection from %s:%s\n", host, port);
+
+    pthread_mutex_lock(&conn_lock);
+    active_conns++;
+    pthread_mutex_unlock(&conn_lock);
+
+    conn = Malloc(sizeof(client_conn_t));
+    conn->fd = fd;
+    conn->pinned = 0;
+    snprintf(conn->addr, sizeof(conn->addr), "%s:%s", host, port);
+    return conn;
 }
 
-/* Cache Initialization */
-void initialize_cache(cache_manager *cache) {
-    cache->first = NULL;
-    cache->current_size = 0;
-    cache->readers = 0;
-    Sem_init(&cache->read_lock, 0, 1);
-    Sem_init(&cache->write_lock, 0, 1);
+/*
+ * serve_cores - Core mode: start a thread per core, which accept and
+ *     serve connections themselves (see cores.h), and handle control
+ *     signals here. Each core's shard is private to it, so an upgrade
+ *     starts the new binary with empty caches.
+ */
+void serve_cores(int listen_fd) {
+    config_t *config = config_get();
+    int i, sig, n = config->cores;
+    struct pollfd pfd;
+
+    if (cores_init(n, config->cache_size) < 0)
+        unix_error("cores_init error");
+    config_put(config);
+    core_listen_fd = listen_fd;
+    for (i = 0; i < n; i++)
+        Pthread_create(&cores_get(i)->tid, NULL, core_main, cores_get(i));
+
+    pfd.fd = control_pipe[0];
+    pfd.events = POLLIN;
+    while (!cores_stopping) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+        while ((sig = control_read())) {
+            if (sig == SIGHUP && reload_config(listen_fd, 1) == 0) {
+                for (i = 0; i < n; i++)
+                    cores_wake(cores_get(i));  /* To resize their shards */
+            }
+            if (sig == SIGQUIT || (sig == SIGUSR2 && start_upgrade(listen_fd) == 0))
+                __atomic_store_n(&cores_stopping, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        cores_wake(cores_get(i));
+        Pthread_join(cores_get(i)->tid, NULL);
+    }
+    drain_connections();
 }
 
-/* Cache Lookup */
-cache_node_t *check_cache(cache_manager *cache, char *uri) {
-    cache_node_t *current = NULL;
+/*
+ * core_main - One core's loop: accept connections, send each to the core
+ *     that owns its URI, and pin the hits of those this core owns. Between
+ *     wakeups a core touches nothing shared but the rings it reads. It
+ *     never blocks on a client: request lines are peeked at as they
+ *     arrive, each connection with its own deadline, and everything that
+ *     writes to a client runs on a thread.
+ */
+void *core_main(void *arg) {
+    core_t *core = arg;
+    client_conn_t *conn;
+    core_peek_t *peeks = NULL;
+    struct pollfd *fds = NULL;
+    int i, n, npeeks = 0, cap = 0, fds_cap = -1, timeout;
+    uint64_t now, next;
+    pthread_t tid;
+    char c;
 
-    P(&cache->read_lock);
-    cache->readers++;
-    if (cache->readers == 1)
-        P(&cache->write_lock);
-    V(&cache->read_lock);
+    cores_pin(core->id);
+    core_apply_config(core);
 
-    for (current = cache->first; current; current = current->next_ptr) {
-        if ((strcmp(current->url, uri) == 0) || 
-            (uri[strlen(uri)-1] == '/' && strncmp(uri, current->url, strlen(uri)-1) == 0)) {
-            current->access_time = update_counter();
-            break;
+    while (!__atomic_load_n(&cores_stopping, __ATOMIC_RELAXED)) {
+        /* The listening socket, the wake pipe, and each connection not napping */
+        if (fds_cap != cap) {
+            fds_cap = cap;
+            fds = Realloc(fds, (cap + 2) * sizeof(struct pollfd));
+        }
+        fds[0].fd = core_listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = core->wake[0];
+        fds[1].events = POLLIN;
+        now = stats_now_usec();
+        next = 0;
+        for (i = 0; i < npeeks; i++) {
+            fds[i + 2].fd = peeks[i].retry ? -1 : peeks[i].conn->fd;
+            fds[i + 2].events = POLLIN;
+            fds[i + 2].revents = 0;
+            if (!next || peeks[i].deadline < next)
+                next = peeks[i].deadline;
+            if (peeks[i].retry && peeks[i].retry < next)
+                next = peeks[i].retry;
+        }
+        timeout = !next ? -1 : next <= now ? 0 : (int)((next - now + 999) / 1000);
+
+        if (poll(fds, npeeks + 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+        if (fds[1].revents & POLLIN) {
+            while (read(core->wake[0], &c, 1) > 0)
+                ;
+            core_apply_config(core);
+            core_read_mail(core);
+            for (i = 0; i < cores_count(); i++)
+                while ((conn = spsc_pop(&core->rings[i])))
+                    core_serve(core, conn);
+        }
+
+        /* Connections whose line came, or that had their wait, leave the list */
+        now = stats_now_usec();
+        for (i = 0, n = 0; i < npeeks; i++) {
+            if ((fds[i + 2].revents || (peeks[i].retry && now >= peeks[i].retry)) &&
+                core_peek(core, &peeks[i], now))
+                continue;
+            if (now >= peeks[i].deadline) {
+                /* A slow client: wait for its request line on a thread, not here */
+                Pthread_create(&tid, NULL, peek_thread, peeks[i].conn);
+                continue;
+            }
+            peeks[n++] = peeks[i];
         }
+        npeeks = n;
+
+        if (fds[0].revents & POLLIN)
+            core_accept(core, &peeks, &npeeks, &cap);
     }
 
-    P(&cache->read_lock);
-    cache->readers--;
-    if (cache->readers == 0)
-        V(&cache->write_lock);
-    V(&cache->read_lock);
+    /* Stopping: whoever is still sending a request line gets a thread to finish it */
+    for (i = 0; i < npeeks; i++)
+        Pthread_create(&tid, NULL, peek_thread, peeks[i].conn);
+    Free(peeks);
+    Free(fds);
+    return NULL;
+}
+
+/* Bring this core's shard in line with the current settings, if they changed */
+void core_apply_config(core_t *core) {
+    config_t *config = config_get();
 
-    return current;
+    if (config->version != core->config_version) {
+        core->config_version = config->version;
+        if (cache_set_limits(&core->cache, config->cache_size / cores_count(),
+                             config->max_object_size, config->cache_policy) < 0)
+            fprintf(stderr, "Core %d could not resize its cache shard\n", core->id);
+        cache_set_pinned(&core->cache, config->cache_pinned_size / cores_count());
+    }
+    config_put(config);
 }
 
-/* Add to Cache */
-void add_to_cache(cache_manager *cache, char *uri, char *buffer, int size) {
-    if (size > MAX_OBJECT_SIZE)
+/* Accept a connection and add it to those waiting for their request line */
+void core_accept(core_t *core, core_peek_t **peeks, int *npeeks, int *cap) {
+    client_conn_t *conn;
+    core_peek_t *peek;
+
+    if (!(conn = accept_client(core_listen_fd)))
         return;
+    conn->core = -1;
+    if (*npeeks == *cap) {
+        *cap = *cap ? 2 * *cap : 16;
+        *peeks = Realloc(*peeks, *cap * sizeof(core_peek_t));
+    }
+    peek = &(*peeks)[(*npeeks)++];
+    peek->conn = conn;
+    peek->deadline = stats_now_usec() + CORE_PEEK_WAIT * 1000;
+    peek->retry = 0;
+}
 
-    P(&cache->write_lock);
+/*
+ * core_peek - Look at what has come of a waiting connection's request
+ *     line, without blocking. Routes it by its URI once the line is in;
+ *     one that closed or isn't a request goes to a thread for
+ *     process_request to deal with. Returns 1 if the connection left the
+ *     core's wait, 0 if it is still waiting (for more of a partial line
+ *     from CORE_PEEK_RETRY on, since poll would only report it again).
+ */
+int core_peek(core_t *core, core_peek_t *peek, uint64_t now) {
+    client_conn_t *conn = peek->conn;
+    pthread_t tid;
+    int rc;
 
-    while (cache->current_size + size > MAX_CACHE_SIZE)
-        remove_oldest(cache);
+    if ((rc = peek_line(conn->fd, conn->uri)) == 0) {
+        core_route(core, conn);
+        return 1;
+    }
+    if (rc < 0) {
+        conn->cache = NULL;
+        conn->max_object = 0;
+        Pthread_create(&tid, NULL, handle_client, conn);
+        return 1;
+    }
+    peek->retry = now + CORE_PEEK_RETRY * 1000;
+    return 0;
+}
 
-    cache_node_t *new_node = malloc(sizeof(cache_node_t));
-    strcpy(new_node->url, uri);
-    memcpy(new_node->content, buffer, size);
-    new_node->content_size = size;
-    new_node->access_time = update_counter();
+/* Serve conn here if this core owns its URI, else hand it to the owner */
+void core_route(core_t *core, client_conn_t *conn) {
+    core_t *owner = cores_get(cores_owner(conn->uri));
+    conn_mail_t *mail;
+
+    if (owner == core) {
+        STAT_ADD(core_local, 1);
+        core_serve(core, conn);
+    } else if (spsc_push(&owner->rings[core->id], conn) == 0) {
+        STAT_ADD(core_handoffs, 1);
+        cores_wake(owner);
+    } else {  /* Ring full: the mailbox takes any number */
+        STAT_ADD(core_mailed, 1);
+        mail = Malloc(sizeof(conn_mail_t));
+        mail->msg.kind = MAIL_CONN;
+        mail->conn = conn;
+        cores_post(owner, &mail->msg);
+    }
+}
+
+/*
+ * core_serve - On the owning core: look the URI up in the shard, pinning
+ *     a hit, and give the connection to a thread (from the pool, if there
+ *     is one) to send it or fetch the miss, so a slow client holds up
+ *     only that thread. The thread never touches the shard: it mails the
+ *     pin back to be released, or the response to be cached.
+ */
+void core_serve(core_t *core, client_conn_t *conn) {
+    pthread_t tid;
+
+    conn->core = core->id;
+    conn->cache = NULL;
+    conn->max_object = cache_max_object(&core->cache);
+    conn->pinned = cache_acquire(&core->cache, conn->uri, &conn->ref);
+    if (pool_enabled())
+        pool_submit(pool_client, conn);
+    else
+        Pthread_create(&tid, NULL, handle_client, conn);
+}
 
-    new_node->next_ptr = cache->first;
-    cache->first = new_node;
-    cache->current_size += size;
+/* Act on the messages other threads have posted to this core */
+void core_read_mail(core_t *core) {
+    core_msg_t *msg, *next;
+    store_mail_t *store;
 
-    V(&cache->write_lock);
+    for (msg = cores_take_mail(core); msg; msg = next) {
+        next = msg->next;
+        if (msg->kind == MAIL_CONN) {
+            core_serve(core, ((conn_mail_t *)msg)->conn);
+        } else if (msg->kind == MAIL_RELEASE) {
+            cache_release(&core->cache, &((release_mail_t *)msg)->ref);
+        } else {
+            store = (store_mail_t *)msg;
+            cache_insert(&core->cache, store->key, store->object, store->size, &store->meta);
+            Free(store->key);
+            Free(store->object);
+        }
+        Free(msg);
+    }
 }
 
-/* Remove Oldest Cache Entry */
-void remove_oldest(cache_manager *cache) {
-    cache_node_t *prev = NULL, *current = cache->first;
-    cache_node_t *to_remove_prev = NULL, *to_remove = NULL;
+/* Core mode: wait for a slow client's request line, then mail it to its owner */
+void *peek_thread(void *arg) {
+    client_conn_t *conn = arg;
+    config_t *config = config_get();
+    int timeout = config->client_timeout > 0 ? config->client_timeout * 1000 : -1;
+    conn_mail_t *mail;
 
-    if (!current) return;
+    config_put(config);
+    Pthread_detach(pthread_self());
+    if (peek_uri(conn->fd, conn->uri, timeout) < 0) {
+        conn->cache = NULL;  /* Gone, or not a request: let process_request deal with it */
+        conn->max_object = 0;
+        serve_client(conn);
+        return NULL;
+    }
+    STAT_ADD(core_mailed, 1);
+    mail = Malloc(sizeof(conn_mail_t));
+    mail->msg.kind = MAIL_CONN;
+    mail->conn = conn;
+    cores_post(cores_get(cores_owner(conn->uri)), &mail->msg);
+    return NULL;
+}
 
-    int oldest = current->access_time;
-    to_remove = current;
+/*
+ * peek_line - Copy the URI from the request line waiting on fd into uri
+ *     (MAXLINE bytes) without consuming anything or blocking. Returns 0
+ *     once the whole line is in, 1 if only part of it is, -1 if the
+ *     connection closed or this isn't a request line.
+ */
+int peek_line(int fd, char *uri) {
+    char buf[MAXLINE], method[MAXLINE];
+    ssize_t n;
 
-    while (current) {
-        if (current->access_time < oldest) {
-            oldest = current->access_time;
-            to_remove_prev = prev;
-            to_remove = current;
+    if ((n = recv(fd, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1 : -1;
+    if (n == 0)
+        return -1;
+    buf[n] = '\0';
+    if (strchr(buf, '\n'))
+        return sscanf(buf, "%s %s", method, uri) == 2 ? 0 : -1;
+    return n == sizeof(buf) - 1 ? -1 : 1;
+}
+
+/*
+ * peek_uri - Like peek_line, but waiting up to timeout_ms (-1: no limit)
+ *     for the whole line. Returns 0, or -1 if it didn't come or isn't a
+ *     request line. Blocks, so only for threads of their own.
+ */
+int peek_uri(int fd, char *uri, int timeout_ms) {
+    uint64_t deadline = stats_now_usec() + (uint64_t)timeout_ms * 1000, now;
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+            return -1;
+        if ((rc = peek_line(fd, uri)) <= 0)
+            return rc;
+
+        /* Part of the line is here, so poll would return at once: nap, then look again */
+        usleep(CORE_PEEK_RETRY * 1000);
+        if (timeout_ms >= 0) {
+            if ((now = stats_now_usec()) >= deadline)
+                return -1;
+            timeout_ms = (deadline - now) / 1000;
         }
-        prev = current;
-        current = current->next_ptr;
     }
+}
 
-    if (to_remove_prev)
-        to_remove_prev->next_ptr = to_remove->next_ptr;
-    else
-        cache->first = to_remove->next_ptr;
+/* Wait up to drain_timeout seconds for in-flight connections to finish */
+void drain_connections(void) {
+    struct timespec deadline;
+    config_t *config = config_get();
 
-    cache->current_size -= to_remove->content_size;
-    free(to_remove);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config->drain_timeout;
+    config_put(config);
+
+    pthread_mutex_lock(&conn_lock);
+    if (active_conns)
+        fprintf(stderr, "Process %d draining %d connections\n", (int)getpid(), active_conns);
+    while (active_conns > 0 &&
+           pthread_cond_timedwait(&conn_done, &conn_lock, &deadline) != ETIMEDOUT)
+        ;
+    if (active_conns)
+        fprintf(stderr, "Process %d abandoning %d connections\n", (int)getpid(), active_conns);
+    pthread_mutex_unlock(&conn_lock);
+}
+
+/* Hand the listening socket and the cache to a freshly exec'd binary */
+int start_upgrade(int listen_fd) {
+    upgrade_fds_t handoff;
+
+    handoff.nfds = 0;
+    handoff.kinds[handoff.nfds] = UPGRADE_FD_LISTEN;
+    handoff.fds[handoff.nfds++] = listen_fd;
+    if (global_cache.fd >= 0) {
+        handoff.kinds[handoff.nfds] = UPGRADE_FD_CACHE;
+        handoff.fds[handoff.nfds++] = global_cache.fd;
+    }
+    return upgrade_spawn(&handoff);
+}
+
+/*
+ * run_prefork - Fork the configured number of worker processes that all
+ *     accept on listen_fd and share global_cache, then supervise them: a
+ *     worker that exits for any reason (a crash, or a unix_error exit) is
+ *     replaced. SIGHUP reloads the configuration, starting or retiring
+ *     workers to match, and is passed on to the workers. SIGTERM or
+ *     SIGINT stops the workers and the supervisor; SIGQUIT stops them
+ *     gracefully, and SIGUSR2 does so after upgrading to a new binary.
+ */
+void run_prefork(int listen_fd) {
+    int signals[] = {SIGCHLD, SIGTERM, SIGINT, SIGQUIT, SIGUSR2, SIGHUP};
+    pid_t pids[MAX_WORKERS];
+    time_t started[MAX_WORKERS];
+    int i, sig, status, nworkers, wanted, stop_signal = 0;
+    struct pollfd pfd;
+    config_t *config;
+    pid_t pid;
+
+    control_init(signals, 6);
+    config = config_get();
+    nworkers = config->workers;
+    config_put(config);
+    for (i = 0; i < nworkers; i++) {
+        pids[i] = spawn_worker(listen_fd);
+        started[i] = time(NULL);
+    }
+    printf("Supervisor %d started %d workers\n", (int)getpid(), nworkers);
+    fflush(stdout);
+    upgrade_ready();
+
+    pfd.fd = control_pipe[0];
+    pfd.events = POLLIN;
+    while (!stop_signal) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            unix_error("poll error");
+
+        while (!stop_signal && (sig = control_read())) {
+            if (sig == SIGTERM || sig == SIGINT)
+                stop_signal = SIGTERM;
+            else if (sig == SIGQUIT)
+                stop_signal = SIGQUIT;
+            else if (sig == SIGUSR2 && start_upgrade(listen_fd) == 0)
+                stop_signal = SIGQUIT;
+            else if (sig == SIGHUP && reload_config(listen_fd, 1) == 0) {
+                for (i = 0; i < nworkers; i++)
+                    kill(pids[i], SIGHUP);
+
+                config = config_get();
+                wanted = config->workers;
+                config_put(config);
+                for (; nworkers < wanted; nworkers++) {
+                    pids[nworkers] = spawn_worker(listen_fd);
+                    started[nworkers] = time(NULL);
+                }
+                /* Retired workers drain on their own and are not replaced */
+                for (; nworkers > wanted; nworkers--)
+                    kill(pids[nworkers - 1], SIGQUIT);
+            }
+        }
+        if (stop_signal)
+            break;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < nworkers && pids[i] != pid; i++)
+                ;
+            if (i == nworkers)
+                continue;
+
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "Worker %d killed by signal %d, respawning\n", (int)pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "Worker %d exited with status %d, respawning\n", (int)pid, WEXITSTATUS(status));
+
+            if (time(NULL) - started[i] < RESPAWN_DELAY)
+                sleep(RESPAWN_DELAY);
+            pids[i] = spawn_worker(listen_fd);
+            started[i] = time(NULL);
+        }
+    }
+
+    for (i = 0; i < nworkers; i++)
+        kill(pids[i], stop_signal);
+    for (i = 0; i < nworkers; i++)
+        waitpid(pids[i], NULL, 0);
+    exit(0);
+}
+
+/* Start One Worker Process */
+pid_t spawn_worker(int listen_fd) {
+    int signals[] = {SIGQUIT, SIGHUP};
+    pid_t pid;
+
+    if ((pid = Fork()) == 0) {
+        Signal(SIGCHLD, SIG_DFL);
+        Signal(SIGTERM, SIG_DFL);
+        Signal(SIGINT, SIG_DFL);
+        Signal(SIGUSR2, SIG_IGN);
+        control_init(signals, 2);
+#ifdef __linux__
+        /* Don't outlive the supervisor */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            exit(0);
+#endif
+        serve(listen_fd, 0);
+        exit(0);
+    }
+    return pid;
 }
 
 /* Client Handler Thread */
 void *handle_client(void *arg) {
-    int client_fd = *((int *)arg);
     Pthread_detach(pthread_self());
-    Free(arg);
-
-    process_request(client_fd);
-    Close(client_fd);
+    serve_client(arg);
     return NULL;
 }
 
+/* Pool thread entry for a connection */
+void pool_client(void *arg) {
+    serve_client(arg);
+}
+
+/* Serve one connection's request, account for it and close it */
+void serve_client(client_conn_t *conn) {
+    config_t *config = config_get();  /* Kept for the whole request, across reloads */
+    int instrument = __atomic_load_n(&proxy_stats->instrument, __ATOMIC_RELAXED);
+    uint64_t start = stats_now_usec(), usec;
+    syscall_counts_t calls;
+    request_cost_t cost;
+    request_t req;
+
+    req.method[0] = req.uri[0] = '\0';
+    req.outcome = OUTCOME_ERROR;
+    req.status = -1;
+    req.bytes = 0;
+    req.headers = NULL;
+    req.mirror = NULL;
+    req.cache = conn->cache;
+    req.core = conn->core;
+    req.max_object = conn->max_object;
+    req.pinned = conn->pinned ? &conn->ref : NULL;
+    req.cache_class = CACHE_NORMAL;
+    strcpy(req.route, "-");
+    req.cpu_start = instrument ? stats_thread_cpu_usec() : 0;
+    req.cpu_lookup = 0;
+    calls = syscall_counts;
+
+    set_timeout(conn->fd, config->client_timeout);
+    process_request(conn->fd, config, &req);
+    if (req.pinned)  /* Not a request that could use it */
+        release_hit(&req, req.pinned);
+    cost.cpu_usec = req.cpu_start ? stats_thread_cpu_usec() - req.cpu_start : 0;
+    Close(conn->fd);
+    config_put(config);
+
+    if (req.method[0]) {
+        STAT_ADD(requests, 1);
+        STAT_ADD(bytes_out, req.bytes);
+        if (req.outcome == OUTCOME_HIT) {
+            STAT_ADD(hits, 1);
+            STAT_ADD(class_hits[req.cache_class], 1);
+        } else if (req.outcome == OUTCOME_MISS) {
+            STAT_ADD(misses, 1);
+            STAT_ADD(class_misses[req.cache_class], 1);
+        } else
+            STAT_ADD(errors, 1);
+        usec = stats_now_usec() - start;
+        stats_record_latency(req.bytes, usec);
+        if (req.mirror)
+            shadow_submit(req.mirror, req.mirror_len, req.status, usec);
+        if (instrument) {
+            STAT_ADD(usec_total, usec);
+            stats_log_request(conn->addr, req.method, req.uri, req.outcome, req.bytes, usec);
+        }
+        if (req.cpu_start) {  /* Instrumented since it started */
+            cost.requests = 1;
+            cost.lookup_cpu_usec = req.cpu_lookup ? req.cpu_lookup - req.cpu_start : cost.cpu_usec;
+            cost.reads = syscall_counts.reads - calls.reads;
+            cost.writes = syscall_counts.writes - calls.writes;
+            cost.connects = syscall_counts.connects - calls.connects;
+            cost.bytes = req.bytes;
+            stats_record_cost(req.route, req.outcome, &cost);
+        }
+    }
+    Free(conn);
+
+    pthread_mutex_lock(&conn_lock);
+    if (--active_conns == 0)
+        pthread_cond_broadcast(&conn_done);
+    pthread_mutex_unlock(&conn_lock);
+}
+
 /* SIGPIPE Handler */
 void handle_sigpipe(int sig) {
     printf("Received SIGPIPE signal\n");
     return;
 }
 
+/* Bound blocking I/O on fd, so a silent or stalled peer can't hold a thread forever */
+void set_timeout(int fd, int seconds) {
+    struct timeval tv;
+
+    if (seconds <= 0)
+        return;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * finish_after_abort - Whether to keep fetching a response whose client
+ *     has gone. Only worth it if the policy says so, the whole response
+ *     will fit in the cache, and enough of it has already arrived.
+ */
+int finish_after_abort(config_t *config, ssize_t expected, size_t total, size_t max_object) {
+    if (config->client_abort != ABORT_FINISH || expected < 0 || (size_t)expected > max_object)
+        return 0;
+    return total * 100 >= (size_t)expected * config->abort_finish_percent;
+}
+
 /* Process Client Request */
-void process_request(int client_fd) {
+void process_request(int client_fd, config_t *config, request_t *req) {
     char buffer[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char host[MAXLINE], path[MAXLINE], port[MAXLINE], request_header[MAXLINE];
-    rio_t client_rio, server_rio;
+    char client_headers[MAXBUF];
+    char *object_buffer, *relay_buffer;
+    size_t max_object;
+    rio_t client_rio;
+    route_t *route;
+    upstream_t up;
+    char variant[VARY_KEYLEN], list[VARY_LISTLEN], target[MAXLINE];
+    size_t list_len;
+    int mirror, hit, fresh, opened, headers_read = 0, hops = 0;
 
-    Rio_readinitb(&client_rio, client_fd);
-    if (!Rio_readlineb(&client_rio, buffer, MAXLINE)) return;
-    sscanf(buffer, "%s %s %s", method, uri, version);
+    rio_readinitb(&client_rio, client_fd);
+    if (rio_readlineb(&client_rio, buffer, MAXLINE) <= 0) return;
+    if (sscanf(buffer, "%s %s %s", method, uri, version) != 3) return;
+    strcpy(req->method, method);
+    strcpy(req->uri, uri);
     
     if (strcasecmp(method, "GET")) {
         send_error(client_fd, method, "501", "Not Implemented", 
                   "This proxy only supports GET requests");
+        req->status = 501;
+        return;
+    }
+    mirror = shadow_sample();
+
+    /* Each redirect followed for the client starts over here with its target */
+ follow:
+    hit = 0;
+
+    /* The route decides the cache class as well as where a miss goes */
+    extract_uri(uri, host, path, port, request_header);
+    route = config_match_route(config, host, path);
+    if (route) {
+        req->cache_class = route->cache_class;
+        strcpy(req->route, route->name);
+    }
+
+    /* A hit is pinned and sent from the cache region itself, never copied out */
+    cache_ref_t ref;
+    if (req->pinned) {
+        /* Core mode: the owning core looked it up already */
+        ref = *req->pinned;
+        req->pinned = NULL;
+        hit = 1;
+    } else if (req->cache && (hit = cache_acquire(req->cache, uri, &ref)) && (ref.flags & CACHE_VARIANTS)) {
+        /* The URL varies: the client's headers pick the variant */
+        list_len = ref.size < sizeof(list) ? ref.size : sizeof(list);
+        memcpy(list, ref.data, list_len);
+        release_hit(req, &ref);
+        process_headers(&client_rio, -1, 0, client_headers);
+        headers_read = 1;
+        vary_key(uri, list, list_len, client_headers, variant);
+        hit = cache_acquire(req->cache, variant, &ref);
+    }
+    if (req->cpu_start && !req->cpu_lookup)
+        req->cpu_lookup = stats_thread_cpu_usec();
+    if (hit && hops < config->follow_redirects &&
+        redirect_target(config, uri, route, ref.data, ref.hdr_len, target)) {
+        /* A cached redirect: on to its target without the client's round trip */
+        release_hit(req, &ref);
+        adapt_record(uri, ref.size, 1);
+        STAT_ADD(redirects_followed, 1);
+        strcpy(uri, target);
+        hops++;
+        mirror = 0;
+        goto follow;
+    }
+    if (hit && (ref.flags & CACHE_ESI)) {
+        /* A page template: assembled afresh for each client, from its request headers */
+        object_buffer = Malloc(ref.size);
+        memcpy(object_buffer, ref.data, ref.size);
+        release_hit(req, &ref);
+        if (!headers_read)
+            process_headers(&client_rio, -1, 0, client_headers);
+        headers_read = 1;
+        ssize_t esi_bytes = esi_serve(client_fd, &global_cache, uri, object_buffer, ref.hdr_len,
+                                      object_buffer + ref.hdr_len, ref.size - ref.hdr_len,
+                                      client_headers, fetch_fragment, config);
+        Free(object_buffer);
+
+        req->outcome = esi_bytes < 0 ? OUTCOME_ERROR : OUTCOME_HIT;
+        req->status = ref.status;
+        req->bytes = esi_bytes > 0 ? esi_bytes : 0;
+        adapt_record(uri, ref.size, 1);
+        if (mirror)
+            mirror_request(req, request_header, client_headers);
         return;
     }
+    if (hit) {
+        ssize_t hit_bytes = send_cached(client_fd, config, req, &ref);
 
-    cache_node_t *cached = check_cache(&global_cache, uri);
-    if (cached) {
-        Rio_writen(client_fd, cached->content, cached->content_size);
+        req->outcome = OUTCOME_HIT;
+        req->status = ref.status;
+        req->bytes = hit_bytes > 0 ? hit_bytes : 0;
+        adapt_record(uri, ref.size, 1);
+
+        /* The client has its response; only now read the rest of its request for the copy */
+        if (mirror && (headers_read || process_headers(&client_rio, -1, 0, client_headers) == 0))
+            mirror_request(req, request_header, client_headers);
         return;
     }
 
-    extract_uri(uri, host, path, port, request_header);
-    int server_fd = Open_clientfd(host, port);
-    Rio_writen(server_fd, request_header, strlen(request_header));
-    process_headers(&client_rio, server_fd);
+    max_object = req->max_object;
+    object_buffer = Malloc(max_object);
+
+    /* The rest of the request is read first, for a retry or a redirect followed to send again */
+    if (!headers_read)
+        process_headers(&client_rio, -1, 0, client_headers);
+    headers_read = 1;
+    fresh = 0;
+ upstream_retry:
+    if ((opened = upstream_open(config, route, host, port, path, request_header, client_headers,
+                                fresh, &up)) < 0) {
+        send_error(client_fd, up.host, "502", "Bad Gateway",
+                   opened == -1 ? "Could not connect to the origin server"
+                   : "Could not send the request to the origin server");
+        req->status = 502;
+        Free(object_buffer);
+        return;
+    }
+    req->headers = client_headers;
+    if (mirror)
+        mirror_request(req, request_header, client_headers);
 
-    Rio_readinitb(&server_rio, server_fd);
-    char object_buffer[MAX_OBJECT_SIZE] = {0};
-    int total_size = 0;
-    size_t n;
+    /*
+     * With zerocopy, a buffer handed to the kernel can't be refilled until
+     * its send completes, so reads rotate through a small pool and all
+     * outstanding sends are reaped before the pool wraps around.
+     */
+    zc_sock_t zs;
+    int zerocopy = config->zerocopy && config->relay_buffer >= config->zerocopy_threshold &&
+        zc_init(&zs, client_fd) == 0;
+    int pool_size = zerocopy ? ZEROCOPY_POOL : 1, slot = 0;
+    char *relay_pool = Malloc(pool_size * config->relay_buffer);
+    size_t total_size = 0, sent = 0, zerocopy_bytes = 0;
+    ssize_t n, expected = -1, length = -1;
+    size_t hdr_end;
+    int client_gone = 0, finishing = 0, wrote, held = 0;
+    int sched = sched_enabled();
+    sched_ticket_t ticket;
+    struct iovec iov;
 
-    while ((n = Rio_readlineb(&server_rio, buffer, MAXLINE)) > 0) {
-        if (total_size + n < MAX_OBJECT_SIZE) {
-            memcpy(object_buffer + total_size, buffer, n);
+    relay_buffer = relay_pool;
+    /* A kept parent connection has no EOF; the response ends at its length */
+    while ((length < 0 || total_size < (size_t)length) &&
+           (COUNT_SYSCALL(reads), n = read(up.fd, relay_buffer, config->relay_buffer)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;  /* Timed out or reset: relay what we have, but don't cache it */
+        }
+        if (total_size == 0) {
+            req->status = http_status(relay_buffer, n);
+            if (up.via_parent && (hdr_end = http_header_end(relay_buffer, n)) &&
+                http_keep_alive(relay_buffer, hdr_end))
+                length = http_response_length(relay_buffer, hdr_end);
+            /* A page template, or a redirect to follow, is held back whole */
+            if ((hdr_end = http_header_end(relay_buffer, n)) && config->esi && req->core < 0 &&
+                esi_is_template(relay_buffer, hdr_end))
+                held = HELD_ESI;
+            else if (hdr_end && hops < config->follow_redirects &&
+                     redirect_target(config, uri, route, relay_buffer, hdr_end, target))
+                held = HELD_REDIRECT;
+        }
+        if (total_size + n <= max_object) {
+            memcpy(object_buffer + total_size, relay_buffer, n);
         }
         total_size += n;
-        Rio_writen(client_fd, buffer, n);
+        if (held) {
+            if (total_size <= max_object)
+                continue;
+            /* Too big to hold: it goes out as it came */
+            held = 0;
+            if (rio_writen(client_fd, object_buffer, total_size - n) != (ssize_t)(total_size - n)) {
+                STAT_ADD(client_aborts, 1);
+                client_gone = 1;
+                break;
+            }
+            sent = total_size - n;
+        }
+        if (client_gone)
+            continue;
+
+        /* Priority is the bytes still to send, known once the headers give a length */
+        if (sched) {
+            if (expected < 0 && total_size <= max_object)
+                expected = http_response_length(object_buffer, total_size);
+            sched_acquire(&ticket, expected > (ssize_t)sent ? expected - sent : SCHED_UNKNOWN_SIZE);
+        }
+        if (zerocopy && (size_t)n >= config->zerocopy_threshold) {
+            wrote = send_zerocopy(&zs, relay_buffer, n, sched ? &ticket : NULL) == n;
+            zerocopy_bytes += wrote ? n : 0;
+            slot = (slot + 1) % pool_size;
+            relay_buffer = relay_pool + slot * config->relay_buffer;
+            if (wrote && slot == 0 && zc_reap(&zs, ZEROCOPY_WAIT * 1000) < 0)
+                wrote = 0;
+        } else if (sched) {
+            iov.iov_base = relay_buffer;
+            iov.iov_len = n;
+            wrote = send_iov(client_fd, &iov, 1, 0, &ticket) == n;
+        } else {
+            wrote = rio_writen(client_fd, relay_buffer, n) == n;
+        }
+        if (sched)
+            sched_release(&ticket);
+        if (wrote) {
+            sent += n;
+            continue;
+        }
+
+        /* The client left mid-response: cancel the fetch, or finish it for the cache */
+        client_gone = 1;
+        STAT_ADD(client_aborts, 1);
+        expected = http_response_length(object_buffer, total_size < max_object ? total_size : max_object);
+        if (!finish_after_abort(config, expected, total_size, max_object)) {
+            STAT_ADD(aborts_cancelled, 1);
+            STAT_ADD(abort_wasted_bytes, total_size - sent);
+            if (expected > (ssize_t)total_size)
+                STAT_ADD(abort_saved_bytes, expected - total_size);
+            break;
+        }
+        STAT_ADD(aborts_finished, 1);
+        finishing = 1;
     }
 
-    Close(server_fd);
+    if (length >= 0 && total_size == (size_t)length)
+        n = 0;
+    if (up.via_parent && up.parent.reused && total_size == 0 && !client_gone) {
+        /* Not a byte back: the parent closed it while pooled, so once more on a new connection */
+        Close(up.fd);
+        Free(relay_pool);  /* Nothing was sent from it */
+        STAT_ADD(parent_retries, 1);
+        mirror = 0;        /* Already copied */
+        fresh = 1;
+        goto upstream_retry;
+    }
+    if (!upstream_close(config, &up, n == 0, total_size == (size_t)length))
+        n = -1;
+    req->outcome = n == 0 && !client_gone ? OUTCOME_MISS : OUTCOME_ERROR;
+    req->bytes = sent;
+    if (held == HELD_ESI && n == 0 && (hdr_end = http_header_end(object_buffer, total_size))) {
+        n = esi_serve(client_fd, &global_cache, uri, object_buffer, hdr_end, object_buffer + hdr_end,
+                      total_size - hdr_end, client_headers, fetch_fragment, config);
+        req->bytes = n > 0 ? n : 0;
+        if (n < 0)
+            req->outcome = OUTCOME_ERROR;
+        n = 0;
+    } else if ((held && n != 0) || (total_size == 0 && !client_gone)) {
+        send_error(client_fd, up.host, "502", "Bad Gateway",
+                   "Could not read the response from the origin server");
+        req->status = 502;
+        req->outcome = OUTCOME_ERROR;
+    }
+
+    if (n == 0)
+        adapt_record(uri, total_size, 0);
+    if (n == 0 && total_size <= max_object) {
+        store_response(req, uri, object_buffer, total_size, held == HELD_ESI ? CACHE_ESI : 0);
+        if (client_gone)
+            STAT_ADD(abort_salvaged_bytes, total_size - sent);
+    } else if (finishing) {  /* Finished in vain: failed, or bigger than it claimed */
+        STAT_ADD(abort_wasted_bytes, total_size - sent);
+    }
+    Free(object_buffer);
 
-    if (total_size <= MAX_OBJECT_SIZE) {
-        add_to_cache(&global_cache, uri, object_buffer, total_size);
+    /* The kernel may still be sending from the pool; if it never lets go, leak it */
+    if (zerocopy) {
+        zerocopy_account(&zs, zerocopy_bytes);
+        if (zs.completed != zs.sent)
+            return;
+    }
+    Free(relay_pool);
+
+    if (held == HELD_REDIRECT && n == 0) {
+        STAT_ADD(redirects_followed, 1);
+        strcpy(uri, target);
+        hops++;
+        mirror = 0;
+        goto follow;
     }
 }
 
-/* Process HTTP Headers */
-void process_headers(rio_t *client_rio, int server_fd) {
+/*
+ * upstream_open - Send the request for host:port/path where its route
+ *     says a miss goes: the route's upstream, a parent (in absolute
+ *     form) or the origin, over HTTP/1.x or as an h2c stream. The
+ *     request is request_header (its request and Host lines), then
+ *     headers, the client's other request headers. Unless fresh, a
+ *     pooled parent connection may be taken, and is replaced once if
+ *     the parent closed it. Returns 0 with up->fd ready to read the
+ *     response from, under upstream_timeout; -1 if no connection could
+ *     be made, -2 if the request could not be sent.
+ */
+int upstream_open(config_t *config, route_t *route, char *host, char *port, char *path,
+                  const char *request_header, char *headers, int fresh, upstream_t *up) {
+    char line[MAXLINE], authority[MAXLINE];
+    const char *request = request_header;
+    sock_profile_t *profile;
+
+    /* A route may send this host to another origin; the Host header is unchanged */
+    up->host = host;
+    up->port = port;
+    up->via_parent = 0;
+    up->h2 = route && route->h2;
+    if (route && route->upstream_host[0]) {
+        up->host = route->upstream_host;
+        up->port = route->upstream_port;
+    } else if (!config->nparents || up->h2) {
+        /* Straight to the origin: parents are only spoken to in HTTP/1.x */
+    } else if (config_bypass_parent(config, host)) {
+        STAT_ADD(parent_bypassed, 1);
+    } else {
+        up->via_parent = 1;
+    }
+    profile = config_find_profile(config, route && route->profile[0] ? route->profile
+                                  : config->upstream_profile);
+ retry:
+    if (up->via_parent) {
+        /* A parent takes the absolute URI, and may keep the connection for the next miss */
+        up->fd = parent_connect(config, host, profile, fresh, &up->parent);
+        up->host = up->fd >= 0 ? config->parents[up->parent.index].host : "parent proxy";
+        if (snprintf(line, MAXLINE, "GET http://%s%s%s%s HTTP/1.0\r\nHost: %s\r\n", host,
+                     strcmp(port, "80") ? ":" : "", strcmp(port, "80") ? port : "", path, host) >= MAXLINE)
+            line[0] = '\0';  /* Too long: sent without a request line, the parent rejects it */
+        request = line;
+        STAT_ADD(parent_requests, 1);
+    } else if (up->h2) {
+        /* A stream on a shared connection; its response is read from up->fd all the same */
+        up->fd = -1;
+        if (snprintf(authority, MAXLINE, "%s%s%s", host, strcmp(port, "80") ? ":" : "",
+                     strcmp(port, "80") ? port : "") < MAXLINE &&
+            h2_request(config, up->host, up->port, profile, authority, path, headers, &up->h2req) == 0)
+            up->fd = up->h2req.fd;
+    } else {
+        up->fd = open_clientfd_setup(up->host, up->port, profile ? sockopt_setup_upstream : NULL,
+                                     profile);
+    }
+    if (up->fd < 0)
+        return -1;
+    set_timeout(up->fd, config->upstream_timeout);
+    if (!up->h2 && (rio_writen(up->fd, (char *)request, strlen(request)) < 0 ||
+                    process_headers(NULL, up->fd, up->via_parent, headers) < 0)) {
+        Close(up->fd);
+        if (up->via_parent && up->parent.reused) {
+            /* The parent closed it while pooled: once more, on a new connection */
+            STAT_ADD(parent_retries, 1);
+            fresh = 1;
+            goto retry;
+        }
+        return -2;
+    }
+    return 0;
+}
+
+/*
+ * upstream_close - Done reading the response from up. It ended (EOF,
+ *     or the end of its length) if ended; kept, it ended at its length
+ *     on a connection the upstream keeps open, which goes back to the
+ *     pool. Returns whether the response came whole: an h2c stream may
+ *     have been reset.
+ */
+int upstream_close(config_t *config, upstream_t *up, int ended, int kept) {
+    if (up->via_parent)
+        parent_done(config, &up->parent, ended && kept);
+    else if (up->h2) {
+        if (!h2_done(&up->h2req))
+            return 0;  /* Reset or cut off: the EOF doesn't end a whole response */
+    } else
+        Close(up->fd);
+    return ended;
+}
+
+/*
+ * fetch_fragment - Fetch an ESI fragment the way a miss for its URL is
+ *     fetched (see esi_fetch_t); arg is the configuration.
+ */
+ssize_t fetch_fragment(void *arg, const char *url, const char *headers, char *resp, size_t size) {
+    config_t *config = arg;
+    char uri[MAXLINE], host[MAXLINE], path[MAXLINE], port[MAXLINE], request_header[MAXLINE];
+    route_t *route;
+    upstream_t up;
+    size_t got, hdr_end;
+    ssize_t n, length;
+    int fresh = 0;
+
+    if (snprintf(uri, MAXLINE, "%s", url) >= MAXLINE)
+        return -1;
+    extract_uri(uri, host, path, port, request_header);
+    route = config_match_route(config, host, path);
+ retry:
+    if (upstream_open(config, route, host, port, path, request_header, (char *)headers, fresh, &up) < 0)
+        return -1;
+    got = 0;
+    length = -1;
+    n = -1;
+    while (got < size && (length < 0 || got < (size_t)length) &&
+           (n = read(up.fd, resp + got, size - got)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        got += n;
+        if (up.via_parent && length < 0 && (hdr_end = http_header_end(resp, got)) &&
+            http_keep_alive(resp, hdr_end))
+            length = http_response_length(resp, hdr_end);
+    }
+    if (length >= 0 && got == (size_t)length)
+        n = 0;
+    if (up.via_parent && up.parent.reused && got == 0) {
+        /* As for a miss: the parent closed it while pooled */
+        Close(up.fd);
+        STAT_ADD(parent_retries, 1);
+        fresh = 1;
+        goto retry;
+    }
+    if (!upstream_close(config, &up, n == 0, got == (size_t)length) || got == 0)
+        return -1;
+    return got;
+}
+
+/*
+ * redirect_target - If the response headers at resp (hdr_len bytes) are
+ *     a redirect to follow for uri, put the absolute URL it points to in
+ *     target (MAXLINE bytes) and return 1, else return 0. Only http URLs
+ *     (or paths on uri's origin) that fall under the same route as uri
+ *     are followed, so the target is fetched and cached the same way.
+ */
+int redirect_target(config_t *config, const char *uri, route_t *route, const char *resp,
+                    size_t hdr_len, char *target) {
+    char location[MAXLINE], host[MAXLINE], path[MAXLINE], port[MAXLINE], request_header[MAXLINE];
+    size_t origin_len;
+
+    if (!http_is_redirect(http_status(resp, hdr_len)) ||
+        !http_find_header(resp, hdr_len, "Location", location, sizeof(location)))
+        return 0;
+    if (location[0] == '/' && location[1] != '/') {
+        origin_len = strncasecmp(uri, "http://", 7) ? 0 : 7 + strcspn(uri + 7, "/");
+        if (!origin_len || snprintf(target, MAXLINE, "%.*s%s", (int)origin_len, uri, location) >= MAXLINE)
+            return 0;
+    } else if (!strncasecmp(location, "http://", 7)) {
+        strcpy(target, location);
+    } else {
+        return 0;
+    }
+    extract_uri(target, host, path, port, request_header);
+    return strcmp(target, uri) && config_match_route(config, host, path) == route;
+}
+
+/* Wait out a socket's zerocopy sends and add them to the counters */
+void zerocopy_account(zc_sock_t *zs, size_t bytes) {
+    if (zs->completed != zs->sent && zc_reap(zs, ZEROCOPY_WAIT * 1000) < 0)
+        STAT_ADD(zerocopy_stuck, 1);
+    STAT_ADD(zerocopy_sends, zs->sent);
+    STAT_ADD(zerocopy_copied, zs->copied);
+    STAT_ADD(zerocopy_bytes, bytes);
+}
+
+/*
+ * send_iov - sendmsg all of iov, picking up after partial sends. With
+ *     a scheduler ticket (its slot held), the socket is never waited on
+ *     with the slot: see sched_wait_writable. Returns the bytes sent, or -1.
+ */
+ssize_t send_iov(int fd, struct iovec *iov, int iovcnt, int flags, sched_ticket_t *ticket) {
+    struct msghdr msg;
+    size_t total = 0;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        COUNT_SYSCALL(writes);
+        if ((n = sendmsg(fd, &msg, flags | (ticket ? MSG_DONTWAIT : 0))) < 0) {
+            if (errno == EINTR ||
+                (ticket && (errno == EAGAIN || errno == EWOULDBLOCK) && sched_wait_writable(ticket, fd) == 0))
+                continue;
+            return -1;
+        }
+        total += n;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+/* zc_send all of buf; with a scheduler ticket, as send_iov does. Returns len, or -1. */
+ssize_t send_zerocopy(zc_sock_t *zs, const char *buf, size_t len, sched_ticket_t *ticket) {
+    size_t done = 0;
+    ssize_t n;
+
+    if (!ticket)
+        return zc_send(zs, buf, len, 0);
+    while ((n = zc_send(zs, buf + done, len - done, MSG_DONTWAIT)) >= 0) {
+        if ((done += n) == len)
+            return len;
+        if (sched_wait_writable(ticket, zs->fd) < 0)
+            break;
+    }
+    return -1;
+}
+
+#ifdef __linux__
+/*
+ * send_cache_file - sendfile len bytes of the cache memfd from offset;
+ *     with a scheduler ticket, as send_iov does (sendfile takes no
+ *     flags, so the socket is made non-blocking meanwhile). Returns 0,
+ *     or -1 on error.
+ */
+int send_cache_file(int fd, int cache_fd, off_t offset, size_t len, sched_ticket_t *ticket) {
+    int fl = ticket ? fcntl(fd, F_GETFL) : 0, rc = 0;
+    ssize_t n;
+
+    if (ticket)
+        fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+    while (len > 0) {
+        COUNT_SYSCALL(writes);
+        if ((n = sendfile(fd, cache_fd, &offset, len)) <= 0) {
+            if (n < 0 && (errno == EINTR ||
+                          (ticket && errno == EAGAIN && sched_wait_writable(ticket, fd) == 0)))
+                continue;
+            rc = -1;
+            break;
+        }
+        len -= n;
+    }
+    if (ticket)
+        fcntl(fd, F_SETFL, fl);
+    return rc;
+}
+#endif
+
+/*
+ * send_cached - Send a pinned cache object and drop the pin. The stored
+ *     header block stops short of the blank line, so this hit's Age,
+ *     Connection and X-Proxy-Cache headers are patched in after it.
+ *     Usually the block, the patch and the body go out in one writev; a
+ *     large body instead follows the headers (sent with MSG_MORE, to
+ *     share its first segment) by MSG_ZEROCOPY or by sendfile from the
+ *     cache memfd.
+ *     With output scheduling, the body goes a quantum per slot grant,
+ *     the slot given up whenever the client's socket is full.
+ *     A zerocopy body keeps the pin until the kernel is done with its
+ *     pages. Returns the bytes sent, or -1.
+ */
+ssize_t send_cached(int fd, config_t *config, request_t *req, cache_ref_t *ref) {
+    cache_t *cache = req->core >= 0 ? &cores_get(req->core)->cache : req->cache;
+    size_t body = ref->size - ref->hdr_len, head, off = 0, chunk, quantum;
+    const char *data = ref->data + ref->hdr_len;
+    int mode = SEND_COPY, sched = sched_enabled(), ok;
+    sched_ticket_t ticket;
+    struct iovec iov[3];
+    char patch[96];
+    zc_sock_t zs;
+
+    iov[0].iov_base = (char *)ref->data;
+    iov[0].iov_len = ref->hdr_len;
+    iov[1].iov_base = patch;
+    iov[1].iov_len = !ref->hdr_len ? 0 :  /* Not a parsed response: send it as stored */
+        sprintf(patch, "Age: %ld\r\nConnection: close\r\nX-Proxy-Cache: HIT\r\n\r\n",
+                (long)(time(NULL) - ref->stored));
+    iov[2].iov_base = (char *)data;
+    iov[2].iov_len = body;
+    head = iov[0].iov_len + iov[1].iov_len;
+
+    if (config->zerocopy && body >= config->zerocopy_threshold && zc_init(&zs, fd) == 0)
+        mode = SEND_ZEROCOPY;
+#ifdef __linux__
+    else if (config->cache_sendfile && cache->fd >= 0 && body >= SENDFILE_MIN)
+        mode = SEND_SENDFILE;
+#endif
+    quantum = sched ? config->sched_quantum : body;
+
+    if (mode == SEND_COPY && body <= quantum) {
+        if (sched)
+            sched_acquire(&ticket, head + body);
+        ok = send_iov(fd, iov, 3, 0, sched ? &ticket : NULL) >= 0;
+        if (sched)
+            sched_release(&ticket);
+        off = body;
+    } else {
+        do {
+            chunk = body - off < quantum ? body - off : quantum;
+            if (sched)
+                sched_acquire(&ticket, body - off + (off ? 0 : head));
+            ok = off || send_iov(fd, iov, 2, MSG_MORE, sched ? &ticket : NULL) >= 0;
+            if (ok && mode == SEND_ZEROCOPY) {
+                ok = send_zerocopy(&zs, data + off, chunk, sched ? &ticket : NULL) >= 0;
+#ifdef __linux__
+            } else if (ok && mode == SEND_SENDFILE) {
+                ok = send_cache_file(fd, cache->fd, ref->offset + ref->hdr_len + off, chunk,
+                                     sched ? &ticket : NULL) == 0;
+#endif
+            } else if (ok) {
+                iov[2].iov_base = (char *)data + off;
+                iov[2].iov_len = chunk;
+                ok = send_iov(fd, &iov[2], 1, 0, sched ? &ticket : NULL) >= 0;
+            }
+            if (sched)
+                sched_release(&ticket);
+            off += ok ? chunk : 0;
+        } while (ok && off < body);
+    }
+
+    if (mode == SEND_ZEROCOPY) {
+        zerocopy_account(&zs, off);
+        if (zs.completed != zs.sent)
+            return ok ? (ssize_t)(head + body) : -1;  /* The kernel never let go: leave it pinned */
+    }
+    release_hit(req, ref);
+    return ok ? (ssize_t)(head + body) : -1;
+}
+
+/* Drop a hit's pin; in core mode the owning core does, the only thread that touches its shard */
+void release_hit(request_t *req, cache_ref_t *ref) {
+    release_mail_t *mail;
+
+    if (req->core < 0) {
+        cache_release(req->cache, ref);
+        return;
+    }
+    mail = Malloc(sizeof(release_mail_t));
+    mail->msg.kind = MAIL_RELEASE;
+    mail->ref = *ref;
+    cores_post(cores_get(req->core), &mail->msg);
+}
+
+/*
+ * store_response - Cache a complete response, its headers rebuilt for
+ *     serving hits, with the given cache flags. Anything without a
+ *     status line and headers (an empty reply, say) is not a response
+ *     to serve again and is dropped. In core mode it is mailed to the
+ *     core owning the URI, the only thread that may insert it.
+ */
+void store_response(request_t *req, const char *uri, const char *resp, size_t len, int flags) {
+    size_t hdr_end = http_header_end(resp, len);
+    char *object, vary[MAXLINE];
+    store_mail_t *mail;
+    cache_meta_t meta;
+    ssize_t size;
+    int varies = hdr_end && http_find_header(resp, hdr_end, "Vary", vary, sizeof(vary));
+    int status = hdr_end ? http_status(resp, hdr_end) : -1;
+    long fresh = 0;
+
+    if (status < 0 || (varies && req->core >= 0))  /* See vary.h */
+        return;
+    /* A permanent redirect keeps; a temporary one only as long as it says */
+    if (http_is_redirect(status)) {
+        fresh = http_freshness(resp, hdr_end);
+        if (fresh == 0 || (fresh < 0 && status != 301 && status != 308))
+            return;
+        STAT_ADD(redirects_cached, 1);
+    }
+    object = Malloc(len + 64);
+    meta.flags = flags;
+    meta.expires = fresh > 0 ? time(NULL) + fresh : 0;
+    meta.cache_class = req->cache_class;
+    if ((size = http_build_cached(resp, len, object, len + 64, &meta.hdr_len, &meta.status,
+                                  &meta.initial_age)) < 0) {
+        Free(object);
+        return;
+    }
+    if (req->core >= 0) {
+        mail = Malloc(sizeof(store_mail_t));
+        mail->msg.kind = MAIL_STORE;
+        mail->key = Malloc(strlen(uri) + 1);
+        strcpy(mail->key, uri);
+        mail->object = object;
+        mail->size = size;
+        mail->meta = meta;
+        cores_post(cores_get(req->core), &mail->msg);
+        return;
+    }
+    if (varies)
+        vary_store(&global_cache, uri, vary, req->headers ? req->headers : "", object, size, &meta);
+    else
+        cache_insert(&global_cache, uri, object, size, &meta);
+    Free(object);
+}
+
+/*
+ * process_headers - Forward the client's request headers to server_fd
+ *     after the proxy's own, asking for the connection to be kept open
+ *     if keep_alive (or closed otherwise). With copy (MAXBUF bytes),
+ *     also keep there the client's headers that are forwarded, as many
+ *     whole lines as fit; a server_fd of -1 only copies them. With no
+ *     client_rio the headers were read already, and are forwarded from
+ *     copy. Returns -1 if the origin stopped taking them, else 0.
+ */
+int process_headers(rio_t *client_rio, int server_fd, int keep_alive, char *copy) {
     char buf[MAXLINE];
+    size_t copied = 0, n;
 
-    sprintf(buf, "%s", user_agent);
-    Rio_writen(server_fd, buf, strlen(buf));
-    sprintf(buf, "%s", connection_hdr);
-    Rio_writen(server_fd, buf, strlen(buf));
-    sprintf(buf, "%s", proxy_connection);
-    Rio_writen(server_fd, buf, strlen(buf));
+    if (keep_alive)
+        sprintf(buf, "%s%s", user_agent, keep_alive_hdrs);
+    else
+        sprintf(buf, "%s%s%s", user_agent, connection_hdr, proxy_connection);
+    if (server_fd >= 0 && rio_writen(server_fd, buf, strlen(buf)) < 0)
+        return -1;
+    if (!client_rio)
+        return rio_writen(server_fd, copy, strlen(copy)) < 0 || rio_writen(server_fd, "\r\n", 2) < 0 ? -1 : 0;
+    if (copy)
+        copy[0] = '\0';
 
-    while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
+    while (rio_readlineb(client_rio, buf, MAXLINE) > 0) {
         if (strcmp(buf, "\r\n") == 0) break;
 
         if (strncmp(buf, "Host:", 5) == 0 || 
@@ -245,30 +1787,42 @@ void process_headers(rio_t *client_rio, int server_fd) {
             strncmp(buf, "Proxy-Connection:", 17) == 0)
             continue;
 
-        Rio_writen(server_fd, buf, strlen(buf));
+        n = strlen(buf);
+        if (copy && copied + n < MAXBUF) {
+            memcpy(copy + copied, buf, n + 1);
+            copied += n;
+        }
+        if (server_fd >= 0 && rio_writen(server_fd, buf, n) < 0)
+            return -1;
     }
 
-    Rio_writen(server_fd, "\r\n", 2);
+    return server_fd >= 0 && rio_writen(server_fd, "\r\n", 2) < 0 ? -1 : 0;
+}
+
+/* Keep the request for the shadow upstream, asking it to keep the connection open */
+void mirror_request(request_t *req, const char *request_header, const char *client_headers) {
+    size_t size = strlen(request_header) + strlen(user_agent) + strlen(client_headers) + 32;
+
+    req->mirror = Malloc(size);
+    req->mirror_len = snprintf(req->mirror, size, "%s%sConnection: keep-alive\r\n%s\r\n",
+                               request_header, user_agent, client_headers);
 }
 
-/* Send Error Response */
+/* Send Error Response; best effort, since the client may already be gone */
 void send_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXLINE];
+    char buf[MAXLINE + 512];
     
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<html><title>Proxy Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=\"ffffff\">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>Web Proxy Server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    snprintf(buf, sizeof(buf),
+             "HTTP/1.0 %s %s\r\n"
+             "Content-type: text/html\r\n\r\n"
+             "<html><title>Proxy Error</title>"
+             "<body bgcolor=\"ffffff\">\r\n"
+             "%s: %s\r\n"
+             "<p>%s: %.*s\r\n"
+             "<hr><em>Web Proxy Server</em>\r\n",
+             errnum, shortmsg, errnum, shortmsg, longmsg, MAXLINE, cause);
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+        return;
 }
 
 /* URI Parser */
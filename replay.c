@@ -0,0 +1,366 @@
+/*
+ * replay.c - replay an access log or trace through the proxy
+ *
+ * usage: ./replay [-m original|max] [-s speed] [-c conns] [-o port] <proxy> <trace>
+ *
+ * <proxy> is host:port or unix:<path>. The trace is either the proxy's
+ * own access log (see stats_log_request) or lines of
+ *
+ *   <unix time> <url> <size>
+ *
+ * Only GETs are replayed; anything else, and lines that parse as
+ * neither, are skipped.
+ *
+ * In original mode (the default) each request is sent at its offset
+ * from the first one in the trace, divided by speed (-s 10 replays an
+ * hour in six minutes): conns threads take requests in order and wait
+ * for their time, so bursts come out as bursts for as long as there
+ * are threads free, and requests sent over 10 ms late are counted.
+ * Max mode ignores the timestamps and keeps conns requests in flight.
+ *
+ * With -o, replay serves as the origin itself on that port: each URL
+ * is rewritten to http://localhost:<port>/<size>/<host><path>, and the
+ * origin answers it with <size> bytes, cacheable for an hour. The cache
+ * sees the production mix of URLs and sizes without the production
+ * origins. Without -o the URLs are fetched as they are.
+ *
+ * A response the proxy served from its cache is told by the
+ * X-Proxy-Cache: HIT header it adds to hits; an Age header would not
+ * do, as misses pass on the origin's. The report gives the replay's hit ratios and latency
+ * percentiles and, for an access log, the production ones beside them.
+ */
+#include "csapp.h"
+#include <stdint.h>
+
+#define LATE_USEC   10000   /* Sent this much after its time: late */
+#define ORIGIN_MAX  (64 << 20)  /* Largest body the origin serves */
+
+typedef struct {
+    uint64_t at_usec;       /* Offset from the first request */
+    char *url;
+    size_t size;            /* Bytes production sent, 0 if unknown */
+    int prod_outcome;       /* 1 hit, 0 miss, -1 unknown or error */
+    uint64_t prod_usec;     /* Production latency, 0 if unknown */
+} trace_req_t;
+
+typedef struct {
+    uint64_t *latency;      /* Per request, usec */
+    long count;
+    long errors;
+    long hits;
+    long late;
+    uint64_t bytes;
+    uint64_t hit_bytes;
+} replay_thread_t;
+
+static char *proxy_host, *proxy_port;
+static trace_req_t *reqs;
+static long nreqs;
+static long next_request = 0;
+static int max_rate = 0;
+static double speed = 1.0;
+static uint64_t start_usec;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*****************
+ * Trace reading
+ *****************/
+
+/* Parse one access log or trace line into r; returns 0, or -1 to skip it */
+static int parse_line(char *line, trace_req_t *r, double *t) {
+    char *f[8], *save, *p;
+    int n = 0;
+
+    for (p = strtok_r(line, " \t\r\n", &save); p && n < 8; p = strtok_r(NULL, " \t\r\n", &save))
+        f[n++] = p;
+    *t = n ? atof(f[0]) : 0;
+    if (n == 7) {  /* <time> <client> <method> <uri> <outcome> <bytes> <usec> */
+        if (strcmp(f[2], "GET"))
+            return -1;
+        r->url = f[3];
+        r->size = strtoul(f[5], NULL, 10);
+        r->prod_outcome = !strcmp(f[4], "HIT") ? 1 : !strcmp(f[4], "MISS") ? 0 : -1;
+        r->prod_usec = strtoull(f[6], NULL, 10);
+    } else if (n == 3) {  /* <time> <url> <size> */
+        r->url = f[1];
+        r->size = strtoul(f[2], NULL, 10);
+        r->prod_outcome = -1;
+        r->prod_usec = 0;
+    } else {
+        return -1;
+    }
+    return strncasecmp(r->url, "http://", 7) ? -1 : 0;
+}
+
+/* Rewrite a URL onto the replay origin, keeping its host and path distinct */
+static char *origin_url(const char *url, size_t size, const char *origin_port) {
+    char buf[MAXLINE];
+
+    snprintf(buf, sizeof(buf), "http://localhost:%s/%lu/%s", origin_port,
+             (unsigned long)size, url + 7);
+    return strdup(buf);
+}
+
+static void read_trace(const char *path, const char *origin_port) {
+    FILE *fp = fopen(path, "r");
+    char line[MAXLINE + 256];
+    double t, first = -1;
+    long cap = 1024;
+    trace_req_t r;
+
+    if (!fp)
+        unix_error("could not open trace");
+    reqs = Malloc(cap * sizeof(trace_req_t));
+    while (fgets(line, sizeof(line), fp)) {
+        if (parse_line(line, &r, &t) < 0)
+            continue;
+        if (first < 0)
+            first = t;
+        /* Timestamps from several workers may be slightly out of order */
+        r.at_usec = t > first ? (uint64_t)((t - first) * 1e6 / speed) : 0;
+        r.url = origin_port ? origin_url(r.url, r.size, origin_port) : strdup(r.url);
+        if (nreqs == cap)
+            reqs = Realloc(reqs, (cap *= 2) * sizeof(trace_req_t));
+        reqs[nreqs++] = r;
+    }
+    fclose(fp);
+}
+
+/*******************
+ * Replay origin
+ *******************/
+
+/* Answer one request for /<size>/... with that many bytes */
+static void *origin_conn(void *arg) {
+    int fd = (int)(long)arg;
+    char buf[MAXLINE], method[16], uri[MAXLINE];
+    size_t size, n;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, sizeof(buf)) > 0 &&
+        sscanf(buf, "%15s %8191s", method, uri) == 2) {
+        while (rio_readlineb(&rio, buf, sizeof(buf)) > 2)
+            ;
+        size = strtoul(uri + (uri[0] == '/'), NULL, 10);
+        size = size < ORIGIN_MAX ? size : ORIGIN_MAX;
+        n = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-Length: %lu\r\n"
+                     "Cache-Control: max-age=3600\r\nConnection: close\r\n\r\n", (unsigned long)size);
+        if (rio_writen(fd, buf, n) == (ssize_t)n) {
+            memset(buf, 'x', sizeof(buf));
+            for (; size > 0; size -= n) {
+                n = size < sizeof(buf) ? size : sizeof(buf);
+                if (rio_writen(fd, buf, n) != (ssize_t)n)
+                    break;
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *origin_thread(void *arg) {
+    int listen_fd = (int)(long)arg, fd;
+    pthread_t tid;
+
+    while (1)
+        if ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+            Pthread_create(&tid, NULL, origin_conn, (void *)(long)fd);
+    return NULL;
+}
+
+/*************
+ * Replaying
+ *************/
+
+/* Fetch one URL; returns the response bytes, or -1. Sets *hit if it came from the cache. */
+static ssize_t fetch(const char *url, int *hit) {
+    char buf[MAXBUF], head[MAXLINE], *end;
+    ssize_t n, total = 0;
+    size_t head_len = 0;
+    int fd;
+
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+        return -1;
+    n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", url);
+    if (rio_writen(fd, buf, n) < 0) {
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (head_len < sizeof(head) - 1) {
+            size_t k = (size_t)n < sizeof(head) - 1 - head_len ? (size_t)n : sizeof(head) - 1 - head_len;
+            memcpy(head + head_len, buf, k);
+            head_len += k;
+        }
+        total += n;
+    }
+    close(fd);
+    head[head_len] = '\0';
+    /* Only the headers count: a body could say anything */
+    if ((end = strstr(head, "\r\n\r\n")))
+        *end = '\0';
+    *hit = strstr(head, "\r\nX-Proxy-Cache: HIT") != NULL;
+    return n < 0 || total == 0 ? -1 : total;
+}
+
+static void *replay_thread(void *arg) {
+    replay_thread_t *t = arg;
+    uint64_t start, due;
+    ssize_t n;
+    long i;
+    int hit;
+
+    while ((i = __atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED)) < nreqs) {
+        if (!max_rate) {
+            due = start_usec + reqs[i].at_usec;
+            if ((start = now_usec()) < due)
+                usleep(due - start);
+            else if (start - due > LATE_USEC)
+                t->late++;
+        }
+        start = now_usec();
+        if ((n = fetch(reqs[i].url, &hit)) < 0) {
+            t->errors++;
+            continue;
+        }
+        t->latency[t->count++] = now_usec() - start;
+        t->bytes += n;
+        if (hit) {
+            t->hits++;
+            t->hit_bytes += n;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Print name_p50 .. name_max for n sorted latencies */
+static void print_latency(const char *name, uint64_t *all, long n) {
+    if (!n)
+        return;
+    printf("%s_p50 %lu\n%s_p90 %lu\n%s_p99 %lu\n%s_max %lu\n",
+           name, (unsigned long)all[n / 2], name, (unsigned long)all[n * 9 / 10],
+           name, (unsigned long)all[n * 99 / 100], name, (unsigned long)all[n - 1]);
+}
+
+/* The production figures the access log recorded, for comparison */
+static void report_production(void) {
+    uint64_t *all = Calloc(nreqs, sizeof(uint64_t)), bytes = 0, hit_bytes = 0;
+    long hits = 0, known = 0, n = 0, i;
+
+    for (i = 0; i < nreqs; i++) {
+        if (reqs[i].prod_outcome < 0)
+            continue;
+        known++;
+        bytes += reqs[i].size;
+        if (reqs[i].prod_outcome) {
+            hits++;
+            hit_bytes += reqs[i].size;
+        }
+        all[n++] = reqs[i].prod_usec;
+    }
+    if (known) {
+        qsort(all, n, sizeof(uint64_t), cmp_u64);
+        printf("prod_hit_ratio %.3f\nprod_byte_hit_ratio %.3f\n", (double)hits / known,
+               bytes ? (double)hit_bytes / bytes : 0.0);
+        print_latency("prod_latency_usec", all, n);
+    }
+    free(all);
+}
+
+int main(int argc, char **argv) {
+    int conns = 64, opt, i, listen_fd;
+    char *colon, *origin_port = NULL;
+    replay_thread_t *threads;
+    pthread_t *tids, tid;
+    uint64_t elapsed, *all, bytes = 0, hit_bytes = 0;
+    long count = 0, errors = 0, hits = 0, late = 0, j;
+
+    while ((opt = getopt(argc, argv, "m:s:c:o:")) != -1) {
+        switch (opt) {
+        case 'm':
+            max_rate = !strcmp(optarg, "max");
+            if (!max_rate && strcmp(optarg, "original"))
+                argc = 0;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'o':
+            origin_port = optarg;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind != 2 || conns < 1 || speed <= 0) {
+        fprintf(stderr, "usage: %s [-m original|max] [-s speed] [-c conns] [-o origin-port] "
+                "<host:port | unix:path> <trace>\n", argv[0]);
+        exit(1);
+    }
+
+    proxy_host = argv[optind];
+    proxy_port = "";
+    if (!IS_UNIX_ADDR(proxy_host)) {
+        if (!(colon = strrchr(proxy_host, ':')))
+            app_error("proxy must be host:port or unix:path");
+        *colon = '\0';
+        proxy_port = colon + 1;
+    }
+    read_trace(argv[optind + 1], origin_port);
+    if (!nreqs)
+        app_error("no GET requests in the trace");
+    Signal(SIGPIPE, SIG_IGN);
+    if (origin_port) {
+        listen_fd = Open_listenfd(origin_port);
+        Pthread_create(&tid, NULL, origin_thread, (void *)(long)listen_fd);
+    }
+
+    threads = Calloc(conns, sizeof(replay_thread_t));
+    tids = Calloc(conns, sizeof(pthread_t));
+    start_usec = now_usec();
+    for (i = 0; i < conns; i++) {
+        threads[i].latency = Calloc(nreqs, sizeof(uint64_t));
+        Pthread_create(&tids[i], NULL, replay_thread, &threads[i]);
+    }
+    for (i = 0; i < conns; i++)
+        Pthread_join(tids[i], NULL);
+    elapsed = now_usec() - start_usec;
+
+    all = Calloc(nreqs, sizeof(uint64_t));
+    for (i = 0; i < conns; i++) {
+        for (j = 0; j < threads[i].count; j++)
+            all[count++] = threads[i].latency[j];
+        errors += threads[i].errors;
+        hits += threads[i].hits;
+        late += threads[i].late;
+        bytes += threads[i].bytes;
+        hit_bytes += threads[i].hit_bytes;
+    }
+    qsort(all, count, sizeof(uint64_t), cmp_u64);
+
+    printf("requests %ld\nerrors %ld\nlate %ld\nseconds %.3f\n", count, errors, late, elapsed / 1e6);
+    printf("requests_per_sec %.1f\n", count * 1e6 / elapsed);
+    if (count)
+        printf("hit_ratio %.3f\nbyte_hit_ratio %.3f\n", (double)hits / count,
+               bytes ? (double)hit_bytes / bytes : 0.0);
+    print_latency("latency_usec", all, count);
+    report_production();
+    return errors ? 1 : 0;
+}
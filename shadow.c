@@ -0,0 +1,196 @@
+/*
+ * shadow.c - mirror a sample of requests to a shadow upstream
+ *
+ * Shadow threads start on the first mirrored request in each process,
+ * so prefork workers get their own. Lowering shadow_connections on a
+ * reload retires the extra threads once they are idle.
+ */
+#include "shadow.h"
+#include "http.h"
+#include "stats.h"
+
+/* A request waiting to be mirrored */
+typedef struct {
+    char *request;              /* Malloc'd request head */
+    size_t len;
+    int status;                 /* What the client got, -1 for no response */
+    uint64_t usec;              /* And how long it took */
+} shadow_job_t;
+
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shadow_ready = PTHREAD_COND_INITIALIZER;
+
+/* Settings, from the last configuration applied */
+static char shadow_host[CONFIG_HOSTLEN], shadow_port[16];
+static unsigned long shadow_target;     /* Bumped when host or port change */
+static int shadow_percent = 0;
+static int queue_limit, wanted_threads, shadow_timeout;
+
+static shadow_job_t queue[SHADOW_MAX_QUEUE];
+static int queue_head = 0, queue_len = 0;
+static char running[SHADOW_MAX_CONNECTIONS];
+static pid_t threads_pid;               /* Threads in running[] belong to this process */
+static unsigned long sample_count = 0;
+
+void shadow_configure(config_t *config) {
+    pthread_mutex_lock(&shadow_lock);
+    if (strcmp(shadow_host, config->shadow_host) || strcmp(shadow_port, config->shadow_port)) {
+        strcpy(shadow_host, config->shadow_host);
+        strcpy(shadow_port, config->shadow_port);
+        shadow_target++;
+    }
+    __atomic_store_n(&shadow_percent, shadow_host[0] ? config->shadow_percent : 0, __ATOMIC_RELAXED);
+    queue_limit = config->shadow_queue;
+    wanted_threads = config->shadow_connections;
+    shadow_timeout = config->upstream_timeout > 0 ? config->upstream_timeout : SHADOW_TIMEOUT;
+    pthread_cond_broadcast(&shadow_ready);
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+/* Whether to mirror the next request: shadow_percent of them, evenly spread */
+int shadow_sample(void) {
+    int percent = __atomic_load_n(&shadow_percent, __ATOMIC_RELAXED);
+    unsigned long n;
+
+    if (percent == 0)
+        return 0;
+    n = __atomic_fetch_add(&sample_count, 1, __ATOMIC_RELAXED);
+    return n * percent / 100 != (n + 1) * percent / 100;
+}
+
+/*
+ * exchange - Send one request on fd and read the response, discarding
+ *     it. Returns its status, or -1 on failure; *keep says whether the
+ *     connection can carry another request.
+ */
+static int exchange(int fd, shadow_job_t *job, int *keep) {
+    char buf[MAXBUF];
+    size_t got = 0, hdr_end = 0;
+    ssize_t n, length = -1;
+    int status = -1;
+
+    *keep = 0;
+    if (rio_writen(fd, job->request, job->len) != (ssize_t)job->len)
+        return -1;
+
+    /* Read the headers, then as much of the body as they promise (or to EOF) */
+    while (!hdr_end && got < sizeof(buf)) {
+        if ((n = read(fd, buf + got, sizeof(buf) - got)) <= 0)
+            return n == 0 && got ? http_status(buf, got) : -1;
+        got += n;
+        hdr_end = http_header_end(buf, got);
+    }
+    status = http_status(buf, got);
+    if (hdr_end) {
+        length = http_response_length(buf, hdr_end);
+        *keep = http_keep_alive(buf, hdr_end);
+    }
+    while (length < 0 || (ssize_t)got < length) {
+        n = read(fd, buf, length < 0 || length - got > sizeof(buf) ? sizeof(buf) : length - got);
+        if (n <= 0)
+            return length < 0 && n == 0 ? status : -1;
+        got += n;
+    }
+    return status;
+}
+
+static void *shadow_thread(void *arg) {
+    int id = (long)arg, fd = -1, keep, status, reused, timeout = 0;
+    char host[CONFIG_HOSTLEN], port[16];
+    unsigned long target = 0;
+    shadow_job_t job;
+    uint64_t start;
+    struct timeval tv;
+
+    Pthread_detach(pthread_self());
+    pthread_mutex_lock(&shadow_lock);
+    for (;;) {
+        while (!queue_len && id < wanted_threads)
+            pthread_cond_wait(&shadow_ready, &shadow_lock);
+        if (id >= wanted_threads)
+            break;
+        job = queue[queue_head];
+        queue_head = (queue_head + 1) % SHADOW_MAX_QUEUE;
+        queue_len--;
+        if (target != shadow_target && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        target = shadow_target;
+        strcpy(host, shadow_host);
+        strcpy(port, shadow_port);
+        timeout = shadow_timeout;
+        pthread_mutex_unlock(&shadow_lock);
+
+        /* A kept connection may have been closed by the shadow meanwhile: retry on a new one */
+        start = stats_now_usec();
+        status = -1;
+        do {
+            if ((reused = fd >= 0) == 0) {
+                if (!host[0] || (fd = open_clientfd(host, port)) < 0)
+                    break;
+                tv.tv_sec = timeout;
+                tv.tv_usec = 0;
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            }
+            status = exchange(fd, &job, &keep);
+            if (status < 0 || !keep) {
+                close(fd);
+                fd = -1;
+            }
+        } while (status < 0 && reused);
+
+        if (status < 0) {
+            STAT_ADD(shadow_errors, 1);
+        } else {
+            STAT_ADD(shadow_sent, 1);
+            STAT_ADD(shadow_usec, stats_now_usec() - start);
+            STAT_ADD(shadow_primary_usec, job.usec);
+            if (status != job.status)
+                STAT_ADD(shadow_mismatches, 1);
+        }
+        Free(job.request);
+        pthread_mutex_lock(&shadow_lock);
+    }
+    running[id] = 0;
+    pthread_mutex_unlock(&shadow_lock);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/*
+ * shadow_submit - Queue request (len bytes, malloc'd; this takes it)
+ *     for mirroring, with the status and latency the client saw. Drops
+ *     it if the queue is full.
+ */
+void shadow_submit(char *request, size_t len, int status, uint64_t usec) {
+    shadow_job_t *job;
+    pthread_t tid;
+    long i;
+
+    pthread_mutex_lock(&shadow_lock);
+    if (threads_pid != getpid()) {  /* Forked: the parent's threads aren't here */
+        memset(running, 0, sizeof(running));
+        queue_len = 0;
+        threads_pid = getpid();
+    }
+    for (i = 0; i < wanted_threads; i++)
+        if (!running[i] && pthread_create(&tid, NULL, shadow_thread, (void *)i) == 0)
+            running[i] = 1;
+
+    if (queue_len >= queue_limit) {
+        pthread_mutex_unlock(&shadow_lock);
+        STAT_ADD(shadow_dropped, 1);
+        Free(request);
+        return;
+    }
+    job = &queue[(queue_head + queue_len++) % SHADOW_MAX_QUEUE];
+    job->request = request;
+    job->len = len;
+    job->status = status;
+    job->usec = usec;
+    pthread_cond_signal(&shadow_ready);
+    pthread_mutex_unlock(&shadow_lock);
+}
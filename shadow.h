@@ -0,0 +1,26 @@
+/*
+ * shadow.h - mirror a sample of requests to a shadow upstream
+ *
+ * A sampled request is copied, after the client has its response, onto
+ * a bounded per-process queue. A few shadow threads send each one to the
+ * shadow upstream over connections of their own, which they keep open
+ * when the shadow allows it, read and discard the response, and compare
+ * its status and latency with what the client got. The client's request
+ * never waits on any of this: when the queue is full the copy is
+ * dropped and counted.
+ */
+#ifndef __SHADOW_H__
+#define __SHADOW_H__
+
+#include "csapp.h"
+#include "config.h"
+#include <stdint.h>
+
+/* Seconds a shadow may take to answer when upstream_timeout is 0 */
+#define SHADOW_TIMEOUT 10
+
+void shadow_configure(config_t *config);
+int shadow_sample(void);
+void shadow_submit(char *request, size_t len, int status, uint64_t usec);
+
+#endif /* __SHADOW_H__ */
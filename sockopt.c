@@ -0,0 +1,98 @@
+/*
+ * sockopt.c - apply named socket tuning profiles
+ *
+ * An option the kernel lacks or refuses (SO_BUSY_POLL without
+ * CAP_NET_ADMIN, say) is left at its default; listeners report it.
+ */
+#include "sockopt.h"
+#include <netinet/tcp.h>
+
+/* Set one int option if the profile gives it (value >= 0). Returns 1 if that failed, else 0. */
+static int set_int(int fd, int level, int name, int value, const char *what,
+                   const sock_profile_t *prof, int verbose) {
+    if (value < 0 || setsockopt(fd, level, name, &value, sizeof(value)) == 0)
+        return 0;
+    if (verbose)
+        fprintf(stderr, "profile %s: could not set %s: %s\n", prof->name, what, strerror(errno));
+    return 1;
+}
+
+/* Options that apply to both ends. Returns the number that failed. */
+static int apply_common(int fd, const sock_profile_t *prof, int tcp, int verbose) {
+    int failed = 0;
+
+    failed += set_int(fd, SOL_SOCKET, SO_RCVBUF, prof->rcvbuf, "rcvbuf", prof, verbose);
+    failed += set_int(fd, SOL_SOCKET, SO_SNDBUF, prof->sndbuf, "sndbuf", prof, verbose);
+#ifdef SO_BUSY_POLL
+    failed += set_int(fd, SOL_SOCKET, SO_BUSY_POLL, prof->busy_poll, "busy_poll", prof, verbose);
+#endif
+    if (!tcp)
+        return failed;
+
+    failed += set_int(fd, IPPROTO_TCP, TCP_NODELAY, prof->nodelay, "nodelay", prof, verbose);
+#ifdef TCP_NOTSENT_LOWAT
+    failed += set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, prof->notsent_lowat, "notsent_lowat", prof, verbose);
+#endif
+    if (prof->keepidle >= 0) {
+        failed += set_int(fd, SOL_SOCKET, SO_KEEPALIVE, prof->keepidle > 0, "keepalive", prof, verbose);
+        if (prof->keepidle > 0) {
+            failed += set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, prof->keepidle, "keepalive idle", prof, verbose);
+            failed += set_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, prof->keepintvl, "keepalive interval", prof, verbose);
+            failed += set_int(fd, IPPROTO_TCP, TCP_KEEPCNT, prof->keepcnt, "keepalive count", prof, verbose);
+        }
+    }
+    return failed;
+}
+
+static int is_tcp(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    return getsockname(fd, (SA *)&addr, &len) == 0 &&
+        (addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
+}
+
+/*
+ * sockopt_apply_listener - Apply prof (which may be NULL) to a listening
+ *     socket and set its backlog: the profile's if it has one, else
+ *     backlog. Returns the number of options that could not be set.
+ */
+int sockopt_apply_listener(int fd, const sock_profile_t *prof, int backlog) {
+    int tcp = is_tcp(fd), failed = 0;
+
+    if (prof) {
+        failed = apply_common(fd, prof, tcp, 1);
+        if (tcp) {
+            failed += set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, prof->defer_accept, "defer_accept", prof, 1);
+#ifdef TCP_FASTOPEN
+            failed += set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, prof->fastopen, "fastopen", prof, 1);
+#endif
+        }
+        if (prof->backlog > 0)
+            backlog = prof->backlog;
+    }
+
+    /* listen() on a listening socket just updates its backlog */
+    if (listen(fd, backlog) < 0) {
+        fprintf(stderr, "Could not set listen backlog: %s\n", strerror(errno));
+        failed++;
+    }
+    return failed;
+}
+
+/*
+ * sockopt_setup_upstream - open_clientfd_setup callback applying the
+ *     sock_profile_t at prof to an origin socket before it connects.
+ *     Failures are silent: this runs for every miss.
+ */
+void sockopt_setup_upstream(int fd, void *prof) {
+    const sock_profile_t *p = prof;
+    int tcp = is_tcp(fd);
+
+    apply_common(fd, p, tcp, 0);
+#ifdef TCP_FASTOPEN_CONNECT
+    /* The request then rides on the SYN when the origin has given us a cookie */
+    if (tcp && p->fastopen > 0)
+        set_int(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "fastopen", p, 0);
+#endif
+}
@@ -0,0 +1,19 @@
+/*
+ * sockopt.h - apply named socket tuning profiles
+ *
+ * A profile (see sock_profile_t in config.h) is applied to the listening
+ * socket once, when the configuration is loaded or reloaded, and is
+ * inherited by every connection accepted on it; an upstream profile is
+ * applied to each origin socket before it connects. TCP options are
+ * skipped on Unix-domain sockets.
+ */
+#ifndef __SOCKOPT_H__
+#define __SOCKOPT_H__
+
+#include "csapp.h"
+#include "config.h"
+
+int sockopt_apply_listener(int fd, const sock_profile_t *prof, int backlog);
+void sockopt_setup_upstream(int fd, void *prof);
+
+#endif /* __SOCKOPT_H__ */
@@ -0,0 +1,140 @@
+/*
+ * stats.c - shared proxy counters and the access log
+ */
+#include "stats.h"
+
+proxy_stats_t *proxy_stats;
+
+/* Access log descriptor; replaced with dup2 so writers never see it closed */
+static int log_fd = -1;
+
+/* Map the counters; must run before workers are forked */
+void stats_init(void) {
+    proxy_stats = Mmap(NULL, sizeof(proxy_stats_t), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(proxy_stats, 0, sizeof(proxy_stats_t));
+    if ((log_fd = dup(STDERR_FILENO)) < 0)
+        unix_error("dup error");
+}
+
+/* Send the access log to path, or to stderr if path is NULL or empty */
+void stats_set_log(const char *path) {
+    int fd;
+
+    if (!path || !*path) {
+        dup2(STDERR_FILENO, log_fd);
+        return;
+    }
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        fprintf(stderr, "Could not open access log %s: %s\n", path, strerror(errno));
+        return;
+    }
+    dup2(fd, log_fd);
+    close(fd);
+}
+
+uint64_t stats_now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* CPU time the calling thread has used */
+uint64_t stats_thread_cpu_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char *stats_outcome_name(int outcome) {
+    switch (outcome) {
+    case OUTCOME_HIT:  return "HIT";
+    case OUTCOME_MISS: return "MISS";
+    default:           return "ERROR";
+    }
+}
+
+static const char *size_class_names[SIZE_CLASSES] = {"<1K", "<10K", "<100K", "<1M", ">=1M"};
+static const size_t size_class_limits[SIZE_CLASSES - 1] = {1 << 10, 10 << 10, 100 << 10, 1 << 20};
+
+const char *stats_size_class_name(int class) {
+    return size_class_names[class];
+}
+
+/* Count one request of bytes that took usec in its size class's histogram */
+void stats_record_latency(size_t bytes, uint64_t usec) {
+    int class, bucket;
+
+    for (class = 0; class < SIZE_CLASSES - 1 && bytes >= size_class_limits[class]; class++)
+        ;
+    for (bucket = 0; bucket < LATENCY_BUCKETS - 1 && usec >= ((uint64_t)2 << bucket); bucket++)
+        ;
+    STAT_ADD(latency[class][bucket], 1);
+}
+
+/*
+ * stats_log_request - Append one access log line:
+ *
+ *   <unix time.ms> <client> <method> <uri> <outcome> <bytes> <usec>
+ *
+ * Each line goes out in a single write to an O_APPEND descriptor, so
+ * lines from different workers don't interleave.
+ */
+void stats_log_request(const char *client, const char *method, const char *uri,
+                       int outcome, size_t bytes, uint64_t usec) {
+    char line[MAXLINE + 256];
+    struct timeval now;
+    int n;
+
+    gettimeofday(&now, NULL);
+    n = snprintf(line, sizeof(line), "%ld.%03ld %s %s %s %s %lu %lu\n",
+                 (long)now.tv_sec, (long)now.tv_usec / 1000, client, method, uri,
+                 stats_outcome_name(outcome), (unsigned long)bytes, (unsigned long)usec);
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+    if (write(log_fd, line, n) < 0)
+        ;  /* Nothing sensible to do if the log is unwritable */
+}
+
+/* The cost slot named route, claiming a free one if it has none; NULL if all are taken */
+static route_cost_t *route_cost(const char *route) {
+    route_cost_t *rc;
+    int i, state;
+
+    for (i = 0; i < COST_ROUTES; i++) {
+        rc = &proxy_stats->costs[i];
+        state = 0;
+        if (__atomic_compare_exchange_n(&rc->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            snprintf(rc->name, sizeof(rc->name), "%s", route);
+            __atomic_store_n(&rc->state, 2, __ATOMIC_RELEASE);
+            return rc;
+        }
+        /* Another process or thread is naming it: it may be this route */
+        while (__atomic_load_n(&rc->state, __ATOMIC_ACQUIRE) == 1)
+            sched_yield();
+        if (!strcmp(rc->name, route))
+            return rc;
+    }
+    return NULL;
+}
+
+/* Add one request's cost to its route's totals for its outcome */
+void stats_record_cost(const char *route, int outcome, const request_cost_t *cost) {
+    route_cost_t *rc = route_cost(route);
+    request_cost_t *total;
+
+    if (!rc)
+        return;
+    total = &rc->by_outcome[outcome];
+    __atomic_fetch_add(&total->requests, cost->requests, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->cpu_usec, cost->cpu_usec, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->lookup_cpu_usec, cost->lookup_cpu_usec, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->reads, cost->reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->writes, cost->writes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->connects, cost->connects, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->bytes, cost->bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,193 @@
+/*
+ * stats.h - proxy-wide counters and instrumentation switches
+ *
+ * The counters live in an anonymous shared mapping created before any
+ * worker is forked, so in prefork mode every worker adds to the same
+ * totals and the admin socket reports the whole proxy. Updates are
+ * relaxed atomic adds; readers get a recent, not a consistent, view.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include "config.h"
+#include <stdint.h>
+
+/* Request outcomes, as counted and logged */
+#define OUTCOME_HIT   0
+#define OUTCOME_MISS  1
+#define OUTCOME_ERROR 2
+#define OUTCOMES      3
+
+/* Latency histograms: by response size, in power-of-two microsecond buckets */
+#define SIZE_CLASSES    5       /* Under 1K, 10K, 100K, 1M, and larger */
+#define LATENCY_BUCKETS 24      /* Bucket i: under 2^(i+1) usec; the last takes the rest */
+
+/*
+ * What requests cost while instrumented, summed: thread CPU time in all
+ * and up to the cache lookup's verdict, and the I/O system calls made
+ * on the request's thread (see syscall_counts). Fragment fetches for
+ * ESI run on threads of their own and are not included.
+ */
+typedef struct {
+    uint64_t requests;
+    uint64_t cpu_usec;
+    uint64_t lookup_cpu_usec;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t connects;
+    uint64_t bytes;
+} request_cost_t;
+
+/*
+ * Costs of one route by outcome. A slot is claimed for a route name the
+ * first time it is seen; "-" stands for requests no route matched. Once
+ * every slot is taken, routes new since then are not counted.
+ */
+#define COST_ROUTES (MAX_ROUTES + 1)
+
+typedef struct {
+    int state;                  /* 0 free, 1 being named, 2 named */
+    char name[CONFIG_NAMELEN];
+    request_cost_t by_outcome[OUTCOMES];
+} route_cost_t;
+
+typedef struct {
+    int instrument;             /* Write an access log line per request */
+
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t errors;
+    uint64_t bytes_out;         /* Response bytes written to clients */
+    uint64_t usec_total;        /* Summed request latency while instrumented */
+
+    /*
+     * Clients that left mid-response. Every byte fetched from the origin
+     * but never delivered ends up either wasted (dropped) or salvaged
+     * (cached by finishing the fetch); saved is what cancelling spared
+     * us from fetching at all, when the length was known.
+     */
+    uint64_t client_aborts;
+    uint64_t aborts_cancelled;
+    uint64_t aborts_finished;
+    uint64_t abort_wasted_bytes;
+    uint64_t abort_salvaged_bytes;
+    uint64_t abort_saved_bytes;
+
+    /* MSG_ZEROCOPY sends, and those the kernel ended up copying anyway */
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_bytes;
+    uint64_t zerocopy_copied;
+    uint64_t zerocopy_stuck;    /* Completions never came: buffer or pin leaked */
+
+    /* Output scheduler: quanta that had to wait for a send slot, and
+     * slots given up while a client's socket was full */
+    uint64_t sched_waits;
+    uint64_t sched_wait_usec;
+    uint64_t sched_yields;
+
+    /*
+     * Shadow mirroring: requests copied to the shadow upstream, dropped
+     * (queue full), and failed; of those answered, how many got another
+     * status than the client did, and the summed latencies of both sides.
+     */
+    uint64_t shadow_sent;
+    uint64_t shadow_dropped;
+    uint64_t shadow_errors;
+    uint64_t shadow_mismatches;
+    uint64_t shadow_usec;
+    uint64_t shadow_primary_usec;
+
+    /* Core mode: connections served by the core that accepted them, handed
+     * to the owning core over its ring, or posted to its mailbox */
+    uint64_t core_local;
+    uint64_t core_handoffs;
+    uint64_t core_mailed;
+
+    /* Parent proxies: misses sent to a parent, of those on a pooled
+     * connection, parents skipped as unreachable, misses for bypassed
+     * hosts sent direct, and pooled connections the parent had closed
+     * (retried on a new one) */
+    uint64_t parent_requests;
+    uint64_t parent_reused;
+    uint64_t parent_failovers;
+    uint64_t parent_bypassed;
+    uint64_t parent_retries;
+
+    /*
+     * Thread pool: threads running (all processes), resizes, and per
+     * connection served, its time queued, time on a thread, and of that
+     * the time off the CPU.
+     */
+    uint64_t pool_threads;
+    uint64_t pool_grows;
+    uint64_t pool_shrinks;
+    uint64_t pool_jobs;
+    uint64_t pool_wait_usec;
+    uint64_t pool_busy_usec;
+    uint64_t pool_blocked_usec;
+
+    /* Adaptive max_object_size: decisions taken, and those that changed it */
+    uint64_t adapt_decisions;
+    uint64_t adapt_changes;
+
+    /* Cache autosizing: the cgroup's memory limit and usage at the last
+     * check (0 if unknown), stalls reported by PSI, and budget changes */
+    uint64_t mem_limit;
+    uint64_t mem_usage;
+    uint64_t mem_stalls;
+    uint64_t mem_shrinks;
+    uint64_t mem_grows;
+
+    /* Vary: variants cached, variants purged to bound a URL's list, and
+     * responses not cached for Vary: * */
+    uint64_t vary_stores;
+    uint64_t vary_evictions;
+    uint64_t vary_uncacheable;
+
+    /* ESI: pages assembled, fragments fetched from origin, fragments
+     * served from the cache, and fragments left out for failing */
+    uint64_t esi_pages;
+    uint64_t esi_fragments;
+    uint64_t esi_fragment_hits;
+    uint64_t esi_fragment_errors;
+
+    /* Redirects cached (permanent, or with a lifetime), and hops followed for clients */
+    uint64_t redirects_cached;
+    uint64_t redirects_followed;
+
+    /* HTTP/2 upstreams: connections opened, streams sent, streams reset
+     * because their client left, streams the upstream failed, and misses
+     * that found every connection full until their deadline */
+    uint64_t h2_connections;
+    uint64_t h2_streams;
+    uint64_t h2_cancelled;
+    uint64_t h2_errors;
+    uint64_t h2_timeouts;
+
+    /* Hits and misses by the cache class of the request's route */
+    uint64_t class_hits[CACHE_CLASSES];
+    uint64_t class_misses[CACHE_CLASSES];
+
+    uint64_t latency[SIZE_CLASSES][LATENCY_BUCKETS];
+    route_cost_t costs[COST_ROUTES];
+} proxy_stats_t;
+
+extern proxy_stats_t *proxy_stats;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&proxy_stats->field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field)    __atomic_load_n(&proxy_stats->field, __ATOMIC_RELAXED)
+
+void stats_init(void);
+void stats_set_log(const char *path);
+uint64_t stats_now_usec(void);
+uint64_t stats_thread_cpu_usec(void);
+void stats_log_request(const char *client, const char *method, const char *uri,
+                       int outcome, size_t bytes, uint64_t usec);
+const char *stats_outcome_name(int outcome);
+void stats_record_latency(size_t bytes, uint64_t usec);
+const char *stats_size_class_name(int class);
+void stats_record_cost(const char *route, int outcome, const request_cost_t *cost);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,260 @@
+/*
+ * upgrade.c - hand the listening socket and cache to a new proxy binary
+ *
+ * Handoff protocol over a socketpair (old end <-> new end):
+ *
+ *   old -> new   struct handoff_msg, with the descriptors attached as
+ *                one SCM_RIGHTS control message
+ *   new -> old   one byte once the new process is accepting
+ *
+ * If the new process cannot be started, exits, or does not answer
+ * within UPGRADE_TIMEOUT seconds, the old process simply keeps serving.
+ */
+#include "upgrade.h"
+#include <stdint.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define HANDOFF_MAGIC 0x55505244  /* "UPRD" */
+
+struct handoff_msg {
+    uint32_t magic;
+    int32_t nfds;
+    int32_t kinds[UPGRADE_MAX_FDS];
+};
+
+static char exec_path[MAXLINE];    /* Binary to exec on upgrade */
+static char **exec_argv;           /* Arguments it was started with */
+static int ready_fd = -1;          /* New process: end to report readiness on */
+
+/*
+ * upgrade_init - Remember how this process was started, resolving the
+ *     binary path now: by upgrade time the cwd or PATH may differ.
+ */
+void upgrade_init(int argc, char **argv) {
+    char *path, *dir, candidate[MAXLINE];
+
+    exec_argv = argv;
+    if (strchr(argv[0], '/')) {
+        if (!realpath(argv[0], exec_path))
+            snprintf(exec_path, sizeof(exec_path), "%s", argv[0]);
+        return;
+    }
+
+    snprintf(exec_path, sizeof(exec_path), "%s", argv[0]);
+    if (!(path = getenv("PATH")) || !(path = strdup(path)))
+        return;
+    for (dir = strtok(path, ":"); dir; dir = strtok(NULL, ":")) {
+        snprintf(candidate, sizeof(candidate), "%s/%s", dir, argv[0]);
+        if (access(candidate, X_OK) == 0) {
+            snprintf(exec_path, sizeof(exec_path), "%s", candidate);
+            break;
+        }
+    }
+    free(path);
+}
+
+/* Send the handoff message with its descriptors attached */
+static int send_handoff(int sock, upgrade_fds_t *handoff) {
+    struct handoff_msg msg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = HANDOFF_MAGIC;
+    msg.nfds = handoff->nfds;
+    for (i = 0; i < handoff->nfds; i++)
+        msg.kinds[i] = handoff->kinds[i];
+
+    memset(&mh, 0, sizeof(mh));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * handoff->nfds);
+
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * handoff->nfds);
+    memcpy(CMSG_DATA(cm), handoff->fds, sizeof(int) * handoff->nfds);
+
+    return sendmsg(sock, &mh, 0) == sizeof(msg) ? 0 : -1;
+}
+
+static int recv_handoff(int sock, upgrade_fds_t *inherited) {
+    struct handoff_msg msg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    int i;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(msg) || msg.magic != HANDOFF_MAGIC ||
+        msg.nfds < 0 || msg.nfds > UPGRADE_MAX_FDS)
+        return -1;
+    if (!(cm = CMSG_FIRSTHDR(&mh)) || cm->cmsg_level != SOL_SOCKET ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(int) * msg.nfds))
+        return -1;
+
+    inherited->nfds = msg.nfds;
+    memcpy(inherited->fds, CMSG_DATA(cm), sizeof(int) * msg.nfds);
+    for (i = 0; i < msg.nfds; i++)
+        inherited->kinds[i] = msg.kinds[i];
+    return 0;
+}
+
+/*
+ * close_other_fds - Close every descriptor from 3 up except keep, in a
+ *     freshly forked child (only async-signal-safe calls). One
+ *     close_range call where the kernel has it, since walking up to a
+ *     large nofile limit one close at a time takes seconds.
+ */
+static void close_other_fds(int keep, long maxfd) {
+    long fd;
+
+#ifdef SYS_close_range
+    if ((keep == 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0) &&
+        syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+        return;
+#endif
+    for (fd = 3; fd < maxfd; fd++)
+        if (fd != keep)
+            close(fd);
+}
+
+/*
+ * upgrade_spawn - Start the new binary and hand it the descriptors.
+ *     Returns 0 once it reports that it is accepting connections (the
+ *     caller should then stop accepting and drain), -1 if the upgrade
+ *     failed and the caller should carry on serving.
+ */
+int upgrade_spawn(upgrade_fds_t *handoff) {
+    int sv[2], n, nenv;
+    long maxfd;
+    char env_entry[64], **envp, ready;
+    struct pollfd pfd;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "upgrade: socketpair failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Build the environment before forking: only exec-safe calls in the child */
+    snprintf(env_entry, sizeof(env_entry), "%s=%d", UPGRADE_ENV, sv[1]);
+    for (nenv = 0; environ[nenv]; nenv++)
+        ;
+    envp = Malloc((nenv + 2) * sizeof(char *));
+    for (n = 0; n < nenv; n++)
+        envp[n] = environ[n];
+    envp[nenv] = env_entry;
+    envp[nenv + 1] = NULL;
+    maxfd = sysconf(_SC_OPEN_MAX);
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "upgrade: fork failed: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        free(envp);
+        return -1;
+    }
+    if (pid == 0) {
+        /*
+         * Drop every other inherited descriptor, in particular client
+         * connections still being served: the old process must be able
+         * to close them for real.
+         */
+        close_other_fds(sv[1], maxfd);
+        execve(exec_path, exec_argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    close(sv[1]);
+    fprintf(stderr, "upgrade: started %s as pid %d\n", exec_path, (int)pid);
+
+    if (send_handoff(sv[0], handoff) < 0) {
+        fprintf(stderr, "upgrade: handoff to pid %d failed\n", (int)pid);
+        goto fail;
+    }
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    while ((n = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0 || read(sv[0], &ready, 1) != 1) {
+        fprintf(stderr, "upgrade: pid %d did not become ready\n", (int)pid);
+        goto fail;
+    }
+
+    close(sv[0]);
+    fprintf(stderr, "upgrade: pid %d is accepting, draining\n", (int)pid);
+    return 0;
+
+ fail:
+    close(sv[0]);
+    kill(pid, SIGTERM);
+    /* Reap it here: a standalone proxy has no supervisor to do so */
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/*
+ * upgrade_inherit - In a process started by upgrade_spawn, receive the
+ *     handed-over descriptors. Returns 1 if descriptors were inherited,
+ *     0 if this is a normal start, -1 if the handoff failed.
+ */
+int upgrade_inherit(upgrade_fds_t *inherited) {
+    char *env = getenv(UPGRADE_ENV);
+    int sock;
+
+    inherited->nfds = 0;
+    if (!env)
+        return 0;
+    sock = atoi(env);
+    unsetenv(UPGRADE_ENV);
+
+    if (recv_handoff(sock, inherited) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    ready_fd = sock;
+    return 1;
+}
+
+/* Return the first inherited descriptor of the given kind, or -1 */
+int upgrade_find_fd(upgrade_fds_t *inherited, int kind) {
+    int i;
+
+    for (i = 0; i < inherited->nfds; i++)
+        if (inherited->kinds[i] == kind)
+            return inherited->fds[i];
+    return -1;
+}
+
+/* Tell the old process we are accepting; a no-op on a normal start */
+void upgrade_ready(void) {
+    if (ready_fd < 0)
+        return;
+    if (write(ready_fd, "R", 1) != 1)
+        fprintf(stderr, "upgrade: could not report readiness: %s\n", strerror(errno));
+    close(ready_fd);
+    ready_fd = -1;
+}
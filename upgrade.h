@@ -0,0 +1,43 @@
+/*
+ * upgrade.h - zero-downtime binary upgrade
+ *
+ * On SIGUSR2 the running proxy forks and execs its own binary path
+ * (which may by now hold a new build) with the same arguments, and hands
+ * it the listening socket and the cache memfd over a Unix socket using
+ * SCM_RIGHTS. Once the new process reports that it is accepting, the
+ * old one stops accepting, drains its in-flight requests and exits.
+ * The cache region is shared rather than copied, so no cached object is
+ * lost across the upgrade.
+ */
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "csapp.h"
+
+/* Environment variable naming the handoff socket in the new process */
+#define UPGRADE_ENV "PROXY_UPGRADE_FD"
+
+/* Descriptors that can be handed over */
+#define UPGRADE_FD_LISTEN 1
+#define UPGRADE_FD_CACHE  2
+#define UPGRADE_MAX_FDS   8
+
+/* Seconds the old process waits for the new one to become ready */
+#define UPGRADE_TIMEOUT 10
+
+typedef struct {
+    int nfds;
+    int kinds[UPGRADE_MAX_FDS];
+    int fds[UPGRADE_MAX_FDS];
+} upgrade_fds_t;
+
+/* Old process side */
+void upgrade_init(int argc, char **argv);
+int upgrade_spawn(upgrade_fds_t *handoff);
+
+/* New process side */
+int upgrade_inherit(upgrade_fds_t *inherited);
+int upgrade_find_fd(upgrade_fds_t *inherited, int kind);
+void upgrade_ready(void);
+
+#endif /* __UPGRADE_H__ */
@@ -0,0 +1,133 @@
+/*
+ * vary.c - cache variants for responses with Vary
+ */
+#include "vary.h"
+#include "stats.h"
+
+/* Append s (n bytes) lowercased and without whitespace to out (outsize bytes, used *len) */
+static void append_normal(char *out, size_t outsize, size_t *len, const char *s, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n && *len + 1 < outsize; i++)
+        if (!isspace((unsigned char)s[i]))
+            out[(*len)++] = tolower((unsigned char)s[i]);
+    out[*len] = '\0';
+}
+
+/* The value of header name (n bytes) among the request headers, or NULL; its length in *vlen */
+static const char *find_header(const char *headers, const char *name, size_t n, size_t *vlen) {
+    const char *p, *eol;
+
+    for (p = headers; *p; p = eol + 1) {
+        if (!(eol = strchr(p, '\n')))
+            eol = p + strlen(p) - 1;
+        if (!strncasecmp(p, name, n) && p[n] == ':') {
+            *vlen = eol + 1 - (p + n + 1);
+            return p + n + 1;
+        }
+        if (!eol[1])
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * variant_hash - Hash the values the request headers give the names
+ *     (space-separated, as on a list's first line, n bytes).
+ */
+static uint64_t variant_hash(const char *names, size_t n, const char *headers) {
+    char buf[MAXBUF];
+    const char *name, *end = names + n, *value;
+    size_t len = 0, name_len, vlen;
+
+    buf[0] = '\0';
+    for (name = names; name < end; name += name_len + 1) {
+        name_len = strcspn(name, " \n");
+        if (name + name_len > end)
+            name_len = end - name;
+        append_normal(buf, sizeof(buf), &len, name, name_len);
+        append_normal(buf, sizeof(buf), &len, ":", 1);
+        if ((value = find_header(headers, name, name_len, &vlen)))
+            append_normal(buf, sizeof(buf), &len, value, vlen);
+        append_normal(buf, sizeof(buf), &len, "\n", 1);
+        if (name[name_len] == '\n')
+            break;
+    }
+    return cache_key_hash(buf);
+}
+
+/*
+ * vary_key - Build in key (VARY_KEYLEN bytes) the secondary key of the
+ *     variant of uri that the request headers select, by the variant
+ *     list cached under uri (list_len bytes).
+ */
+void vary_key(const char *uri, const char *list, size_t list_len, const char *headers, char *key) {
+    const char *eol = memchr(list, '\n', list_len);
+
+    sprintf(key, "%s %016lx", uri,
+            (unsigned long)variant_hash(list, eol ? (size_t)(eol - list) : list_len, headers));
+}
+
+/*
+ * vary_store - Cache a response whose Vary header is vary as the
+ *     variant the request headers select, and put it at the head of
+ *     uri's variant list, purging the oldest beyond VARY_MAX_VARIANTS.
+ *     If the names varied on have changed, the list starts over.
+ */
+void vary_store(cache_t *cache, const char *uri, const char *vary, const char *headers,
+                const char *object, size_t size, const cache_meta_t *meta) {
+    char names[MAXLINE], list[VARY_LISTLEN], old[VARY_LISTLEN], key[VARY_KEYLEN], hex[17];
+    const char *p, *end;
+    size_t len = 0, names_len, n;
+    ssize_t old_len;
+    uint64_t hash;
+    cache_meta_t list_meta;
+    int count = 1;
+
+    if (!strcmp(vary, "*")) {
+        STAT_ADD(vary_uncacheable, 1);
+        return;
+    }
+    names[0] = '\0';
+    for (p = vary; *p; p += n + (p[n] == ',')) {
+        n = strcspn(p, ",");
+        if (len && len + 1 < sizeof(names))
+            names[len++] = ' ';
+        append_normal(names, sizeof(names), &len, p, n);
+    }
+    names_len = len;
+    hash = variant_hash(names, names_len, headers);
+    sprintf(hex, "%016lx", (unsigned long)hash);
+    sprintf(key, "%s %s", uri, hex);
+    cache_insert(cache, key, object, size, meta);
+    STAT_ADD(vary_stores, 1);
+
+    /* The new list: the names, this variant, then the others listed under the same names */
+    len = sprintf(list, "%s\n%s\n", names, hex);
+    old_len = cache_get_variants(cache, uri, old, sizeof(old) - 1);
+    if (old_len > (ssize_t)names_len && !memcmp(old, names, names_len) && old[names_len] == '\n') {
+        old[old_len] = '\0';
+        end = old + old_len;
+        for (p = old + names_len + 1; p + 17 <= end; p += 17) {
+            if (!strncmp(p, hex, 16))
+                continue;
+            if (count++ < VARY_MAX_VARIANTS) {
+                memcpy(list + len, p, 17);
+                len += 17;
+            } else {
+                sprintf(key, "%s %.16s", uri, p);
+                cache_purge(cache, key);
+                STAT_ADD(vary_evictions, 1);
+            }
+        }
+    }
+    list[len] = '\0';
+
+    list_meta.hdr_len = 0;
+    list_meta.status = 0;
+    list_meta.initial_age = 0;
+    list_meta.flags = CACHE_VARIANTS;
+    list_meta.expires = 0;
+    list_meta.cache_class = meta->cache_class;
+    cache_insert(cache, uri, list, len, &list_meta);
+}
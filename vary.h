@@ -0,0 +1,34 @@
+/*
+ * vary.h - cache variants for responses with Vary
+ *
+ * A response with, say, "Vary: Accept-Encoding" is cached under a
+ * secondary key: its URI, a space, and 16 hex digits of a hash of the
+ * varied request headers' values as the fetching request had them
+ * (lowercased, without whitespace; absent counts as empty). A space
+ * never occurs in a request URI, so these keys can't collide with one.
+ *
+ * The URI's own key then holds its variant list (CACHE_VARIANTS): the
+ * varied header names on the first line, then the hashes of the newest
+ * VARY_MAX_VARIANTS variants, newest first. Storing one more purges the
+ * oldest, so a URL never holds more. A lookup that finds a list reads
+ * the request's headers, builds the secondary key from the names and
+ * looks that up.
+ *
+ * "Vary: *" responses are not cached. Neither are Vary responses in
+ * core mode, where the list could only be updated on the owning core.
+ */
+#ifndef __VARY_H__
+#define __VARY_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define VARY_MAX_VARIANTS 8
+#define VARY_KEYLEN (MAXLINE + 24)      /* A URI, a space and 16 hex digits */
+#define VARY_LISTLEN (MAXLINE + VARY_MAX_VARIANTS * 17)
+
+void vary_key(const char *uri, const char *list, size_t list_len, const char *headers, char *key);
+void vary_store(cache_t *cache, const char *uri, const char *vary, const char *headers,
+                const char *object, size_t size, const cache_meta_t *meta);
+
+#endif /* __VARY_H__ */
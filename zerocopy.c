@@ -0,0 +1,121 @@
+/*
+ * zerocopy.c - MSG_ZEROCOPY sends and error-queue completions
+ *
+ * Where the kernel has no SO_ZEROCOPY, zc_init leaves the socket in
+ * copy mode and zc_send is a plain send loop.
+ */
+#include "zerocopy.h"
+#include <poll.h>
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY 1
+#endif
+
+/* Turn on zerocopy sends for fd. Returns 0 if enabled, -1 if copying. */
+int zc_init(zc_sock_t *zs, int fd) {
+    int one = 1;
+
+    memset(zs, 0, sizeof(*zs));
+    zs->fd = fd;
+#ifdef HAVE_ZEROCOPY
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+        zs->enabled = 1;
+#else
+    (void)one;
+#endif
+    return zs->enabled ? 0 : -1;
+}
+
+#ifdef HAVE_ZEROCOPY
+/* Read whatever notifications are queued. Returns how many sends they completed. */
+static int zc_read_errqueue(zc_sock_t *zs) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    uint32_t n;
+    int done = 0;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zs->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return done;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* Sends ee_info through ee_data, inclusive */
+            n = serr->ee_data - serr->ee_info + 1;
+            zs->completed += n;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zs->copied += n;
+            done += n;
+        }
+    }
+}
+#endif
+
+/*
+ * zc_reap - Wait until the kernel is done with every zerocopy send made
+ *     on zs. Returns 0, or -1 if that took longer than timeout_ms (the
+ *     buffers involved must then be treated as still in use).
+ */
+int zc_reap(zc_sock_t *zs, int timeout_ms) {
+#ifdef HAVE_ZEROCOPY
+    struct pollfd pfd;
+
+    while (zs->completed != zs->sent) {
+        if (zc_read_errqueue(zs) > 0)
+            continue;
+        pfd.fd = zs->fd;
+        pfd.events = 0;  /* POLLERR is always reported */
+        if (poll(&pfd, 1, timeout_ms) == 0)
+            return -1;
+        if (!(pfd.revents & POLLERR))
+            usleep(1000);  /* Hung up with completions still to come: don't spin */
+    }
+#endif
+    return 0;
+}
+
+/*
+ * zc_send - Send all len bytes of buf, with MSG_ZEROCOPY if enabled.
+ *     buf must not change until zc_reap says the kernel is done with it.
+ *     Returns len, or -1 on error (including a send timeout). With
+ *     MSG_DONTWAIT in flags it stops early once the socket is full,
+ *     returning the bytes sent so far.
+ */
+ssize_t zc_send(zc_sock_t *zs, const void *buf, size_t len, int flags) {
+    size_t done = 0;
+    ssize_t n;
+
+#ifdef HAVE_ZEROCOPY
+    if (zs->enabled)
+        flags |= MSG_ZEROCOPY;
+#endif
+    while (done < len) {
+        COUNT_SYSCALL(writes);
+        if ((n = send(zs->fd, (const char *)buf + done, len - done, flags)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return done;
+#ifdef HAVE_ZEROCOPY
+            /* Out of memory to pin pages: let earlier sends complete, then retry */
+            if (errno == ENOBUFS && zs->enabled && zs->completed != zs->sent &&
+                zc_reap(zs, ZEROCOPY_WAIT * 1000) == 0)
+                continue;
+#endif
+            return -1;
+        }
+        if (zs->enabled)
+            zs->sent++;
+        done += n;
+    }
+    return len;
+}
@@ -0,0 +1,36 @@
+/*
+ * zerocopy.h - MSG_ZEROCOPY sends with completion tracking
+ *
+ * A zerocopy send pins the caller's pages instead of copying them into
+ * the socket buffer, so the buffer must stay untouched until the kernel
+ * reports, on the socket's error queue, that it is done with it. Each
+ * successful send call gets the next number in a per-socket sequence;
+ * a notification covers a range of those numbers. The caller sends,
+ * then reaps every outstanding notification before reusing the memory
+ * (or releasing the cache entry it points into).
+ *
+ * The kernel may still fall back to copying (always on loopback); the
+ * notification then says so, and the send was simply a normal one.
+ */
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* Seconds to wait for outstanding completions before giving up */
+#define ZEROCOPY_WAIT 10
+
+typedef struct {
+    int fd;
+    int enabled;            /* SO_ZEROCOPY is set: sends use MSG_ZEROCOPY */
+    uint32_t sent;          /* Zerocopy send calls made */
+    uint32_t completed;     /* Of those, ones the kernel is done with */
+    uint32_t copied;        /* Of those, ones the kernel copied after all */
+} zc_sock_t;
+
+int zc_init(zc_sock_t *zs, int fd);
+ssize_t zc_send(zc_sock_t *zs, const void *buf, size_t len, int flags);
+int zc_reap(zc_sock_t *zs, int timeout_ms);
+
+#endif /* __ZEROCOPY_H__ */